@@ -0,0 +1,7 @@
+# bench.mk
+# Jeremy Barnes, 22 March 2010
+# Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+#
+# Benchmarks.  Build with "make mvcc_bench"; run with --help for the options.
+
+$(eval $(call program,mvcc_bench,jmvcc mmap boost_thread-mt,mvcc_bench.cc))
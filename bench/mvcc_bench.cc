@@ -0,0 +1,550 @@
+/* mvcc_bench.cc
+   Jeremy Barnes, 22 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Benchmark of the MVCC objects under configurable workloads.  Prints the
+   results as JSON on stdout, so that they can be compared between builds.
+
+   Usage: mvcc_bench [--option=value]...  (see usage() for the options)
+*/
+
+#include "jmvcc/transaction.h"
+#include "jmvcc/versioned.h"
+#include "jmvcc/versioned2.h"
+#include "jmvcc/versioned_small.h"
+#include "jmvcc/stats.h"
+#include "mmap/pvo_store.h"
+#include "mmap/pvo_manager.h"
+#include "mmap/typed_pvo.h"
+#include "jml/arch/exception.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/utils/string_functions.h"
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <unistd.h>
+
+
+using namespace std;
+using namespace ML;
+using namespace JMVCC;
+
+
+/*****************************************************************************/
+/* CONFIGURATION                                                             */
+/*****************************************************************************/
+
+struct Bench_Config {
+    Bench_Config()
+        : object_type("versioned2"), threads(4), objects(1000),
+          seconds(2.0), txn_size(4), write_fraction(0.2),
+          skew("uniform"), zipf_theta(0.99), snapshot_lifetime(0.0),
+          seed(1), pvo_file("mvcc_bench_store")
+    {
+    }
+
+    string object_type;       ///< versioned, versioned2, small or pvo
+    int threads;              ///< Number of threads running transactions
+    int objects;              ///< Number of objects
+    double seconds;           ///< How long to run for
+    int txn_size;             ///< Objects accessed per transaction
+    double write_fraction;    ///< Fraction of accesses that are writes
+    string skew;              ///< uniform or zipf
+    double zipf_theta;        ///< Skew parameter for zipf
+    double snapshot_lifetime; ///< Seconds a long-lived snapshot lives; 0=none
+    unsigned seed;
+    string pvo_file;          ///< Backing file for the pvo store
+
+    void parse(int argc, char ** argv);
+};
+
+void usage(ostream & stream)
+{
+    Bench_Config d;
+    stream << "usage: mvcc_bench [--option=value]..." << endl
+           << "  --type=versioned|versioned2|small|pvo  object type ["
+           << d.object_type << "]" << endl
+           << "  --threads=n             transaction threads ["
+           << d.threads << "]" << endl
+           << "  --objects=n             number of objects ["
+           << d.objects << "]" << endl
+           << "  --seconds=s             run time [" << d.seconds << "]"
+           << endl
+           << "  --txn-size=n            objects per transaction ["
+           << d.txn_size << "]" << endl
+           << "  --write-fraction=f      fraction of accesses that write ["
+           << d.write_fraction << "]" << endl
+           << "  --skew=uniform|zipf     key distribution [" << d.skew
+           << "]" << endl
+           << "  --zipf-theta=t          zipf skew [" << d.zipf_theta << "]"
+           << endl
+           << "  --snapshot-lifetime=s   hold a snapshot open for s seconds "
+           << "at a time [0 = none]" << endl
+           << "  --seed=n                random seed [" << d.seed << "]"
+           << endl
+           << "  --pvo-file=name         backing file for pvo ["
+           << d.pvo_file << "]" << endl;
+}
+
+void
+Bench_Config::
+parse(int argc, char ** argv)
+{
+    for (int i = 1;  i < argc;  ++i) {
+        string arg = argv[i];
+
+        if (arg == "--help" || arg == "-h") {
+            usage(cout);
+            exit(0);
+        }
+
+        string::size_type eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == string::npos)
+            throw Exception("couldn't parse argument " + arg);
+
+        string name(arg, 2, eq - 2), value(arg, eq + 1);
+        const char * v = value.c_str();
+
+        if (name == "type") object_type = value;
+        else if (name == "threads") threads = atoi(v);
+        else if (name == "objects") objects = atoi(v);
+        else if (name == "seconds") seconds = atof(v);
+        else if (name == "txn-size") txn_size = atoi(v);
+        else if (name == "write-fraction") write_fraction = atof(v);
+        else if (name == "skew") skew = value;
+        else if (name == "zipf-theta") zipf_theta = atof(v);
+        else if (name == "snapshot-lifetime") snapshot_lifetime = atof(v);
+        else if (name == "seed") seed = atoi(v);
+        else if (name == "pvo-file") pvo_file = value;
+        else throw Exception("unknown option " + arg);
+    }
+
+    if (object_type != "versioned" && object_type != "versioned2"
+        && object_type != "small" && object_type != "pvo")
+        throw Exception("unknown object type " + object_type);
+    if (skew != "uniform" && skew != "zipf")
+        throw Exception("unknown skew " + skew);
+    if (threads < 1 || objects < 1 || txn_size < 1 || seconds <= 0.0)
+        throw Exception("threads, objects, txn-size and seconds must be "
+                        "positive");
+    if (write_fraction < 0.0 || write_fraction > 1.0)
+        throw Exception("write-fraction must be between 0 and 1");
+}
+
+
+/*****************************************************************************/
+/* KEY CHOICE                                                                */
+/*****************************************************************************/
+
+/// xorshift64*; quick, and good enough to pick keys with
+struct Random {
+    Random(uint64_t seed)
+        : state(seed * 0x9e3779b97f4a7c15ULL + 1)
+    {
+    }
+
+    uint64_t state;
+
+    uint64_t next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ULL;
+    }
+
+    /// Uniform in [0, 1)
+    double uniform()
+    {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+/** Chooses objects, either uniformly or with a zipf distribution (where
+    object i is chosen with a probability proportional to 1 / (i+1)^theta).
+    The zipf distribution is sampled exactly from its cumulative
+    distribution, which costs a double per object.
+*/
+struct Key_Chooser {
+    Key_Chooser(const Bench_Config & config)
+        : nobjects(config.objects)
+    {
+        if (config.skew != "zipf") return;
+
+        cdf.resize(nobjects);
+        double total = 0.0;
+        for (int i = 0;  i < nobjects;  ++i) {
+            total += 1.0 / pow(i + 1.0, config.zipf_theta);
+            cdf[i] = total;
+        }
+        for (int i = 0;  i < nobjects;  ++i)
+            cdf[i] /= total;
+    }
+
+    int nobjects;
+    vector<double> cdf;   ///< Empty for uniform
+
+    int operator () (Random & random) const
+    {
+        if (cdf.empty()) return random.next() % nobjects;
+        int result = std::lower_bound(cdf.begin(), cdf.end(),
+                                      random.uniform()) - cdf.begin();
+        return std::min(result, nobjects - 1);
+    }
+};
+
+
+/*****************************************************************************/
+/* OBJECTS                                                                   */
+/*****************************************************************************/
+
+typedef int64_t Value;
+
+/// Objects that live in memory
+template<class Var>
+struct Memory_Objects {
+    Memory_Objects(const Bench_Config & config)
+    {
+        // The objects can't be copied, so we can't put them in a vector
+        for (int i = 0;  i < config.objects;  ++i)
+            vars.push_back(boost::shared_ptr<Var>(new Var(0)));
+    }
+
+    std::vector<boost::shared_ptr<Var> > vars;
+
+    Value read(int i) const { return vars[i]->read(); }
+    void add(int i, Value v) { vars[i]->mutate() += v; }
+};
+
+/// Objects in a persistent object store
+struct PVO_Objects {
+    PVO_Objects(const Bench_Config & config)
+        : filename(config.pvo_file)
+    {
+        unlink(filename.c_str());
+        // Plenty of room for the old versions, which also live in the store
+        store.reset(new PVOStore(boost::interprocess::create_only, filename,
+                                 std::max<size_t>(64 << 20,
+                                                  config.objects * 1024)));
+
+        Local_Transaction trans;
+        for (int i = 0;  i < config.objects;  ++i)
+            ids.push_back(store->construct<Value>(0)->id());
+        if (!trans.commit())
+            throw Exception("couldn't create the objects");
+    }
+
+    ~PVO_Objects()
+    {
+        store.reset();
+        unlink(filename.c_str());
+    }
+
+    string filename;
+    boost::shared_ptr<PVOStore> store;
+    std::vector<ObjectId> ids;
+
+    Value read(int i) const { return store->lookup<Value>(ids[i])->read(); }
+    void add(int i, Value v) { store->lookup<Value>(ids[i])->mutate() += v; }
+};
+
+
+/*****************************************************************************/
+/* WORKLOAD                                                                  */
+/*****************************************************************************/
+
+volatile bool bench_stop = false;
+
+/// What each thread counts
+struct Thread_Result {
+    Thread_Result()
+        : transactions(0), read_only(0), commits(0), aborts(0), added(0),
+          checksum(0)
+    {
+    }
+
+    uint64_t transactions;   ///< Finished, including read-only ones
+    uint64_t read_only;      ///< Those that didn't write anything
+    uint64_t commits;        ///< Successful commits
+    uint64_t aborts;         ///< Failed commits (which were retried)
+    uint64_t added;          ///< Total committed to the objects
+    uint64_t checksum;       ///< Of the values read; keeps the reads live
+    Latency_Histogram latency;  ///< Of whole transactions, with retries
+
+    void operator += (const Thread_Result & other)
+    {
+        transactions += other.transactions;
+        read_only += other.read_only;
+        commits += other.commits;
+        aborts += other.aborts;
+        added += other.added;
+        checksum += other.checksum;
+        latency += other.latency;
+    }
+};
+
+template<class Objects>
+void run_bench_thread(Objects & objects, const Bench_Config & config,
+                      const Key_Chooser & chooser, int thread_num,
+                      boost::barrier & barrier, Thread_Result & result)
+{
+    Random random(config.seed * 1000 + thread_num);
+    vector<int> keys(config.txn_size);
+    vector<bool> writes(config.txn_size);
+
+    barrier.wait();
+
+    while (!bench_stop) {
+        bool any_writes = false;
+        for (int i = 0;  i < config.txn_size;  ++i) {
+            keys[i] = chooser(random);
+            writes[i] = random.uniform() < config.write_fraction;
+            any_writes = any_writes || writes[i];
+        }
+
+        uint64_t start = stats_clock();
+
+        if (!any_writes) {
+            Read_Only_Transaction trans;
+            Value total = 0;
+            for (int i = 0;  i < config.txn_size;  ++i)
+                total += objects.read(keys[i]);
+            result.checksum += total;
+            ++result.read_only;
+        }
+        else {
+            // Each write adds one, so that we can check at the end that
+            // nothing was lost
+            Local_Transaction trans;
+            int nwrites;
+            Value total;
+            for (;;) {
+                total = 0;
+                nwrites = 0;
+                for (int i = 0;  i < config.txn_size;  ++i) {
+                    if (!writes[i]) total += objects.read(keys[i]);
+                    else {
+                        objects.add(keys[i], 1);
+                        ++nwrites;
+                    }
+                }
+
+                if (trans.commit()) break;
+                ++result.aborts;
+            }
+            ++result.commits;
+            result.added += nwrites;
+            result.checksum += total;
+        }
+
+        result.latency.record(stats_clock() - start);
+        ++result.transactions;
+    }
+}
+
+/// Holds a snapshot open for the configured time, over and over, so that
+/// old versions pile up
+void run_snapshot_thread(const Bench_Config & config, boost::barrier & barrier)
+{
+    barrier.wait();
+
+    while (!bench_stop) {
+        Read_Only_Transaction snapshot;
+        for (double slept = 0.0;
+             slept < config.snapshot_lifetime && !bench_stop;
+             slept += 0.01)
+            usleep(10000);
+    }
+}
+
+template<class Objects>
+Thread_Result run_workload(const Bench_Config & config, double & elapsed)
+{
+    Objects objects(config);
+    Key_Chooser chooser(config);
+
+    bool snapshots = config.snapshot_lifetime > 0.0;
+    vector<Thread_Result> results(config.threads);
+    boost::barrier barrier(config.threads + snapshots + 1);
+    boost::thread_group tg;
+
+    bench_stop = false;
+    reset_mvcc_stats();
+
+    for (int i = 0;  i < config.threads;  ++i)
+        tg.create_thread(boost::bind(&run_bench_thread<Objects>,
+                                     boost::ref(objects),
+                                     boost::cref(config),
+                                     boost::cref(chooser), i,
+                                     boost::ref(barrier),
+                                     boost::ref(results[i])));
+    if (snapshots)
+        tg.create_thread(boost::bind(&run_snapshot_thread,
+                                     boost::cref(config),
+                                     boost::ref(barrier)));
+
+    barrier.wait();
+    uint64_t start = stats_clock();
+    usleep((useconds_t)(config.seconds * 1000000));
+    bench_stop = true;
+    tg.join_all();
+    elapsed = (stats_clock() - start) / 1e9;
+
+    Thread_Result result;
+    for (int i = 0;  i < config.threads;  ++i)
+        result += results[i];
+
+    // Check that nothing was lost
+    Value total = 0;
+    {
+        Read_Only_Transaction trans;
+        for (int i = 0;  i < config.objects;  ++i)
+            total += objects.read(i);
+    }
+    if (total != (Value)result.added)
+        throw Exception(format("objects total %lld; should be %lld",
+                               (long long)total, (long long)result.added));
+
+    return result;
+}
+
+
+/*****************************************************************************/
+/* OUTPUT                                                                    */
+/*****************************************************************************/
+
+string json_latency(const Latency_Histogram & h)
+{
+    return format("{ \"count\": %lld, \"mean\": %.0f, \"p50\": %lld, "
+                  "\"p90\": %lld, \"p99\": %lld, \"p999\": %lld, "
+                  "\"max\": %lld }",
+                  (long long)h.count, h.mean(),
+                  (long long)h.percentile(0.5),
+                  (long long)h.percentile(0.9),
+                  (long long)h.percentile(0.99),
+                  (long long)h.percentile(0.999),
+                  (long long)h.max_ns);
+}
+
+void print_json(ostream & stream, const Bench_Config & config,
+                const Thread_Result & result, double elapsed,
+                const MVCC_Stats & stats)
+{
+    uint64_t attempts = result.commits + result.aborts;
+
+    stream << "{" << endl;
+    stream << "  \"config\": {" << endl
+           << "    \"type\": \"" << config.object_type << "\"," << endl
+           << "    \"threads\": " << config.threads << "," << endl
+           << "    \"objects\": " << config.objects << "," << endl
+           << "    \"seconds\": " << config.seconds << "," << endl
+           << "    \"txn_size\": " << config.txn_size << "," << endl
+           << "    \"write_fraction\": " << config.write_fraction << ","
+           << endl
+           << "    \"skew\": \"" << config.skew << "\"," << endl
+           << "    \"zipf_theta\": " << config.zipf_theta << "," << endl
+           << "    \"snapshot_lifetime\": " << config.snapshot_lifetime
+           << "," << endl
+           << "    \"seed\": " << config.seed << "," << endl
+           << "    \"epoch_bits\": " << sizeof(Epoch) * 8 << endl
+           << "  }," << endl;
+
+    stream << format("  \"elapsed\": %.6f,", elapsed) << endl;
+    stream << "  \"transactions\": " << result.transactions << "," << endl;
+    stream << "  \"read_only_transactions\": " << result.read_only << ","
+           << endl;
+    stream << "  \"commits\": " << result.commits << "," << endl;
+    stream << "  \"aborts\": " << result.aborts << "," << endl;
+    stream << "  \"read_checksum\": " << result.checksum << "," << endl;
+    stream << format("  \"throughput\": %.1f,",
+                     result.transactions / elapsed) << endl;
+    stream << format("  \"commit_throughput\": %.1f,",
+                     result.commits / elapsed) << endl;
+    stream << format("  \"abort_rate\": %.6f,",
+                     attempts ? (double)result.aborts / attempts : 0.0)
+           << endl;
+    stream << "  \"latency_ns\": " << json_latency(result.latency) << ","
+           << endl;
+
+    stream << "  \"aborts_by_reason\": {";
+    for (unsigned i = 0;  i < NUM_ABORT_REASONS;  ++i)
+        stream << (i ? ", " : " ") << "\"" << print(Abort_Reason(i))
+               << "\": " << stats.commits.aborts[i];
+    stream << " }," << endl;
+
+    stream << "  \"commit_phases_ns\": {" << endl;
+    for (unsigned i = 0;  i < NUM_COMMIT_PHASES;  ++i)
+        stream << "    \"" << print(Commit_Phase(i)) << "\": "
+               << json_latency(stats.commits.phases[i])
+               << (i + 1 < NUM_COMMIT_PHASES ? "," : "") << endl;
+    stream << "  }," << endl;
+
+    const Reclamation_Stats & r = stats.reclamation;
+    stream << "  \"gc\": {" << endl
+           << "    \"versions_retained\": " << stats.versions_retained
+           << "," << endl
+           << "    \"pending_batches\": " << r.pending_batches << "," << endl
+           << "    \"pending_cleanups\": " << r.pending_cleanups << ","
+           << endl
+           << "    \"max_queue_depth\": " << r.max_queue_depth << "," << endl
+           << "    \"batches_inline\": " << r.batches_inline << "," << endl
+           << "    \"batches_background\": " << r.batches_background << ","
+           << endl
+           << format("    \"max_background_latency\": %.6f",
+                     r.max_latency) << endl
+           << "  }," << endl;
+
+    stream << "  \"locks\": {" << endl;
+    const Adaptive_Lock::Stats * locks[3]
+        = { &stats.commit_lock, &stats.commit_stripes, &stats.snapshot_lock };
+    const char * names[3] = { "commit_lock", "commit_stripes", "snapshots" };
+    for (unsigned i = 0;  i < 3;  ++i)
+        stream << "    \"" << names[i] << "\": { \"acquisitions\": "
+               << locks[i]->acquisitions << ", \"contended\": "
+               << locks[i]->contended << ", \"parks\": "
+               << locks[i]->parks << " }" << (i < 2 ? "," : "") << endl;
+    stream << "  }" << endl;
+
+    stream << "}" << endl;
+}
+
+
+/*****************************************************************************/
+/* MAIN                                                                      */
+/*****************************************************************************/
+
+int main(int argc, char ** argv)
+try {
+    Bench_Config config;
+    config.parse(argc, argv);
+
+    Thread_Result result;
+    double elapsed = 0.0;
+
+    if (config.object_type == "versioned")
+        result = run_workload<Memory_Objects<Versioned<Value> > >
+            (config, elapsed);
+    else if (config.object_type == "versioned2")
+        result = run_workload<Memory_Objects<Versioned2<Value> > >
+            (config, elapsed);
+    else if (config.object_type == "small")
+        result = run_workload<Memory_Objects<Versioned_Small<Value> > >
+            (config, elapsed);
+    else result = run_workload<PVO_Objects>(config, elapsed);
+
+    MVCC_Stats stats = get_mvcc_stats();
+    print_json(cout, config, result, elapsed, stats);
+
+    return 0;
+} catch (const std::exception & exc) {
+    cerr << "mvcc_bench: " << exc.what() << endl;
+    usage(cerr);
+    return 1;
+}
@@ -0,0 +1,132 @@
+/* adaptive_lock.cc
+   Jeremy Barnes, 16 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Slow paths of the adaptive lock.
+*/
+
+#include "adaptive_lock.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <climits>
+
+
+using namespace std;
+
+
+namespace JMVCC {
+
+/// Spinning is no use when the holder can't be running at the same time
+/// as us.  Zero (before static initialization) means don't spin either.
+int adaptive_lock_num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+inline void futex_wait(volatile int * addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, 0, 0, 0);
+}
+
+inline void futex_wake(volatile int * addr, int nwaiters)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nwaiters, 0, 0, 0);
+}
+
+
+/*****************************************************************************/
+/* ADAPTIVE_LOCK                                                             */
+/*****************************************************************************/
+
+/* The lock is the "mutex3" of Drepper's "Futexes are Tricky".  The spin
+   limit is adapted the same way as glibc's PTHREAD_MUTEX_ADAPTIVE_NP. */
+
+void
+Adaptive_Lock::
+acquire_slow()
+{
+    int limit = 0;
+    if (adaptive_lock_num_cpus > 1)
+        limit = std::min<int>(MAX_SPINS, spin_limit * 2 + 10);
+
+    int spun = 0;
+    bool got_it = false;
+
+    for (;  spun < limit && !got_it;  ++spun) {
+        cpu_relax();
+        got_it = (state == 0 && __sync_bool_compare_and_swap(&state, 0, 1));
+    }
+
+    // Nothing doing; go to sleep.  Setting the state to 2 means that
+    // whoever releases the lock will wake somebody up.
+    int parked = 0;
+    if (!got_it) {
+        while (__sync_lock_test_and_set(&state, 2) != 0) {
+            futex_wait(&state, 2);
+            ++parked;
+        }
+    }
+
+    // We hold the lock now, so we can update our fields
+    ++contended;
+    spins += spun;
+    parks += parked;
+    if (limit) spin_limit += (spun - spin_limit) / 8;
+}
+
+void
+Adaptive_Lock::
+release_slow()
+{
+    // The state was 2, so there may be someone asleep
+    __sync_lock_release(&state);
+    futex_wake(&state, 1);
+}
+
+Adaptive_Lock::Stats
+Adaptive_Lock::
+stats() const
+{
+    Stats result;
+    result.acquisitions = acquisitions;
+    result.contended = contended;
+    result.spins = spins;
+    result.parks = parks;
+    return result;
+}
+
+void
+Adaptive_Lock::
+reset_stats()
+{
+    acquisitions = contended = spins = parks = 0;
+}
+
+
+/*****************************************************************************/
+/* WAIT_QUEUE                                                                */
+/*****************************************************************************/
+
+/* This is an eventcount.  A waiter reads the sequence number, registers
+   itself, and then checks its condition once more before sleeping; the
+   futex only puts it to sleep if the sequence number hasn't changed since
+   it was read.  A notifier changes the condition and then (after a barrier)
+   looks for waiters, so either the waiter sees the change or the notifier
+   sees the waiter and bumps the sequence number. */
+
+void
+Wait_Queue::
+sleep(int seq)
+{
+    __sync_fetch_and_add(&parks_, 1);
+    futex_wait(&sequence, seq);
+}
+
+void
+Wait_Queue::
+wake_all()
+{
+    __sync_fetch_and_add(&sequence, 1);
+    futex_wake(&sequence, INT_MAX);
+}
+
+} // namespace JMVCC
@@ -0,0 +1,201 @@
+/* adaptive_lock.h                                                 -*- C++ -*-
+   Jeremy Barnes, 16 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   A lock that spins for a while before going to sleep.
+*/
+
+#ifndef __jmvcc__adaptive_lock_h__
+#define __jmvcc__adaptive_lock_h__
+
+#include "jml/compiler/compiler.h"
+#include <boost/utility.hpp>
+#include <stdint.h>
+#include <errno.h>
+
+namespace JMVCC {
+
+/// Number of CPUs; no spinning is done when there is only one
+extern int adaptive_lock_num_cpus;
+
+/// Tell the CPU that we're in a spin loop
+inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    asm volatile ("pause" : : : "memory");
+#else
+    asm volatile ("" : : : "memory");
+#endif
+}
+
+
+/*****************************************************************************/
+/* ADAPTIVE_LOCK                                                             */
+/*****************************************************************************/
+
+/** A mutex for short critical sections.  Taking a free lock is a single
+    atomic operation.  If the lock is held, we spin for a while (with pause
+    instructions) in the hope that the holder is about to release it, and
+    if not, sleep on a futex until the holder wakes us up.
+
+    How long to spin adapts to the lock: it moves towards twice the number
+    of spins it took to get the lock last time it was contended, so that
+    locks that are held for a long time stop wasting CPU on spinning.
+    When there is only one CPU, we never spin.
+
+    It has the same interface as ACE_Mutex, so it can be used with
+    ACE_Guard.  It can't be used with an ACE_Condition.
+*/
+
+struct Adaptive_Lock : boost::noncopyable {
+    Adaptive_Lock()
+        : state(0), spin_limit(0),
+          acquisitions(0), contended(0), spins(0), parks(0)
+    {
+    }
+
+    int acquire()
+    {
+        if (JML_UNLIKELY(!__sync_bool_compare_and_swap(&state, 0, 1)))
+            acquire_slow();
+        ++acquisitions;
+        return 0;
+    }
+
+    /** Take the lock if it's free.  Returns 0 on success, or -1 with errno
+        set to EBUSY if it's already held. */
+    int tryacquire()
+    {
+        if (__sync_bool_compare_and_swap(&state, 0, 1)) {
+            ++acquisitions;
+            return 0;
+        }
+        errno = EBUSY;
+        return -1;
+    }
+
+    int release()
+    {
+        // If it goes from 1 to 0, nobody was asleep waiting for it
+        if (JML_UNLIKELY(__sync_fetch_and_sub(&state, 1) != 1))
+            release_slow();
+        return 0;
+    }
+
+    /** Contention statistics.  They are updated with the lock held, so
+        they may be slightly out if the lock is held when they're read. */
+    struct Stats {
+        Stats()
+            : acquisitions(0), contended(0), spins(0), parks(0)
+        {
+        }
+
+        uint64_t acquisitions;  ///< Number of times the lock was taken
+        uint64_t contended;     ///< How many of those found it already held
+        uint64_t spins;         ///< Number of times around the spin loop
+        uint64_t parks;         ///< Number of times a thread went to sleep
+
+        Stats & operator += (const Stats & other)
+        {
+            acquisitions += other.acquisitions;
+            contended += other.contended;
+            spins += other.spins;
+            parks += other.parks;
+            return *this;
+        }
+    };
+
+    Stats stats() const;
+
+    void reset_stats();
+
+    /// Longest that we will spin before sleeping
+    enum { MAX_SPINS = 1000 };
+
+private:
+    /// 0 = unlocked, 1 = locked, 2 = locked and there may be sleepers
+    volatile int state;
+
+    /// How long to spin, roughly; see the class comment.  Only written
+    /// with the lock held.
+    int spin_limit;
+
+    /// Statistics.  Only written with the lock held.
+    uint64_t acquisitions, contended, spins, parks;
+
+    void acquire_slow();
+
+    void release_slow();
+};
+
+
+/*****************************************************************************/
+/* WAIT_QUEUE                                                                */
+/*****************************************************************************/
+
+/** Somewhere to wait for a condition that other threads make true, such as
+    an epoch being published.  As with Adaptive_Lock, a waiter spins for a
+    while and then sleeps on a futex.  Whoever changes what the condition
+    depends upon must call notify() afterwards; this is cheap when nobody
+    is asleep.
+*/
+
+struct Wait_Queue : boost::noncopyable {
+    Wait_Queue()
+        : sequence(0), waiters(0), parks_(0)
+    {
+    }
+
+    /** Return once done() returns true.  done() is called repeatedly, so it
+        should be cheap. */
+    template<class Done>
+    void wait(const Done & done)
+    {
+        int limit = (adaptive_lock_num_cpus > 1 ? MAX_SPINS : 0);
+        for (int spun = 0;  spun < limit;  ++spun) {
+            if (done()) return;
+            cpu_relax();
+        }
+
+        // Once we're counted as a waiter, a notify() will either be seen by
+        // done() or change the sequence number, so we can't miss a wakeup
+        while (!done()) {
+            int seq = sequence;
+            __sync_fetch_and_add(&waiters, 1);
+            if (!done()) sleep(seq);
+            __sync_fetch_and_add(&waiters, -1);
+        }
+    }
+
+    /** Wake up anything that is waiting, so that it checks its condition
+        again.  Includes a full memory barrier. */
+    void notify()
+    {
+        __sync_synchronize();
+        if (JML_UNLIKELY(waiters != 0))
+            wake_all();
+    }
+
+    /// Number of times that a waiter has gone to sleep
+    uint64_t parks() const { return parks_; }
+
+    /// Longest that we will spin before sleeping
+    enum { MAX_SPINS = 1000 };
+
+private:
+    /// Changed by every notify() that has somebody to wake up
+    volatile int sequence;
+
+    /// Number of threads that may be asleep
+    volatile int waiters;
+
+    uint64_t parks_;
+
+    void sleep(int seq);
+
+    void wake_all();
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__adaptive_lock_h__ */
@@ -0,0 +1,155 @@
+/* arena.cc
+   Jeremy Barnes, 14 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Bump-pointer allocator.
+*/
+
+#include "arena.h"
+#include "jml/arch/exception.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <new>
+
+
+using namespace std;
+using namespace ML;
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* THREAD CACHE                                                              */
+/*****************************************************************************/
+
+/* Each thread keeps the block of the last arena that it destroyed, so that
+   the next transaction it runs can use it.  The block is freed when the
+   thread exits. */
+
+__thread Arena::Block * t_spare_block = 0;
+
+pthread_key_t spare_block_key;
+pthread_once_t spare_block_key_once = PTHREAD_ONCE_INIT;
+
+void release_spare_block(void *)
+{
+    free(t_spare_block);
+    t_spare_block = 0;
+}
+
+void create_spare_block_key()
+{
+    if (pthread_key_create(&spare_block_key, release_spare_block) != 0)
+        throw Exception("couldn't create arena spare block key");
+}
+
+void set_spare_block(Arena::Block * block)
+{
+    pthread_once(&spare_block_key_once, create_spare_block_key);
+    if (!pthread_getspecific(spare_block_key))
+        pthread_setspecific(spare_block_key, &spare_block_key);
+    t_spare_block = block;
+}
+
+
+/*****************************************************************************/
+/* ARENA                                                                     */
+/*****************************************************************************/
+
+Arena::
+Arena()
+    : blocks(0), pos(0), end(0)
+{
+}
+
+Arena::
+~Arena()
+{
+    // Keep our biggest block for the next arena in this thread, if it's
+    // bigger than what is already there
+    Block * keep = blocks;
+    if (keep && keep->size <= MAX_RETAINED
+        && (!t_spare_block || t_spare_block->size < keep->size)) {
+        blocks = keep->next;
+        free(t_spare_block);
+        keep->next = 0;
+        set_spare_block(keep);
+    }
+
+    while (blocks) {
+        Block * next = blocks->next;
+        free(blocks);
+        blocks = next;
+    }
+}
+
+void
+Arena::
+reset()
+{
+    if (!blocks) return;
+
+    // Blocks double in size, so the first one is the biggest.  Keep it, and
+    // free the rest.
+    while (blocks->next) {
+        Block * next = blocks->next->next;
+        free(blocks->next);
+        blocks->next = next;
+    }
+
+    if (blocks->size > MAX_RETAINED) {
+        free(blocks);
+        blocks = 0;
+        pos = end = 0;
+        return;
+    }
+
+    pos = blocks->begin();
+    end = blocks->end();
+}
+
+size_t
+Arena::
+capacity() const
+{
+    size_t result = 0;
+    for (Block * b = blocks;  b;  b = b->next)
+        result += b->size - sizeof(Block);
+    return result;
+}
+
+void *
+Arena::
+allocate_slow(size_t bytes, size_t alignment)
+{
+    size_t needed = sizeof(Block) + bytes + alignment;
+
+    Block * block = 0;
+
+    // The first block can come from the thread's spare
+    if (!blocks && t_spare_block && t_spare_block->size >= needed) {
+        block = t_spare_block;
+        t_spare_block = 0;
+    }
+    else {
+        size_t size = (blocks ? blocks->size * 2 : INITIAL_BLOCK_SIZE);
+        size = std::max(size, needed);
+
+        block = reinterpret_cast<Block *>(malloc(size));
+        if (!block) throw std::bad_alloc();
+        block->size = size;
+    }
+
+    block->next = blocks;
+    blocks = block;
+    pos = block->begin();
+    end = block->end();
+
+    void * result = allocate(bytes, alignment);
+    if (!result)
+        throw Exception("Arena: allocation from new block failed");
+    return result;
+}
+
+} // namespace JMVCC
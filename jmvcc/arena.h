@@ -0,0 +1,86 @@
+/* arena.h                                                         -*- C++ -*-
+   Jeremy Barnes, 14 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Bump-pointer allocator for memory that all goes away at once.
+*/
+
+#ifndef __jmvcc__arena_h__
+#define __jmvcc__arena_h__
+
+#include "jml/compiler/compiler.h"
+#include <boost/utility.hpp>
+#include <stddef.h>
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* ARENA                                                                     */
+/*****************************************************************************/
+
+/** Memory is handed out by bumping a pointer through a block, and is only
+    given back all at once with reset().  Used to hold the local values of
+    a sandbox, which all live until the transaction commits or restarts.
+
+    After a reset(), the largest block is kept so that a transaction that
+    runs again allocates nothing.  When the arena is destroyed, its block
+    is kept for the next arena created by the same thread, so that short
+    transactions don't need to call malloc() at all.
+*/
+
+struct Arena : boost::noncopyable {
+    Arena();
+
+    ~Arena();
+
+    /** Allocate the given number of bytes, aligned to the given power of
+        two.  The memory stays valid until reset() or destruction. */
+    void * allocate(size_t bytes, size_t alignment)
+    {
+        char * result
+            = reinterpret_cast<char *>
+            ((reinterpret_cast<size_t>(pos) + alignment - 1)
+             & ~(alignment - 1));
+
+        if (JML_LIKELY(result + bytes <= end)) {
+            pos = result + bytes;
+            return result;
+        }
+
+        return allocate_slow(bytes, alignment);
+    }
+
+    /** Forget about everything that was allocated.  No destructors are run;
+        that is up to the owner of the memory. */
+    void reset();
+
+    /** Number of bytes in the blocks that we hold. */
+    size_t capacity() const;
+
+    /** Largest block that is kept for reuse, by reset() and between
+        arenas. */
+    enum { MAX_RETAINED = 1024 * 1024 };
+
+    /** Size of the first block to be allocated. */
+    enum { INITIAL_BLOCK_SIZE = 4096 };
+
+    struct Block {
+        Block * next;
+        size_t size;   ///< Including this header
+
+        char * begin() { return reinterpret_cast<char *>(this + 1); }
+        char * end() { return reinterpret_cast<char *>(this) + size; }
+    };
+
+private:
+    Block * blocks;    ///< Newest (and largest) first
+    char * pos;        ///< Next free byte in blocks
+    char * end;        ///< End of blocks
+
+    void * allocate_slow(size_t bytes, size_t alignment);
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__arena_h__ */
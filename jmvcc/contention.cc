@@ -0,0 +1,220 @@
+/* contention.cc
+   Jeremy Barnes, 15 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Contention management.
+*/
+
+#include "contention.h"
+#include "transaction.h"
+#include "jml/arch/atomic_ops.h"
+#include <algorithm>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+
+
+using namespace std;
+
+
+namespace JMVCC {
+
+Contention_Manager * default_contention_manager = 0;
+
+void set_default_contention_manager(Contention_Manager * manager)
+{
+    default_contention_manager = manager;
+}
+
+Contention_Manager * get_default_contention_manager()
+{
+    return default_contention_manager;
+}
+
+
+/*****************************************************************************/
+/* CONTENTION_MANAGER                                                        */
+/*****************************************************************************/
+
+Contention_Manager::
+~Contention_Manager()
+{
+}
+
+uint64_t
+Contention_Manager::
+priority(const Transaction & trans) const
+{
+    return 0;
+}
+
+void
+Contention_Manager::
+aborted(Transaction & trans, size_t work)
+{
+}
+
+void
+Contention_Manager::
+wait(Transaction & trans)
+{
+}
+
+void
+Contention_Manager::
+committed(Transaction & trans)
+{
+}
+
+bool
+Contention_Manager::
+uses_barging() const
+{
+    return false;
+}
+
+bool
+Contention_Manager::
+should_barge(const Transaction & trans) const
+{
+    return false;
+}
+
+
+/*****************************************************************************/
+/* BACKOFF_CONTENTION_MANAGER                                                */
+/*****************************************************************************/
+
+/// Seed for the random part of the backoff
+__thread unsigned backoff_seed = 0;
+
+Backoff_Contention_Manager::
+Backoff_Contention_Manager(double min_wait, double max_wait)
+    : min_wait(min_wait), max_wait(max_wait)
+{
+}
+
+void
+Backoff_Contention_Manager::
+wait(Transaction & trans)
+{
+    backoff(trans.retries());
+}
+
+void
+Backoff_Contention_Manager::
+backoff(int retries) const
+{
+    double seconds = min_wait * (1 << std::min(std::max(retries, 0), 20));
+    seconds = std::min(seconds, max_wait);
+
+    // Randomize so that those that failed together don't retry together
+    if (backoff_seed == 0)
+        backoff_seed = time(0) ^ (size_t)&backoff_seed;
+    seconds *= 0.5 + 0.5 * (rand_r(&backoff_seed) / (RAND_MAX + 1.0));
+
+    // Sleeping for less than this is really a yield
+    if (seconds < 0.00005) sched_yield();
+    else usleep((useconds_t)(seconds * 1000000));
+}
+
+
+/*****************************************************************************/
+/* AGE_CONTENTION_MANAGER                                                    */
+/*****************************************************************************/
+
+/// Hands out the tickets that order transactions by age
+uint64_t next_contention_ticket = 1;
+
+Age_Contention_Manager::
+Age_Contention_Manager(int barge_after, double min_wait, double max_wait)
+    : Backoff_Contention_Manager(min_wait, max_wait),
+      barge_after(barge_after)
+{
+}
+
+uint64_t
+Age_Contention_Manager::
+priority(const Transaction & trans) const
+{
+    // Tickets are given out the first time they are needed, which is on
+    // the first commit, so age is counted from there.
+    uint64_t & ticket = const_cast<Transaction &>(trans).contention_ticket;
+    if (ticket == 0)
+        ticket = __sync_fetch_and_add(&next_contention_ticket, 1);
+
+    return ~ticket;
+}
+
+void
+Age_Contention_Manager::
+committed(Transaction & trans)
+{
+    // If the transaction object is used again, it's a new transaction
+    trans.contention_ticket = 0;
+}
+
+bool
+Age_Contention_Manager::
+uses_barging() const
+{
+    return true;
+}
+
+bool
+Age_Contention_Manager::
+should_barge(const Transaction & trans) const
+{
+    return trans.retries() + 1 >= barge_after;
+}
+
+
+/*****************************************************************************/
+/* KARMA_CONTENTION_MANAGER                                                  */
+/*****************************************************************************/
+
+Karma_Contention_Manager::
+Karma_Contention_Manager(int barge_after, double min_wait, double max_wait)
+    : Backoff_Contention_Manager(min_wait, max_wait),
+      barge_after(barge_after)
+{
+}
+
+uint64_t
+Karma_Contention_Manager::
+priority(const Transaction & trans) const
+{
+    return trans.karma;
+}
+
+void
+Karma_Contention_Manager::
+aborted(Transaction & trans, size_t work)
+{
+    // Even a transaction that wrote nothing did some work
+    trans.karma += work + 1;
+}
+
+void
+Karma_Contention_Manager::
+committed(Transaction & trans)
+{
+    trans.karma = 0;
+}
+
+bool
+Karma_Contention_Manager::
+uses_barging() const
+{
+    return true;
+}
+
+bool
+Karma_Contention_Manager::
+should_barge(const Transaction & trans) const
+{
+    return trans.retries() + 1 >= barge_after;
+}
+
+} // namespace JMVCC
@@ -0,0 +1,158 @@
+/* contention.h                                                    -*- C++ -*-
+   Jeremy Barnes, 15 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Contention management: what to do when a transaction fails to commit.
+*/
+
+#ifndef __jmvcc__contention_h__
+#define __jmvcc__contention_h__
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace JMVCC {
+
+struct Transaction;
+
+
+/*****************************************************************************/
+/* CONTENTION_MANAGER                                                        */
+/*****************************************************************************/
+
+/** Decides what a transaction does when its commit fails, and which of two
+    transactions that keep conflicting gets to go first, so that they
+    don't livelock or starve each other.  A manager is attached to each
+    transaction (by default, the one passed to
+    set_default_contention_manager()) and is called from commit().
+
+    The state that the policies use (the number of retries, the age of the
+    transaction and its karma) lives in the Transaction, so retries need to
+    use the same Transaction object, which commit() restarts when it fails:
+
+        Local_Transaction trans;
+        do {
+            ...
+        } while (!trans.commit());
+
+    One manager is normally shared by all transactions, so they must be
+    thread safe.
+
+    Barging: when the manager says so, a transaction that failed claims the
+    commit stripes of the objects that it was writing, with its priority.
+    Until it commits (or is destroyed), a transaction with a lower priority
+    whose write set shares one of those stripes fails its commit without
+    trying, which lets the more important transaction through.  This is
+    best effort; a commit that has already got past the check goes ahead.
+*/
+
+struct Contention_Manager {
+    virtual ~Contention_Manager();
+
+    /** Priority of the transaction when barging; higher wins. */
+    virtual uint64_t priority(const Transaction & trans) const;
+
+    /** Called when a commit has failed, before the transaction restarts.
+        work is the number of objects that it was writing. */
+    virtual void aborted(Transaction & trans, size_t work);
+
+    /** Called after aborted() (and after the transaction has claimed its
+        stripes, if it is barging), to wait before the retry. */
+    virtual void wait(Transaction & trans);
+
+    /** Called when a commit has succeeded. */
+    virtual void committed(Transaction & trans);
+
+    /** Does this manager ever barge?  If not, commit() doesn't need to
+        look for claims. */
+    virtual bool uses_barging() const;
+
+    /** Should the transaction, whose commit just failed, claim its write
+        set so that transactions of lower priority give way? */
+    virtual bool should_barge(const Transaction & trans) const;
+};
+
+/** Set the manager for transactions created from now on.  Null (the
+    default) means none: failed transactions retry straight away.  The
+    manager isn't owned, and must outlive the transactions. */
+void set_default_contention_manager(Contention_Manager * manager);
+
+Contention_Manager * get_default_contention_manager();
+
+/** Number of commits that failed because a transaction with a higher
+    priority had claimed one of their stripes. */
+size_t get_num_barged_commits();
+
+
+/*****************************************************************************/
+/* BACKOFF_CONTENTION_MANAGER                                                */
+/*****************************************************************************/
+
+/** After each failed commit, wait for a random time up to an amount that
+    doubles with each retry, from min_wait up to max_wait seconds. */
+
+struct Backoff_Contention_Manager : public Contention_Manager {
+    Backoff_Contention_Manager(double min_wait = 0.000001,
+                               double max_wait = 0.001);
+
+    virtual void wait(Transaction & trans);
+
+    double min_wait;
+    double max_wait;
+
+protected:
+    void backoff(int retries) const;
+};
+
+
+/*****************************************************************************/
+/* AGE_CONTENTION_MANAGER                                                    */
+/*****************************************************************************/
+
+/** Backs off, and the transaction that started first has the highest
+    priority.  Once a transaction has failed barge_after times, it barges.
+    Since the oldest transaction always wins, every transaction eventually
+    commits.
+*/
+
+struct Age_Contention_Manager : public Backoff_Contention_Manager {
+    Age_Contention_Manager(int barge_after = 3,
+                           double min_wait = 0.000001,
+                           double max_wait = 0.001);
+
+    virtual uint64_t priority(const Transaction & trans) const;
+    virtual void committed(Transaction & trans);
+    virtual bool uses_barging() const;
+    virtual bool should_barge(const Transaction & trans) const;
+
+    int barge_after;
+};
+
+
+/*****************************************************************************/
+/* KARMA_CONTENTION_MANAGER                                                  */
+/*****************************************************************************/
+
+/** Backs off, and the priority of a transaction is the work that it has
+    lost in failed commits (its karma), so that a transaction that has
+    wasted a lot of work is let through.  Barges once it has failed
+    barge_after times.
+*/
+
+struct Karma_Contention_Manager : public Backoff_Contention_Manager {
+    Karma_Contention_Manager(int barge_after = 3,
+                             double min_wait = 0.000001,
+                             double max_wait = 0.001);
+
+    virtual uint64_t priority(const Transaction & trans) const;
+    virtual void aborted(Transaction & trans, size_t work);
+    virtual void committed(Transaction & trans);
+    virtual bool uses_barging() const;
+    virtual bool should_barge(const Transaction & trans) const;
+
+    int barge_after;
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__contention_h__ */
@@ -7,9 +7,8 @@
 
 #include "garbage.h"
 #include "jml/arch/exception.h"
-#include "spinlock.h"
+#include "adaptive_lock.h"
 #include "jml/arch/cmp_xchg.h"
-#include <ace/Synch.h>
 #include <vector>
 #include <iostream>
 #include "jml/utils/hash_map.h"
@@ -17,6 +16,15 @@
 #include "jml/utils/string_functions.h"
 #include "jml/arch/backtrace.h"
 #include "jml/arch/atomic_ops.h"
+#include "jml/compiler/compiler.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <memory>
+#include <new>
+#include <sched.h>
+#include <deque>
+#include <ace/Synch.h>
+#include "jml/arch/timers.h"
 
 
 using namespace std;
@@ -93,321 +101,667 @@ namespace JMVCC {
    as soon as it is possible (rather than delayed) as delays will lead to
    objects accumulating in memory, leading to memory and cache pressure.
 
-   When an thread enters into a critical section, it obtains a Critical_Info
-   structure.  These structures (one per thread) are linked together in a
-   doubly-linked list.  The oldest structure is pointed to by the oldest_ci
-   pointer, and the newest one by the newest_ci pointer.  This means that
-   traversing the list of critical_info structures traverses the active
-   critical sections in order of creation: oldest to newest.
+   Finally, entering and leaving a critical section happens on every read,
+   so it needs to be cheap and to scale with the number of threads.  It
+   must not touch any shared, written-to memory.
+
+   There is a global reclamation epoch, gc_epoch, that only ever increases.
+   Each thread owns a Thread_Record (padded to a cache line so that threads
+   don't share lines) that contains the value of gc_epoch when the thread
+   entered its critical section, or zero if it is not in one.  Entering and
+   leaving a critical section only write to the thread's own record.  On
+   entry there is a memory barrier so that the record is visible before
+   anything protected is read.
+
+   Cleanups scheduled within a critical section go onto a thread-local
+   list.  When the outermost critical section ends, the list is tagged with
+   the current value of gc_epoch and moved onto the global list of pending
+   batches.  Any thread that was in a critical section when a cleanup was
+   scheduled entered it with an epoch no later than the tag.
+
+   INVARIANT: a batch tagged with epoch e can be run once there is no
+   thread in a critical section that it entered at an epoch <= e.
+
+   The thread records are only scanned (by reclaim()) when there are
+   batches pending.  We take the pending batches, find the oldest epoch
+   that is still in use, run the batches that are older than it and put the
+   others back.
+
+   When a batch is tagged, gc_epoch is advanced past the tag, so that
+   threads entering from then on won't hold it up.  A thread that leaves a
+   critical section without cleanups of its own only calls reclaim() if it
+   entered at or before the epoch of the oldest pending batch, as otherwise
+   it can't have been holding anything up.  Everything else that it could
+   have been holding up is held up by whatever holds up the oldest batch.
+   This stops a long-lived critical section (such as that of a
+   Read_Only_Transaction) from making every other reader scan the records
+   when it leaves.
+
+   Batches that are put back must not get stranded.  A thread leaving a
+   critical section clears its record before it looks for pending batches,
+   and reclaim() puts the batches back before it scans the records for a
+   second time.  So either the thread holding up the batches sees them when
+   it leaves, or reclaim() sees that it has left and goes around again.
+*/
 
-   INVARIANT: traversing the list of critical_info structures forward
-   from oldest_ci traverses the active critical sections in creation order
-   (oldest to newest).
+int num_cleanups_outstanding = 0;
 
-   INVARIANT: traversing the list of critical_info structures from newest_ci
-   to newest_ci traverses the active critical sections in creation order
-   (oldest to newest).
+bool debug_mode = false;
 
-   INVARIANT: the newest critical section is always pointed to by newest_ci.
-   INVARIANT: the oldest critical section is always pointed to by oldest_ci.
-   
-   INVARIANT: the number of threads in critical sections is equal to the
-   length of the critical_info list.
+int num_added_local = 0;
+int num_added_outside = 0;
+int num_batches_deferred = 0;
 
+struct Stats {
+    ~Stats()
+    {
+        if (!debug_mode) return;
 
-                  ci0       ci1       cin           
+        cerr << "num_added_local = " << num_added_local << endl;
+        cerr << "num_added_outside = " << num_added_outside << endl;
+        cerr << "num_batches_deferred = " << num_batches_deferred << endl;
+    }
+} stats;
 
-   oldest_ci ---> next ---> next ---> next --->  0
-           0 <--- prev <--- prev <--- prev <---  newest_ci
 
+/*****************************************************************************/
+/* CLEANUP LISTS                                                             */
+/*****************************************************************************/
 
-   Each critical_info section has a list of cleanups to perform.  Cleanups
-   are simply pushed on the cleanup list of the current critical seciton.
+/* Cleanups are kept as records of a function and two words of payload, so
+   that scheduling one doesn't need to allocate.  The records are stored in
+   fixed-sized segments that are chained together; moving a list of cleanups
+   to another list is a splice of the chain.  Each thread keeps a small cache
+   of free segments.
+*/
 
-   Once a critical section ends, we need to do one of two things:
-   1.  Perform all of the cleanups on its cleanup list;
-   2.  Transfer all of the cleanups to the cleanup list of another thread.
+struct Cleanup_Record {
+    Cleanup_Function function;
+    void * arg1;
+    void * arg2;
+};
 
+struct Cleanup_Segment {
+    enum { CAPACITY = 20 };
 
-   Subordinated Critical Sections
+    Cleanup_Segment * next;
+    unsigned size;
+    Cleanup_Record records[CAPACITY];
+};
 
-   One critical section is subordinated to another if its lifetime is entirely
-   within the lifetime of the other:
+enum { MAX_FREE_SEGMENTS = 64 };
 
-   ----------------- CS A
-         -----       CS B
+void register_thread_state();
 
-   Here, critical section B is subordinated to critical section A.
+/// Thread-specific data: segments that can be reused
+__thread Cleanup_Segment * t_free_segments = 0;
+__thread int t_num_free_segments = 0;
 
-   If critical section B is subordinated to critical section A, then its
-   cleanups must be done by critical section A.  We can detect a subordinated
-   critical section by noting that A will be before B in the creation time.
+Cleanup_Segment * allocate_segment()
+{
+    Cleanup_Segment * result = t_free_segments;
+    if (result) {
+        t_free_segments = result->next;
+        --t_num_free_segments;
+    }
+    else result = new Cleanup_Segment();
 
+    result->next = 0;
+    result->size = 0;
+    return result;
+}
 
-   Disjoint Critical Sections
+void free_segment(Cleanup_Segment * segment)
+{
+    if (t_num_free_segments >= MAX_FREE_SEGMENTS) {
+        delete segment;
+        return;
+    }
 
-   ---------              CS A
-              ----------  CS B
+    // Make sure that the cache is freed when the thread exits
+    if (t_num_free_segments == 0) register_thread_state();
 
-   In this case, each critical section cleans up its own list, as neither one
-   could be using objects that the other one wants to use.
+    segment->next = t_free_segments;
+    t_free_segments = segment;
+    ++t_num_free_segments;
+}
 
+void release_free_segments()
+{
+    while (t_free_segments) {
+        Cleanup_Segment * segment = t_free_segments;
+        t_free_segments = segment->next;
+        delete segment;
+    }
+    t_num_free_segments = 0;
+}
 
-   Overlapping Critical Sections
-   
-   --w----x----         CS A
-        ----y-----z---  CS B
-   
-   This case is more complex.  Object w should be deleted when CS A disappears;
-   objects x, y and z when CS B disappears.
-   
+/** A list of cleanups to run in order.  It has no constructor so that it
+    can be thread-specific data; initialize with { 0, 0, 0 }.
+*/
+struct Cleanup_List {
+    Cleanup_Segment * head;
+    Cleanup_Segment * tail;
+    size_t count;
 
+    bool empty() const { return count == 0; }
 
+    void add(Cleanup_Function function, void * arg1, void * arg2)
+    {
+        if (!tail || tail->size == Cleanup_Segment::CAPACITY) {
+            Cleanup_Segment * segment = allocate_segment();
+            if (tail) tail->next = segment;
+            else head = segment;
+            tail = segment;
+        }
 
-   Thus,
-   * Cleanups should be assigned to the NEWEST critical_info object no
-     matter what critical section they were made in;
-   * When a critical section finisheds:
-     - If it's the oldest one, then run its cleanups
-     - Otherwise, transfer its cleanups to the next oldest one
+        Cleanup_Record & record = tail->records[tail->size++];
+        record.function = function;
+        record.arg1 = arg1;
+        record.arg2 = arg2;
+        ++count;
+    }
 
+    /// Move all of the other list's cleanups onto the end of this one
+    void splice(Cleanup_List & other)
+    {
+        if (!other.head) return;
 
-   --------------------d
-       -----
-         -x-------
-   OK
+        if (tail) tail->next = other.head;
+        else head = other.head;
+        tail = other.tail;
+        count += other.count;
 
+        other.head = other.tail = 0;
+        other.count = 0;
+    }
 
-   --------------------d
-       -------------
-           -x----
-   OK
-           
+    /// Run the cleanups and free the segments, leaving the list empty.
+    void run()
+    {
+        Cleanup_Segment * segment = head;
+        size_t n = count;
+        head = tail = 0;
+        count = 0;
+
+        while (segment) {
+            for (unsigned i = 0;  i < segment->size;  ++i) {
+                const Cleanup_Record & record = segment->records[i];
+                record.function(record.arg1, record.arg2);
+            }
+            Cleanup_Segment * next = segment->next;
+            free_segment(segment);
+            segment = next;
+        }
 
-   --------------------
-       -----------------------d
-           -x----
-   OK
-*/
+        if (debug_mode) atomic_add(num_cleanups_outstanding, -n);
+    }
+};
 
-struct Critical_Info;
+/// Runs a boost::function cleanup that was scheduled via the compatibility
+/// interface
+void run_function_cleanup(void * arg1, void *)
+{
+    std::auto_ptr<Cleanup> cleanup(reinterpret_cast<Cleanup *>(arg1));
+    (*cleanup)();
+}
 
 
-struct Critical_Guard {
-    Critical_Guard()
-    {
-        if (lock_depth > 0) {
-            ++lock_depth;
-            return;
-        }
+/*****************************************************************************/
+/* CRITICAL SECTIONS                                                         */
+/*****************************************************************************/
 
-        lock.acquire();
-        lock_depth = 1;
-    }
+enum { CACHE_LINE_SIZE = 64 };
 
-    ~Critical_Guard()
+struct Thread_Record {
+    Thread_Record()
+        : epoch(0), in_use(1), next(0)
     {
-        if (lock_depth > 1) {
-            --lock_depth;
-            return;
-        }
-
-        lock.release();
-        lock_depth = 0;
     }
 
-    typedef ACE_Mutex Lock;
-    static Lock lock;
-    static __thread unsigned lock_depth;
-};
+    /// Value of gc_epoch when the thread entered its critical section, or
+    /// zero if it isn't in one.  Only written by the owning thread.
+    volatile uint64_t epoch;
 
-__thread unsigned Critical_Guard::lock_depth = 0;
-Critical_Guard::Lock Critical_Guard::lock;
+    /// Non-zero whilst the record belongs to a running thread
+    volatile int in_use;
 
+    /// Next record in the list of all records.  Never changes once the
+    /// record has been published.
+    Thread_Record * next;
+} __attribute__((__aligned__(CACHE_LINE_SIZE)));
 
-/// Global pointer to the latest critical info structure.  If this pointer is
-/// null, then it means that there are no critical sections active and so
-/// things can be deleted at will.
-Critical_Info * newest_ci = 0;
+/// List of all thread records.  Records are recycled when their thread
+/// exits but never freed, so the list can be traversed without a lock.
+Thread_Record * volatile thread_records = 0;
 
-typedef vector<boost::function<void ()> > Cleanups;
+/// Global reclamation epoch.  Starts at 1 as 0 means "not in a critical
+/// section".
+volatile uint64_t gc_epoch = 1;
 
-int num_in_critical = 0;
-int num_cleanups_outstanding = 0;
+/// Thread-specific data: the thread's record.  Null until the thread first
+/// enters a critical section.
+__thread Thread_Record * t_record = 0;
 
-bool debug_mode = false;
+/// The quick queue for local cleanups; tagged and made pending once the
+/// thread leaves its critical section
+__thread Cleanup_List t_cleanups = { 0, 0, 0 };
 
-int num_added_local = 0;
-int num_added_newest = 0;
-int num_cleaned_immediately = 0;
+/// Thread-specific data: nesting level of the current thread.
+__thread uint32_t t_nesting = 0;
 
-struct Stats {
-    ~Stats()
-    {
-        if (!debug_mode) return;
+/// Used to give a thread's record and free segments back when the thread
+/// exits
+pthread_key_t thread_state_key;
+pthread_once_t thread_state_key_once = PTHREAD_ONCE_INIT;
 
-        cerr << "num_added_local = " << num_added_local << endl;
-        cerr << "num_added_newest = " << num_added_newest << endl;
-        cerr << "num_cleaned_immediately = "
-             << num_cleaned_immediately << endl;
-    }
-} stats;
+void release_batches();
 
-struct Critical_Info {
-    bool live;
+void release_thread_state(void *)
+{
+    release_batches();
 
-    Critical_Info()
-        : live(false), prev(0), next(0)
-    {
+    if (t_record) {
+        t_record->epoch = 0;
+        memory_barrier();
+        t_record->in_use = 0;
+        t_record = 0;
     }
 
-    void insert()
-    {
-        if (live)
-            throw Exception("insert on live Critical_Info");
-        // Must be called with critical_lock held
-
-        // This is the newest one.  Put it in the chain.
-        prev = newest_ci;
-        if (prev) {
-            if (prev->next != 0)
-                throw Exception("newest_ci->next != 0");
-            prev->next = this;
+    release_free_segments();
+}
+
+void create_thread_state_key()
+{
+    if (pthread_key_create(&thread_state_key, release_thread_state) != 0)
+        throw Exception("couldn't create thread state key");
+}
+
+void register_thread_state()
+{
+    pthread_once(&thread_state_key_once, create_thread_state_key);
+    if (!pthread_getspecific(thread_state_key))
+        pthread_setspecific(thread_state_key, &thread_state_key);
+}
+
+Thread_Record * allocate_thread_record()
+{
+    register_thread_state();
+
+    // Recycle the record of an exited thread if we can
+    Thread_Record * record = 0;
+    for (Thread_Record * r = thread_records;  r && !record;  r = r->next)
+        if (!r->in_use && __sync_bool_compare_and_swap(&r->in_use, 0, 1))
+            record = r;
+
+    if (!record) {
+        void * mem;
+        if (posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(Thread_Record)))
+            throw Exception("couldn't allocate thread record");
+        record = new (mem) Thread_Record();
+
+        for (;;) {
+            Thread_Record * head = thread_records;
+            record->next = head;
+            if (__sync_bool_compare_and_swap(&thread_records, head, record))
+                break;
         }
-        newest_ci = this;
-        next = 0;
-        live = true;
     }
 
-    ~Critical_Info()
-    {
-        if (!cleanups.empty())
-            throw Exception("exited critical section with live cleanups");
+    t_record = record;
+    return record;
+}
+
+/// Oldest epoch at which a thread that is still in its critical section
+/// entered, or the maximum value if there are none.
+uint64_t oldest_epoch_in_use()
+{
+    uint64_t result = (uint64_t)-1;
+    for (Thread_Record * r = thread_records;  r;  r = r->next) {
+        uint64_t epoch = r->epoch;
+        if (epoch != 0 && epoch < result) result = epoch;
     }
+    return result;
+}
 
-    void remove()
-    {
-        if (!live)
-            throw Exception("remove on non-live Critical_Info");
+struct Cleanup_Batch {
+    uint64_t epoch;
+    Cleanup_List cleanups;
+    double ready_time;   ///< When it was handed to a background thread
+};
 
-        // Must be called with critical_lock held
-        if (prev) {
-            prev->next = next;
-            prev->take_cleanups_from(cleanups);
-        }
+typedef vector<Cleanup_Batch> Batches;
 
-        if (next) next->prev = prev;
-        else newest_ci = prev;
+/// Batches waiting for the critical sections that could be using them to
+/// finish.  Only touched when there are cleanups to do.
+Batches pending;
+Adaptive_Lock pending_lock;
 
-        prev = next = 0;
+/// Number of entries in pending; allows us to avoid the lock when there is
+/// nothing to do
+volatile int num_pending = 0;
 
-        live = false;
+/// Epoch of the oldest batch in pending, or the maximum value if there are
+/// none.  A thread that entered its critical section after this can't be
+/// holding up any of them.
+volatile uint64_t oldest_pending_epoch = (uint64_t)-1;
+
+/// Add a batch to pending.  Must be called with pending_lock held.  If the
+/// newest batch has the same or a later epoch, the cleanups are spliced onto
+/// it, which is safe as it only makes them wait longer.
+void add_pending_locked(uint64_t epoch, Cleanup_List & cleanups)
+{
+    if (!pending.empty() && pending.back().epoch >= epoch)
+        pending.back().cleanups.splice(cleanups);
+    else {
+        Cleanup_Batch batch;
+        batch.epoch = epoch;
+        batch.cleanups.head = batch.cleanups.tail = 0;
+        batch.cleanups.count = 0;
+        batch.cleanups.splice(cleanups);
+        batch.ready_time = 0.0;
+        pending.push_back(batch);
     }
 
-    Critical_Info * prev;
-    Critical_Info * next;
-    
-    Cleanups cleanups;
+    // Batches are only ever added at the back with a later epoch, so the
+    // front is the oldest
+    oldest_pending_epoch = pending.front().epoch;
+    num_pending = pending.size();
+}
 
-    void add_cleanup(Cleanup cleanup)
-    {
-        cleanups.push_back(cleanup);
-        if (debug_mode) atomic_add(num_cleanups_outstanding, 1);
+void add_pending(Cleanup_List & cleanups)
+{
+    // Nothing that can be using the cleanups entered later than now
+    memory_barrier();
+    uint64_t epoch = gc_epoch;
+
+    pending_lock.acquire();
+    add_pending_locked(epoch, cleanups);
+    pending_lock.release();
+
+    // Threads that enter from now on can't be using the cleanups, so they
+    // shouldn't hold them up
+    __sync_bool_compare_and_swap(&gc_epoch, epoch, epoch + 1);
+}
+
+/*****************************************************************************/
+/* BACKGROUND RECLAMATION                                                    */
+/*****************************************************************************/
+
+/* Normally the thread that finds that a batch is ready runs it straight
+   away, which means that a reader leaving its critical section can end up
+   running an arbitrary number of destructors.  In background mode, ready
+   batches are put on a queue and run by a pool of reclamation threads.
+
+   If the queue gets longer than max_reclaim_queue_depth, the thread that
+   found the batch runs it itself.  This keeps the memory held by the
+   queue bounded when the reclamation threads can't keep up.
+*/
+
+ACE_Thread_Mutex reclaim_lock;
+ACE_Condition_Thread_Mutex reclaim_work(reclaim_lock);
+ACE_Condition_Thread_Mutex reclaim_idle(reclaim_lock);
+
+std::deque<Cleanup_Batch> reclaim_queue;
+vector<pthread_t> reclaim_threads;
+size_t max_reclaim_queue_depth = 1024;
+bool reclaim_stop = false;
+int reclaim_busy = 0;
+
+/// Number of reclamation threads; read without the lock as a fast check
+volatile int num_reclaim_threads = 0;
+
+Reclamation_Stats reclaim_stats;
+
+void * run_reclamation_thread(void *)
+{
+    ACE_Guard<ACE_Thread_Mutex> guard(reclaim_lock);
+
+    for (;;) {
+        while (reclaim_queue.empty() && !reclaim_stop)
+            reclaim_work.wait();
+
+        // We only stop once the queue is drained
+        if (reclaim_queue.empty()) break;
+
+        Cleanup_Batch batch = reclaim_queue.front();
+        reclaim_queue.pop_front();
+        ++reclaim_busy;
+
+        size_t ncleanups = batch.cleanups.count;
+
+        guard.release();
+        batch.cleanups.run();
+        double latency = wall_time() - batch.ready_time;
+        guard.acquire();
+
+        --reclaim_busy;
+        reclaim_stats.queue_depth = reclaim_queue.size();
+        reclaim_stats.batches_background += 1;
+        reclaim_stats.cleanups_background += ncleanups;
+        reclaim_stats.total_latency += latency;
+        reclaim_stats.max_latency = std::max(reclaim_stats.max_latency,
+                                             latency);
+
+        if (reclaim_queue.empty() && reclaim_busy == 0)
+            reclaim_idle.broadcast();
     }
 
-    void take_cleanups_from(Cleanups & other_cleanups)
+    guard.release();
+    release_free_segments();
+
+    return 0;
+}
+
+/// Give the ready cleanups to the reclamation threads if there is room in
+/// the queue.  If there isn't, they are left for the caller to run.
+void queue_for_reclamation(Cleanup_List & ready)
+{
+    ACE_Guard<ACE_Thread_Mutex> guard(reclaim_lock);
+
+    if (reclaim_threads.empty() || reclaim_stop) return;
+    if (reclaim_queue.size() >= max_reclaim_queue_depth) return;
+
+    Cleanup_Batch batch;
+    batch.epoch = 0;
+    batch.cleanups = ready;
+    batch.ready_time = wall_time();
+    reclaim_queue.push_back(batch);
+
+    ready.head = ready.tail = 0;
+    ready.count = 0;
+
+    reclaim_stats.queue_depth = reclaim_queue.size();
+    reclaim_stats.max_queue_depth
+        = std::max(reclaim_stats.max_queue_depth, reclaim_queue.size());
+
+    reclaim_work.broadcast();
+}
+
+void set_background_reclamation(int nthreads, size_t max_queue_depth)
+{
+    if (nthreads < 0)
+        throw Exception("set_background_reclamation: negative thread count");
+
+    // Stop the current threads; they drain the queue before they exit
     {
-        if (cleanups.size() < other_cleanups.size())
-            cleanups.swap(other_cleanups);
+        ACE_Guard<ACE_Thread_Mutex> guard(reclaim_lock);
+        reclaim_stop = true;
+        reclaim_work.broadcast();
+    }
 
-        if (other_cleanups.empty()) return;
+    for (unsigned i = 0;  i < reclaim_threads.size();  ++i)
+        pthread_join(reclaim_threads[i], 0);
 
-        cleanups.insert(cleanups.end(),
-                        other_cleanups.begin(),
-                        other_cleanups.end());
+    ACE_Guard<ACE_Thread_Mutex> guard(reclaim_lock);
+    reclaim_threads.clear();
+    reclaim_stop = false;
+    max_reclaim_queue_depth = max_queue_depth;
 
-        other_cleanups.clear();
+    for (int i = 0;  i < nthreads;  ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, run_reclamation_thread, 0) != 0)
+            throw Exception("couldn't create reclamation thread");
+        reclaim_threads.push_back(thread);
     }
 
-    void cleanup()
+    num_reclaim_threads = nthreads;
+}
+
+int get_background_reclamation()
+{
+    return num_reclaim_threads;
+}
+
+Reclamation_Stats get_reclamation_stats()
+{
+    Reclamation_Stats result;
     {
-        for (unsigned i = 0;  i != cleanups.size();  ++i)
-            cleanups[i]();
+        ACE_Guard<ACE_Thread_Mutex> guard(reclaim_lock);
+        result = reclaim_stats;
+    }
+
+    ACE_Guard<Adaptive_Lock> guard(pending_lock);
+    result.pending_batches = pending.size();
+    for (unsigned i = 0;  i < pending.size();  ++i)
+        result.pending_cleanups += pending[i].cleanups.count;
+
+    return result;
+}
+
+/// Thread-specific data: scratch space for reclaim().  Freed by
+/// release_thread_state().
+__thread Batches * t_batches = 0;
 
-        if (debug_mode) atomic_add(num_cleanups_outstanding, -cleanups.size());
-        
-        cleanups.clear();
+void release_batches()
+{
+    delete t_batches;
+    t_batches = 0;
+}
+
+/// Run whatever pending cleanups are no longer needed by a critical
+/// section.  Must be called from outside a critical section.
+void reclaim()
+{
+    if (JML_UNLIKELY(!t_batches)) {
+        register_thread_state();
+        t_batches = new Batches();
     }
-};
 
-/// Thread-specific data: what is the thread's critical info structure.  Null
-/// if the thread is not in a critical section.
-__thread Critical_Info * t_critical = 0;
+    Batches & batches = *t_batches;
+
+    for (;;) {
+        // The batches must be taken before the records are scanned;
+        // otherwise we could take a batch whose objects are used by a
+        // thread that entered after our scan.
+        batches.clear();
+        pending_lock.acquire();
+        batches.swap(pending);
+        num_pending = 0;
+        oldest_pending_epoch = (uint64_t)-1;
+        pending_lock.release();
+
+        if (batches.empty()) return;
+
+        memory_barrier();
+
+        atomic_add(reclaim_stats.scans, 1);
+
+        uint64_t current = gc_epoch;
+        uint64_t oldest = oldest_epoch_in_use();
+
+        // If no critical section is from before the current epoch, move on
+        // so that the ones that start from now don't hold up what's left.
+        if (oldest >= current)
+            __sync_bool_compare_and_swap(&gc_epoch, current, current + 1);
+
+        Cleanup_List ready = { 0, 0, 0 };
+        uint64_t oldest_deferred = (uint64_t)-1;
+        int ndeferred = 0;
+
+        pending_lock.acquire();
+        for (unsigned i = 0;  i != batches.size();  ++i) {
+            Cleanup_Batch & batch = batches[i];
+            if (batch.epoch < oldest) ready.splice(batch.cleanups);
+            else {
+                oldest_deferred = std::min(oldest_deferred, batch.epoch);
+                add_pending_locked(batch.epoch, batch.cleanups);
+                ++ndeferred;
+            }
+        }
+        pending_lock.release();
 
+        if (debug_mode && ndeferred)
+            atomic_add(num_batches_deferred, ndeferred);
 
-/// The structure that was allocated
-__thread Critical_Info * t_critical_alloc = 0;
+        if (num_reclaim_threads && !ready.empty())
+            queue_for_reclamation(ready);
 
+        // Cleanups can schedule further cleanups (and so call back into
+        // here), so nothing can be held or in use whilst they run
+        if (!ready.empty()) {
+            atomic_add(reclaim_stats.batches_inline, 1);
+            ready.run();
+        }
 
-/// The quick queue for local cleanups; to be transferred to the newest one
-/// once the thread finishes
-__thread Cleanups * t_cleanups = 0;
+        if (ndeferred == 0) return;
 
-/// Thread-specific data: nesting level of the current thread.
-__thread uint32_t t_nesting = 0;
+        // If whatever is holding up the deferred batches is still in its
+        // critical section, it will find them when it leaves.  Otherwise
+        // it may have missed them, so we go around again.
+        memory_barrier();
+        if (oldest_epoch_in_use() <= oldest_deferred) return;
+    }
+}
 
+void wait_for_reclamation()
+{
+    if (!t_nesting) reclaim();
+
+    ACE_Guard<ACE_Thread_Mutex> guard(reclaim_lock);
+    while (!reclaim_queue.empty() || reclaim_busy > 0)
+        reclaim_idle.wait();
+}
 
 void enter_critical()
 {
-    if (t_critical != 0) {
-        ++t_nesting;
-        return;
-    }
-    
-    if (JML_UNLIKELY(!t_critical_alloc))
-        t_critical_alloc = new Critical_Info();
-    
-    t_critical = t_critical_alloc;
-    if (t_critical->live)
-        throw Exception("entered critical section with live t_critical");
-    
-    Critical_Guard guard;
-    t_critical->insert();
-    ++t_nesting;
-    ++num_in_critical;
+    if (t_nesting++ > 0) return;
+
+    Thread_Record * record = t_record;
+    if (JML_UNLIKELY(!record))
+        record = allocate_thread_record();
+
+    record->epoch = gc_epoch;
+
+    // Our record must be visible before we read anything protected
+    memory_barrier();
+
     check_invariants();
 }
 
 void leave_critical()
 {
-    if (t_nesting == 0 || !t_critical) {
+    if (t_nesting == 0) {
         cerr << "badly nested critical sections" << endl;
         throw Exception("badly nested critical sections");
     }
     --t_nesting;
     if (t_nesting > 0) return;
 
-    // We can't call cleanups with the lock held
-    {
-        Critical_Guard guard;
-
-        // Our local list of things to clean up gets transferred to the
-        // list of the newest one
-        if (t_cleanups)
-            newest_ci->take_cleanups_from(*t_cleanups);
-        
-        t_critical->remove();
-        t_critical = 0;
-        --num_in_critical;
-        check_invariants();
-    }
+    uint64_t entered = t_record->epoch;
 
-    t_critical_alloc->cleanup();
+    // Finish our reads before we are seen to have left
+    memory_barrier();
+    t_record->epoch = 0;
+    memory_barrier();
 
-    if (debug_mode) {
-        Critical_Guard guard;
-        check_invariants();
+    if (!t_cleanups.empty()) {
+        add_pending(t_cleanups);
+        reclaim();
     }
+    else if (num_pending && entered <= oldest_pending_epoch) reclaim();
+
+    check_invariants();
 }
 
 void new_critical()
@@ -416,86 +770,50 @@ void new_critical()
     enter_critical();
 }
 
-void schedule_cleanup(const Cleanup & cleanup)
+void schedule_raw_cleanup(Cleanup_Function function, void * arg1, void * arg2)
 {
-    /* NOTE: concurrency notes
-
-       This function is called without any lock whatsoever.  As a result, the
-       newest_ci field could be changing at the same time.
-
-       Note that:
-       1.  The Cleanup_Info structures, once live, never disappear, so the
-           newest_ci pointer will always point to a valid structure.  (NOTE:
-           this is not true in the case of a thread exiting, but it will be
-           possible to deal with that).
-       2.  If the newest_ci pointer changes, it will always represent a later
-           critical section, which could also take care of cleaning up.
-       3.  The main complication is when we end up pointing to a Cleanup_Info
-           structure that is concurrently either a) having new cleanups added
-           to it via the take_cleanups_from method, or b) having new cleanups
-           removed.
-    */
-
-    if (JML_UNLIKELY(!t_critical)) {
-        // Slow path: not in a critical section
-        // We need to add the value to the newest_ci if it exists, or otherwise
-        // just clean it up straight away.
-        Critical_Guard guard;  // TO REMOVE IF POSSIBLE
-
-        if (newest_ci) {
-            if (debug_mode) atomic_add(num_added_newest, 1);
-            newest_ci->add_cleanup(cleanup);
-        }
-        else {
-            cleanup();
-            if (debug_mode) atomic_add(num_cleaned_immediately, 1);
-        }
-
+    if (debug_mode) atomic_add(num_cleanups_outstanding, 1);
+
+    if (JML_UNLIKELY(!t_nesting)) {
+        // Slow path: not in a critical section.  We make a batch of our
+        // own; if nothing is in a critical section, reclaim() will run it
+        // straight away.
+        if (debug_mode) atomic_add(num_added_outside, 1);
+
+        Cleanup_List cleanups = { 0, 0, 0 };
+        cleanups.add(function, arg1, arg2);
+        add_pending(cleanups);
+        reclaim();
         return;
     }
 
-    // No local cleanup list?  We can return
-    if (JML_UNLIKELY(!t_cleanups))
-        t_cleanups = new Cleanups();
+    if (debug_mode) atomic_add(num_added_local, 1);
+    t_cleanups.add(function, arg1, arg2);
+}
 
-    if (debug_mode) {
-        atomic_add(num_cleanups_outstanding, 1);
-        atomic_add(num_added_local, 1);
-    }
-    t_cleanups->push_back(cleanup);
+void schedule_cleanup(const Cleanup & cleanup)
+{
+    schedule_raw_cleanup(run_function_cleanup, new Cleanup(cleanup), 0);
 }
 
 void check_invariants()
 {
     if (!debug_mode) return;
 
-    if (num_in_critical == 0) {
-        if (t_critical)
-            throw Exception("num_in_critical == 0 but t_critical != 0");
-        if (newest_ci)
-            throw Exception("num_in_critical == 0 but newest_ci != 0");
-    }
-    if (num_in_critical != 0) {
-        if (t_critical && t_critical->live != true)
-            throw Exception("t_critical->live != true");
-        if (!newest_ci)
-            throw Exception("num_in_critical != 0 but newest_ci == 0");
-        if (newest_ci->live != true)
-            throw Exception("newest_ci->live != true");
-        if (newest_ci->next != 0)
-            throw Exception("newest_ci->next != 0");
-        if (num_in_critical == 1) {
-            if (t_critical && t_critical != newest_ci)
-                throw Exception("only one in critical and we're in critical but t_critical != newest_ci");
-            if (newest_ci->prev != 0)
-                throw Exception("one in critical but newest_ci->prev != 0");
-        }
-    }
+    if (t_nesting && (!t_record || t_record->epoch == 0))
+        throw Exception("in critical section but thread record not active");
+    if (!t_nesting && t_record && t_record->epoch != 0)
+        throw Exception("not in critical section but thread record active");
+    if (!t_nesting && !t_cleanups.empty())
+        throw Exception("cleanups left over after critical section");
 }
 
 int get_num_in_critical()
 {
-    return num_in_critical;
+    int result = 0;
+    for (Thread_Record * r = thread_records;  r;  r = r->next)
+        if (r->epoch != 0) ++result;
+    return result;
 }
 
 int get_num_cleanups_outstanding()
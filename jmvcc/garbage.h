@@ -11,6 +11,11 @@
 
 #include <boost/function.hpp>
 #include <boost/bind.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/aligned_storage.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <boost/type_traits/has_trivial_destructor.hpp>
+#include <cstring>
 #include "jml/arch/atomic_ops.h"
 #include "jml/arch/cmp_xchg.h"
 
@@ -54,6 +59,94 @@ typedef boost::function<void ()> Cleanup;
 /// Schedule a cleanup.  Has to be called when in a critical section.
 void schedule_cleanup(const Cleanup & cleanup);
 
+/// Low level cleanup: a function called with two words of payload
+typedef void (*Cleanup_Function) (void * arg1, void * arg2);
+
+/** Schedule a cleanup that calls function(arg1, arg2).  Unlike with a
+    boost::function, nothing needs to be allocated.
+*/
+void schedule_raw_cleanup(Cleanup_Function function, void * arg1,
+                          void * arg2 = 0);
+
+template<typename Fn>
+struct Small_Cleanup {
+    static void run(void * arg1, void * arg2)
+    {
+        // Copied out rather than cast so that the words aren't accessed
+        // through a pointer to an unrelated type
+        void * words[2] = { arg1, arg2 };
+        typename boost::aligned_storage<sizeof(Fn),
+            boost::alignment_of<Fn>::value>::type storage;
+        std::memcpy(&storage, words, sizeof(Fn));
+        Fn & fn = *static_cast<Fn *>(static_cast<void *>(&storage));
+        fn();
+    }
+};
+
+/** Schedule a small function object without allocating.  It is copied
+    bitwise into the cleanup record, so it must be no bigger than two
+    pointers, be bitwise copyable and have a trivial destructor.
+*/
+template<typename Fn>
+void schedule_small_cleanup(const Fn & fn)
+{
+    BOOST_STATIC_ASSERT(sizeof(Fn) <= 2 * sizeof(void *));
+    BOOST_STATIC_ASSERT(boost::has_trivial_destructor<Fn>::value);
+    void * words[2] = { 0, 0 };
+    std::memcpy(words, &fn, sizeof(Fn));
+    schedule_raw_cleanup(&Small_Cleanup<Fn>::run, words[0], words[1]);
+}
+
+
+/** Statistics about the cleanups that have been run. */
+struct Reclamation_Stats {
+    Reclamation_Stats()
+        : pending_batches(0), pending_cleanups(0),
+          queue_depth(0), max_queue_depth(0), batches_inline(0),
+          batches_background(0), cleanups_background(0),
+          total_latency(0.0), max_latency(0.0), scans(0)
+    {
+    }
+
+    /// Batches waiting for the critical sections that could be using them
+    /// to finish, and the number of cleanups in them
+    size_t pending_batches;
+    size_t pending_cleanups;
+
+    size_t queue_depth;          ///< Batches waiting for a background thread
+    size_t max_queue_depth;      ///< Highest that queue_depth has been
+    size_t batches_inline;       ///< Batches run by the thread that found them
+    size_t batches_background;   ///< Batches run by a background thread
+    size_t cleanups_background;  ///< Cleanups run by a background thread
+
+    /// Seconds between a batch being queued and a background thread
+    /// finishing it; summed and maximum.
+    double total_latency;
+    double max_latency;
+
+    /// Times that the thread records were scanned to find ready batches
+    size_t scans;
+};
+
+/** Run cleanups on nthreads background threads rather than in the thread
+    that leaves the critical section that was holding them up.  If more
+    than max_queue_depth batches are waiting, the thread that leaves the
+    critical section runs them itself.  Passing zero goes back to running
+    them inline (the default).  Waits for the cleanups already queued to
+    finish.  Must not be called from within a cleanup.
+*/
+void set_background_reclamation(int nthreads, size_t max_queue_depth = 1024);
+
+/** Return the number of background reclamation threads. */
+int get_background_reclamation();
+
+/** Wait until the background threads have run all cleanups that are ready.
+    If not in a critical section, first looks for newly ready cleanups.
+*/
+void wait_for_reclamation();
+
+Reclamation_Stats get_reclamation_stats();
+
 
 // Debug only
 void set_debug_mode(bool debug_mode_on);
@@ -73,10 +166,8 @@ struct RCU {
 
     ~RCU()
     {
-        Deleter d;
-        
         if (data != 0)
-            schedule_cleanup(boost::bind(d, data));
+            schedule_raw_cleanup(&RCU::run_deleter, data);
     }
 
     const Data * read() const
@@ -98,10 +189,8 @@ struct RCU {
 
     bool publish(const Data * old_data, Data * new_data)
     {
-        // For the moment, the commit lock is held when we update this, so
-        // there is no possibility of conflict.  But if ever we decide to
-        // allow for parallel commits, then we need to be more careful here
-        // to do it atomically.
+        // Commits may now run in parallel, so we publish atomically and
+        // let the loser clean up its new data.
         ML::memory_barrier();
 
         bool result = cmp_xchg(reinterpret_cast<Data * &>(data),
@@ -112,8 +201,8 @@ struct RCU {
             Deleter d;
             d(new_data);
         }
-        else schedule_cleanup(boost::bind(Deleter(),
-                                          const_cast<Data *>(old_data)));
+        else schedule_raw_cleanup(&RCU::run_deleter,
+                                  const_cast<Data *>(old_data));
         
         return result;
     }
@@ -121,6 +210,12 @@ struct RCU {
 
 private:
     mutable Data * data;
+
+    static void run_deleter(void * data, void *)
+    {
+        Deleter d;
+        d(reinterpret_cast<Data *>(data));
+    }
 };
 
 } // namespace JMVCC
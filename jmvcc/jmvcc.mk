@@ -3,9 +3,15 @@ JMVCC_SOURCES := \
 	sandbox.cc \
 	transaction.cc \
 	versioned_object.cc \
-	garbage.cc
+	garbage.cc \
+	arena.cc \
+	contention.cc \
+	adaptive_lock.cc \
+	versioned_counter.cc \
+	stats.cc \
+	slab_allocator.cc
 
-JMVCC_LINK :=  boost_date_time-mt
+JMVCC_LINK :=  boost_date_time-mt rt
 
 $(eval $(call library,jmvcc,$(JMVCC_SOURCES),$(JMVCC_LINK)))
 
@@ -8,9 +8,32 @@
 #ifndef __jmvcc__jmvcc_defs_h__
 #define __jmvcc__jmvcc_defs_h__
 
+#include <stdint.h>
+
 namespace JMVCC {
 
+/** Epochs are 32 bits by default.  Commits fail once 2^32 of them have
+    happened, unless Snapshot_Info::compress_epochs() is run first to
+    renumber the epochs that are in use, which stops all commits while it
+    runs.
+
+    Building with JMVCC_64BIT_EPOCHS defined (JMVCC_64BIT_EPOCHS=1 on the
+    make command line) makes them 64 bits, which never run out, so that
+    compress_epochs() is never needed.  It doubles the size of every
+    epoch that an object stores:
+    - Versioned2 stores none whilst it only has its inline value, and one
+      per version once it has a version table;
+    - Versioned stores one per entry in its history, including the current
+      value;
+    - Versioned_Small always stores one for each of its slots;
+    - TypedPVO always reads through its version table, so every object has
+      a valid_to column with one per version, even when there is only one.
+*/
+#if JMVCC_64BIT_EPOCHS
+typedef uint64_t Epoch;
+#else
 typedef unsigned Epoch;
+#endif
 
 class Snapshot;
 class Versioned_Object;
@@ -7,8 +7,10 @@
 
 #include "sandbox.h"
 #include "transaction.h"
+#include "stats.h"
 #include "jml/arch/atomic_ops.h"
 #include "jml/arch/demangle.h"
+#include <algorithm>
 
 using namespace std;
 using namespace ML;
@@ -16,6 +18,216 @@ using namespace ML;
 namespace JMVCC {
 
 
+/*****************************************************************************/
+/* COMMIT STRIPES                                                            */
+/*****************************************************************************/
+
+/* In order for two commits to proceed at the same time, they need to have
+   disjoint write sets.  Each object maps onto one of a fixed number of
+   locks (stripes).  A commit takes all of the stripes for the objects in its
+   sandbox (in increasing order, to avoid deadlock) before it is given an
+   epoch, and releases them once everything is committed or rolled back.
+
+   Two commits that touch the same object are therefore serialized, and the
+   epochs for any given object are handed out in the order in which the
+   commits happen.  Two commits that map onto disjoint stripes can run setup
+   and commit at the same time; only the publication of their epochs is
+   ordered (see publish_commit_epoch()).
+*/
+
+enum { NUM_COMMIT_STRIPES = 1024 };
+
+Adaptive_Lock commit_stripe_locks[NUM_COMMIT_STRIPES];
+
+inline unsigned commit_stripe(const Versioned_Object * obj)
+{
+    size_t val = reinterpret_cast<size_t>(obj) >> 4;
+    return (val ^ (val >> 10) ^ (val >> 20)) % NUM_COMMIT_STRIPES;
+}
+
+Commit_Stripes::
+Commit_Stripes()
+    : normalized(true), locked(false)
+{
+}
+
+Commit_Stripes::
+~Commit_Stripes()
+{
+    release();
+}
+
+void
+Commit_Stripes::
+add(const Versioned_Object * obj)
+{
+    if (locked)
+        throw Exception("Commit_Stripes::add(): already locked");
+    stripes.push_back(commit_stripe(obj));
+    normalized = false;
+}
+
+void
+Commit_Stripes::
+add(const Commit_Stripes & other)
+{
+    if (locked)
+        throw Exception("Commit_Stripes::add(): already locked");
+    stripes.insert(stripes.end(), other.stripes.begin(), other.stripes.end());
+    normalized = false;
+}
+
+void
+Commit_Stripes::
+clear()
+{
+    if (locked)
+        throw Exception("Commit_Stripes::clear(): already locked");
+    stripes.clear();
+    normalized = true;
+}
+
+void
+Commit_Stripes::
+normalize() const
+{
+    if (normalized) return;
+    std::sort(stripes.begin(), stripes.end());
+    stripes.erase(std::unique(stripes.begin(), stripes.end()),
+                  stripes.end());
+    normalized = true;
+}
+
+bool
+Commit_Stripes::
+intersects(const Commit_Stripes & other) const
+{
+    normalize();
+    other.normalize();
+
+    vector<unsigned>::const_iterator
+        it = stripes.begin(), end = stripes.end(),
+        jt = other.stripes.begin(), jend = other.stripes.end();
+
+    while (it != end && jt != jend) {
+        if (*it < *jt) ++it;
+        else if (*jt < *it) ++jt;
+        else return true;
+    }
+
+    return false;
+}
+
+void
+Commit_Stripes::
+acquire()
+{
+    if (locked)
+        throw Exception("Commit_Stripes::acquire(): already locked");
+
+    normalize();
+
+    for (unsigned i = 0;  i < stripes.size();  ++i)
+        commit_stripe_locks[stripes[i]].acquire();
+
+    locked = true;
+}
+
+void
+Commit_Stripes::
+release()
+{
+    if (!locked) return;
+
+    for (int i = stripes.size() - 1;  i >= 0;  --i)
+        commit_stripe_locks[stripes[i]].release();
+
+    locked = false;
+}
+
+Adaptive_Lock::Stats
+Commit_Stripes::
+lock_stats()
+{
+    Adaptive_Lock::Stats result;
+    for (unsigned i = 0;  i < NUM_COMMIT_STRIPES;  ++i)
+        result += commit_stripe_locks[i].stats();
+    return result;
+}
+
+/* Claims on the stripes by transactions that are barging (see
+   contention.h).  Each holds the highest priority that claims it, or zero.
+   They are only advisory, so they're not protected by the stripe locks. */
+
+uint64_t stripe_claims[NUM_COMMIT_STRIPES];
+
+/// Number of the stripe_claims that are non-zero
+size_t num_stripes_claimed = 0;
+
+void
+Commit_Stripes::
+claim(uint64_t priority)
+{
+    if (locked)
+        throw Exception("Commit_Stripes::claim(): already locked");
+
+    normalize();
+
+    // Keep only the stripes where our claim went in, so that unclaim()
+    // leaves the others alone
+    unsigned kept = 0;
+    for (unsigned i = 0;  i < stripes.size();  ++i) {
+        uint64_t * claim = &stripe_claims[stripes[i]];
+        bool claimed = false;
+        for (;;) {
+            uint64_t old = *claim;
+            if (old >= priority) break;
+            if (__sync_bool_compare_and_swap(claim, old, priority)) {
+                if (old == 0) atomic_add(num_stripes_claimed, 1);
+                claimed = true;
+                break;
+            }
+        }
+        if (claimed) stripes[kept++] = stripes[i];
+    }
+
+    stripes.resize(kept);
+}
+
+void
+Commit_Stripes::
+unclaim(uint64_t priority)
+{
+    if (locked)
+        throw Exception("Commit_Stripes::claim(): already locked");
+
+    normalize();
+
+    // If there's a different value there, it belongs to someone else
+    for (unsigned i = 0;  i < stripes.size();  ++i)
+        if (__sync_bool_compare_and_swap(&stripe_claims[stripes[i]],
+                                         priority, 0))
+            atomic_add(num_stripes_claimed, -1);
+}
+
+bool
+Commit_Stripes::
+any_claimed()
+{
+    return num_stripes_claimed != 0;
+}
+
+uint64_t
+Commit_Stripes::
+max_claim() const
+{
+    uint64_t result = 0;
+    for (unsigned i = 0;  i < stripes.size();  ++i)
+        result = std::max<uint64_t>(result, stripe_claims[stripes[i]]);
+    return result;
+}
+
+
 /*****************************************************************************/
 /* SANDBOX::LOCAL_VALUES                                                     */
 /*****************************************************************************/
@@ -150,6 +362,7 @@ clear()
 {
     local_values.do_in_order(Free_Values());
     local_values.clear();
+    arena.reset();
 }
 
 struct Sandbox::Check_Values {
@@ -168,22 +381,72 @@ struct Sandbox::Check_Values {
     }
 };
 
+struct Sandbox::Prepare_Commit {
+    Prepare_Commit(Epoch old_epoch, vector<void *> & prepared)
+        : old_epoch(old_epoch), prepared(prepared)
+    {
+    }
+
+    Epoch old_epoch;
+    vector<void *> & prepared;
+
+    bool operator () (Versioned_Object * obj, Entry & entry)
+    {
+        if (entry.automatic) return true;
+        prepared.push_back(obj->prepare(old_epoch, entry.val));
+        return true;
+    }
+};
+
+struct Sandbox::Unprepare_Commit {
+    Unprepare_Commit(const Commit_State & state)
+        : state(state), index(0)
+    {
+    }
+
+    const Commit_State & state;
+    int index;
+
+    bool operator () (Versioned_Object * obj, Entry & entry)
+    {
+        if (entry.automatic) return true;
+        if (index >= state.prepared.size()) return false;
+
+        // Those that were set up belong to commit() or rollback()
+        if (index >= state.commit_data.size())
+            obj->unprepare(entry.val, state.prepared[index]);
+        ++index;
+        return true;
+    }
+};
+
 struct Sandbox::Setup_Commit {
     Setup_Commit(Epoch old_epoch, Epoch new_epoch,
-                 vector<void *> & commit_data)
-        : old_epoch(old_epoch), new_epoch(new_epoch), commit_data(commit_data)
+                 const vector<void *> & prepared,
+                 vector<void *> & commit_data,
+                 Versioned_Object * & current)
+        : old_epoch(old_epoch), new_epoch(new_epoch), prepared(prepared),
+          commit_data(commit_data), current(current)
     {
     }
 
     Epoch old_epoch, new_epoch;
+    const vector<void *> & prepared;
     vector<void *> & commit_data;
+    Versioned_Object * & current;  ///< Object being set up, for exceptions
 
     bool operator () (Versioned_Object * obj, Entry & entry)
     {
         if (entry.automatic) {
             return true;
         }
-        void * result = obj->setup(old_epoch, new_epoch, entry.val);
+        current = obj;
+
+        size_t index = commit_data.size();
+        if (index >= prepared.size())
+            throw Exception("Sandbox::Setup_Commit: object wasn't prepared");
+
+        void * result = obj->setup(old_epoch, new_epoch, prepared[index]);
 
         if (result) commit_data.push_back(result);
         return result;
@@ -231,31 +494,65 @@ struct Sandbox::Rollback {
     }
 };
 
-Epoch
+bool
 Sandbox::
-commit(Epoch old_epoch)
+check_commit(Epoch old_epoch)
 {
-    bool debug = false;
-
     Epoch new_epoch = get_current_epoch() + 1;
 
-    // Check that everything is commitable, before the lock is obtained
     Versioned_Object * failed_object
         = local_values.do_in_order(Check_Values(old_epoch, new_epoch));
-    if (failed_object) {
-        clear();
-        return 0;
+
+    return !failed_object;
+}
+
+void
+Sandbox::
+prepare_commit(Epoch old_epoch, Commit_State & state)
+{
+    state.prepared.clear();
+    state.prepared.reserve(local_values.size());
+    state.commit_data.clear();
+
+    try {
+        local_values.do_in_order(Prepare_Commit(old_epoch, state.prepared));
+    } catch (...) {
+        unprepare_commit(state);
+        throw;
     }
+}
 
-    // Get the lock.  Now only we can commit.
-    ACE_Guard<ACE_Mutex> guard(commit_lock);
+void
+Sandbox::
+unprepare_commit(Commit_State & state)
+{
+    if (state.commit_data.size() < state.prepared.size())
+        local_values.do_in_order(Unprepare_Commit(state));
+    state.prepared.clear();
+}
 
-    new_epoch = get_current_epoch() + 1;
+void
+Sandbox::
+commit_stripes(Commit_Stripes & stripes) const
+{
+    // Note that we include the automatic entries, as they may be modified as
+    // a side effect of committing their children.
+    for (Local_Values::const_iterator
+             it = local_values.begin(),
+             end = local_values.end();
+         it != end;  ++it)
+        stripes.add(it->first);
+}
 
-    // Commit everything
+bool
+Sandbox::
+setup_commit(Epoch old_epoch, Epoch new_epoch, Commit_State & state)
+{
+    bool debug = false;
 
-    vector<void *> commit_data;
-    commit_data.reserve(local_values.size());
+    state.commit_data.clear();
+    state.commit_data.reserve(local_values.size());
+    state.failed_object = 0;
 
     if (debug) {
         cerr << "-------------- before setup" << endl;
@@ -263,20 +560,120 @@ commit(Epoch old_epoch)
         cerr << "--------------" << endl << endl;
     }
 
-    Setup_Commit setup_commit(old_epoch, new_epoch, commit_data);
-    failed_object = local_values.do_in_order(setup_commit);
+    Versioned_Object * current = 0;
+    Setup_Commit setup_commit(old_epoch, new_epoch, state.prepared,
+                              state.commit_data, current);
+    try {
+        state.failed_object = local_values.do_in_order(setup_commit);
+    } catch (...) {
+        // The object that threw didn't set anything up
+        state.failed_object = current;
+        throw;
+    }
 
     if (debug) {
         cerr << "setup_commit done: commit_data.size() = "
-             << commit_data.size() << " failed_object = " << failed_object
-             << endl;
+             << state.commit_data.size() << " failed_object = "
+             << state.failed_object << endl;
 
         cerr << "-------------- after setup" << endl;
         dump(cerr);
         cerr << "--------------" << endl << endl;
     }
 
-    bool commit_succeeded = !failed_object;
+    return !state.failed_object;
+}
+
+void
+Sandbox::
+rollback_commit(Epoch new_epoch, Commit_State & state)
+{
+    Rollback rollback(new_epoch, state.commit_data);
+    local_values.do_in_order(rollback, 0, state.failed_object);
+    unprepare_commit(state);
+}
+
+void
+Sandbox::
+confirm_commit(Epoch new_epoch, Commit_State & state)
+{
+    // The objects register their old versions to be cleaned up as they
+    // commit; we register them all at once at the end (or once the
+    // stripes are released, if the caller has a buffer of its own).
+    Cleanup_Buffer cleanups;
+
+    Commit commit(new_epoch, state.commit_data);
+    local_values.do_in_order(commit);
+
+    cleanups.flush();
+}
+
+Epoch
+Sandbox::
+commit(Epoch old_epoch)
+{
+    Commit_Timer timer;
+
+    // Check that everything is commitable, before any lock is obtained
+    bool ok = check_commit(old_epoch);
+    timer.phase(PHASE_CHECK);
+    if (!ok) {
+        timer.aborted(ABORT_CHECK);
+        clear();
+        return 0;
+    }
+
+    // Do the expensive part of the setup whilst nothing is locked.  This
+    // may add local values (for parents that need to be committed too), so
+    // it has to come before we work out the stripes.
+    Commit_State state;
+    prepare_commit(old_epoch, state);
+    timer.phase(PHASE_PREPARE);
+
+    // Lock all of the objects that we are going to commit.  Nothing else
+    // can commit these objects until we are done, but commits of other
+    // objects can proceed in parallel.
+    Commit_Stripes stripes;
+    commit_stripes(stripes);
+    stripes.acquire();
+    timer.phase(PHASE_LOCK);
+
+    // The old versions are registered for cleanup once the stripes have
+    // been released
+    Cleanup_Buffer cleanups;
+
+    // Get our epoch.  It won't become current until we publish it.
+    Epoch new_epoch;
+    try {
+        new_epoch = allocate_commit_epoch();
+    } catch (...) {
+        unprepare_commit(state);
+        clear();
+        throw;
+    }
+    timer.phase(PHASE_EPOCH);
+
+    bool commit_succeeded;
+
+    try {
+        commit_succeeded = setup_commit(old_epoch, new_epoch, state);
+    } catch (...) {
+        // Undo what was set up, and don't hold up the commits that come
+        // after us
+        if (state.failed_object)
+            rollback_commit(new_epoch, state);
+        else unprepare_commit(state);
+        abandon_commit_epoch(new_epoch);
+        finish_commit();
+
+        // The objects that were set up may have taken their local values
+        // (see Versioned_Object::prepare()), so what's left in the sandbox
+        // can't be committed again.  As when a commit fails, the caller
+        // starts again from scratch.
+        clear();
+        throw;
+    }
+    timer.phase(PHASE_SETUP);
 
     if (commit_succeeded) {
         // The setup succeeded.  This means that the commit is guaranteed to
@@ -291,27 +688,38 @@ commit(Epoch old_epoch)
         // could be created with the old epoch.  These transactions might
         // need the values being cleaned up, racing with the creation
         // process.
-        set_current_epoch(new_epoch);
-
-        // Make sure these writes are seen before we clean up
-        memory_barrier();
+        //
+        // This also waits for any commits with earlier epochs to be
+        // published first.
+        publish_commit_epoch(new_epoch);
+        timer.phase(PHASE_PUBLISH);
 
         // Success: we are in a new epoch
-        Commit commit(new_epoch, commit_data);
-        local_values.do_in_order(commit);
+        confirm_commit(new_epoch, state);
+        timer.phase(PHASE_CONFIRM);
+        timer.committed();
     }
     else {
         // The setup failed.  We need to rollback everything that was setup.
-        Rollback rollback(new_epoch, commit_data);
-        local_values.do_in_order(rollback, 0, failed_object);
+        rollback_commit(new_epoch, state);
+        timer.phase(PHASE_CONFIRM);
+        abandon_commit_epoch(new_epoch);
+        timer.phase(PHASE_PUBLISH);
+        timer.aborted(ABORT_SETUP);
     }
+
+    stripes.release();
+
+    // Our snapshot is still registered, so nothing we are cleaning up can
+    // go away yet.  This has to happen before finish_commit(), so that
+    // compress_epochs() can't rename the epochs underneath it.
+    cleanups.flush();
+
+    finish_commit();
     
-    guard.release();
-    
-    // TODO: for failed transactions, we'd do better to keep the
-    // structure to avoid reallocations
     // TODO: clear as we go to better use cache
     clear();
+    timer.phase(PHASE_RELEASE);
     
     return (commit_succeeded ? new_epoch : 0);
 }
@@ -12,12 +12,80 @@
 #include "jml/utils/lightweight_hash.h"
 #include "jml/utils/string_functions.h"
 #include "versioned_object.h"
+#include "arena.h"
+#include "adaptive_lock.h"
 #include <boost/tuple/tuple.hpp>
+#include <boost/utility.hpp>
+#include <vector>
+#include <stdint.h>
 
 
 namespace JMVCC {
 
 
+/*****************************************************************************/
+/* COMMIT_STRIPES                                                            */
+/*****************************************************************************/
+
+/** The set of commit stripes (locks) covering the objects of one or more
+    sandboxes.  Commits whose stripes don't intersect can run at the same
+    time; see the comment in sandbox.cc.
+*/
+
+struct Commit_Stripes : boost::noncopyable {
+    Commit_Stripes();
+
+    ~Commit_Stripes();
+
+    /// Add the stripe for the given object.  Can't be called once locked.
+    void add(const Versioned_Object * obj);
+
+    /// Add all of the stripes of another set.  Can't be called once locked.
+    void add(const Commit_Stripes & other);
+
+    /// Do the two sets have any stripe in common?
+    bool intersects(const Commit_Stripes & other) const;
+
+    /// Lock all of the stripes, in increasing order to avoid deadlock
+    void acquire();
+
+    /// Unlock everything that was locked by acquire()
+    void release();
+
+    /** Claim all of the stripes with the given (non-zero) priority, for
+        barging; see contention.h.  A stripe already claimed with the same
+        or a higher priority keeps that claim, and is removed from the set
+        so that unclaim() won't touch it.  Can't be called once locked. */
+    void claim(uint64_t priority);
+
+    /// Remove the claims that claim() made with the given priority
+    void unclaim(uint64_t priority);
+
+    /// Highest priority with which any of the stripes is claimed; 0 if none
+    uint64_t max_claim() const;
+
+    /** Is any stripe claimed at all?  Much cheaper than working out a set of
+        stripes to call max_claim() on. */
+    static bool any_claimed();
+
+    bool empty() const { return stripes.empty(); }
+
+    /// Remove all of the stripes.  Can't be called once locked.
+    void clear();
+
+    /// Contention statistics for all of the stripe locks together
+    static Adaptive_Lock::Stats lock_stats();
+
+private:
+    void normalize() const;
+
+    mutable std::vector<unsigned> stripes;
+    mutable bool normalized;
+    bool locked;
+};
+
+
+
 /*****************************************************************************/
 /* SANDBOX                                                                   */
 /*****************************************************************************/
@@ -44,6 +112,11 @@ class Sandbox {
        AFTER the given object.  We keep a linked list that gives the order
        of traversal; when we add an object we make sure to add it before its
        parent.
+
+       The local values themselves are allocated from an arena, and the
+       memory is all given back at once when the sandbox is cleared.  The
+       arena and the hash table both keep their memory when cleared, so that
+       a transaction that is retried doesn't need to allocate anything.
     */
 
     struct Entry {
@@ -138,17 +211,27 @@ class Sandbox {
         using Local_Values_Base::begin;
 
 
+        /** Remove everything.  The table keeps its capacity unless it's
+            much bigger than what we were using, so that one huge
+            transaction doesn't make every later clear() slow. */
         void clear()
         {
-            Local_Values_Base::clear();
+            if (capacity() > 1024 && capacity() > 16 * size())
+                Local_Values_Base::destroy();
+            else Local_Values_Base::clear();
             head = tail = 0;
         }
     };
 
     Local_Values local_values;
 
+    /// Memory for the local values
+    Arena arena;
+
     struct Free_Values;
     struct Check_Values;
+    struct Prepare_Commit;
+    struct Unprepare_Commit;
     struct Setup_Commit;
     struct Commit;
     struct Rollback;
@@ -182,8 +265,9 @@ public:
             = local_values.insert(obj);
 
         if (inserted || entry->automatic) {
-            entry->val = malloc(sizeof(T));
-            new (entry->val) T(initial_value);
+            void * mem = arena.allocate(sizeof(T), __alignof__(T));
+            new (mem) T(initial_value);
+            entry->val = mem;
             entry->automatic = false;
         }
 
@@ -202,16 +286,19 @@ public:
         return local_value(const_cast<Versioned_Object *>(obj), initial_value);
     }
 
+    /** Destroy a local value.  Its memory belongs to the arena, and is
+        given back when the sandbox is cleared. */
     template<typename T>
     void free_local_value(void * mem) const
     {
         T * typed = (T *)mem;
         typed->~T();
-        free(mem);
     }
 
     /** Set the local value for the given object.  Returns the previous
-        value and whether or not it existed.
+        value and whether or not it existed.  The value will be destroyed
+        with destroy_local_value() but its memory won't be freed, so it
+        should either be null or belong to something else.
     */
     std::pair<void *, bool>
     set_local_value(Versioned_Object * obj, void * val);
@@ -220,6 +307,62 @@ public:
         failed, or returns the id of the new epoch if it succeeded. */
     Epoch commit(Epoch old_epoch);
 
+    /* The phases of commit(), for when the commits of several sandboxes
+       are driven together (see group commit in transaction.cc).  A commit
+       is made up of:
+       1.  check_commit() and prepare_commit(), with no lock held;
+       2.  locking the commit_stripes() and allocating an epoch;
+       3.  setup_commit() under the new epoch;
+       4.  if the setup failed, rollback_commit() and abandoning the epoch;
+           otherwise, publishing the epoch and then confirm_commit();
+       5.  releasing the stripes, registering the old versions for cleanup
+           and calling clear().
+
+       The stripes are held only for steps 2 to 4, so anything expensive
+       should be done in prepare_commit() or after the stripes are
+       released.
+    */
+
+    /// State carried between the phases of a commit
+    struct Commit_State {
+        Commit_State()
+            : failed_object(0)
+        {
+        }
+
+        std::vector<void *> prepared;     ///< From prepare(), in order
+        std::vector<void *> commit_data;  ///< From setup(), in order
+        Versioned_Object * failed_object;
+    };
+
+    /// Check that everything can be committed.  False if it can't.
+    bool check_commit(Epoch old_epoch);
+
+    /// Prepare everything to be committed.  Must be called before the
+    /// stripes are taken, as it may add local values.  If it throws, what
+    /// was prepared has already been freed.
+    void prepare_commit(Epoch old_epoch, Commit_State & state);
+
+    /// Add the stripes for everything in the sandbox to the given set
+    void commit_stripes(Commit_Stripes & stripes) const;
+
+    /// Set up everything to commit at the new epoch.  False if it failed,
+    /// in which case rollback_commit() must be called.  If an exception
+    /// is thrown, rollback_commit() must also be called.
+    bool setup_commit(Epoch old_epoch, Epoch new_epoch, Commit_State & state);
+
+    /// Undo a setup_commit() that failed, and free what was prepared for
+    /// the objects that weren't set up
+    void rollback_commit(Epoch new_epoch, Commit_State & state);
+
+    /// Free what was prepared for the objects that weren't set up.  For
+    /// when the commit fails before it gets to setup_commit().
+    void unprepare_commit(Commit_State & state);
+
+    /// Make a setup_commit() that succeeded permanent, once the new epoch
+    /// has been published
+    void confirm_commit(Epoch new_epoch, Commit_State & state);
+
     void dump(std::ostream & stream = std::cerr, int indent = 0) const;
 
     size_t num_local_values() const { return local_values.size(); }
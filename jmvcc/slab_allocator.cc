@@ -0,0 +1,224 @@
+/* slab_allocator.cc
+   Jeremy Barnes, 23 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Allocator for small blocks of a few sizes.
+*/
+
+#include "slab_allocator.h"
+#include "adaptive_lock.h"
+#include "jml/arch/exception.h"
+#include <ace/Synch.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <new>
+
+
+using namespace std;
+using namespace ML;
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* DEPOT                                                                     */
+/*****************************************************************************/
+
+/* The free blocks that no thread has in its cache, for each size class.
+   Blocks move between the depot and the thread caches in batches of half
+   a cache, so that a thread that is allocating (or freeing) steadily only
+   takes the lock once every BATCH operations. */
+
+enum { BATCH = Slab_Allocator::CACHE_LIMIT / 2 };
+
+struct Depot {
+    Adaptive_Lock lock;
+    Slab_Allocator::Free_Block * head;
+    size_t count;
+};
+
+// These have no destructors, so they are still usable by cleanups that run
+// during static destruction
+Depot depots[Slab_Allocator::NUM_CLASSES];
+
+size_t slab_bytes = 0;
+size_t large_allocations = 0;
+
+__thread Slab_Allocator::Thread_Caches Slab_Allocator::t_caches;
+
+
+/*****************************************************************************/
+/* THREAD EXIT                                                               */
+/*****************************************************************************/
+
+/* When a thread exits, everything in its caches goes back to the depot.  A
+   cleanup that runs after this (in another thread exit handler) registers
+   the caches again, which POSIX allows for. */
+
+pthread_key_t slab_cache_key;
+pthread_once_t slab_cache_key_once = PTHREAD_ONCE_INIT;
+
+void release_slab_caches(void * arg)
+{
+    Slab_Allocator::Thread_Caches * caches
+        = reinterpret_cast<Slab_Allocator::Thread_Caches *>(arg);
+
+    caches->registered = false;
+
+    for (unsigned i = 0;  i < Slab_Allocator::NUM_CLASSES;  ++i) {
+        Slab_Allocator::Thread_Cache & cache = caches->classes[i];
+        if (!cache.head) continue;
+
+        Slab_Allocator::Free_Block * tail = cache.head;
+        while (tail->next) tail = tail->next;
+
+        Depot & depot = depots[i];
+        ACE_Guard<Adaptive_Lock> guard(depot.lock);
+        tail->next = depot.head;
+        depot.head = cache.head;
+        depot.count += cache.count;
+
+        cache.head = 0;
+        cache.count = 0;
+    }
+}
+
+void create_slab_cache_key()
+{
+    if (pthread_key_create(&slab_cache_key, release_slab_caches) != 0)
+        throw Exception("couldn't create slab cache key");
+}
+
+void register_slab_caches(Slab_Allocator::Thread_Caches & caches)
+{
+    pthread_once(&slab_cache_key_once, create_slab_cache_key);
+    pthread_setspecific(slab_cache_key, &caches);
+    caches.registered = true;
+}
+
+
+/*****************************************************************************/
+/* SLAB_ALLOCATOR                                                            */
+/*****************************************************************************/
+
+char *
+Slab_Allocator::
+allocate_slow(int cls)
+{
+    if (!t_caches.registered) register_slab_caches(t_caches);
+
+    Thread_Cache & cache = t_caches.classes[cls];
+    Depot & depot = depots[cls];
+
+    {
+        ACE_Guard<Adaptive_Lock> guard(depot.lock);
+
+        if (!depot.head) {
+            // Carve a new slab into blocks for the depot
+            size_t size = class_size(cls);
+            size_t n = SLAB_SIZE / size;
+
+            char * slab = (char *)malloc(SLAB_SIZE);
+            if (!slab) throw std::bad_alloc();
+            __sync_fetch_and_add(&slab_bytes, SLAB_SIZE);
+
+            for (size_t i = n;  i > 0;  --i) {
+                Free_Block * block
+                    = reinterpret_cast<Free_Block *>(slab + (i - 1) * size);
+                block->next = depot.head;
+                depot.head = block;
+            }
+            depot.count += n;
+        }
+
+        // Take a batch for our cache; the tail of the batch is found by
+        // walking the list
+        Free_Block * first = depot.head;
+        Free_Block * last = first;
+        int n = 1;
+        for (;  n < BATCH && last->next;  ++n)
+            last = last->next;
+
+        depot.head = last->next;
+        depot.count -= n;
+
+        last->next = cache.head;
+        cache.head = first;
+        cache.count += n;
+    }
+
+    Free_Block * result = cache.head;
+    cache.head = result->next;
+    --cache.count;
+    return reinterpret_cast<char *>(result);
+}
+
+void
+Slab_Allocator::
+deallocate_slow(char * ptr, int cls)
+{
+    if (!t_caches.registered) register_slab_caches(t_caches);
+
+    Thread_Cache & cache = t_caches.classes[cls];
+
+    Free_Block * block = reinterpret_cast<Free_Block *>(ptr);
+    block->next = cache.head;
+    cache.head = block;
+    ++cache.count;
+
+    if (cache.count <= CACHE_LIMIT) return;
+
+    // Give the oldest half of the cache to the depot, keeping the blocks
+    // that we freed most recently as they are more likely to be in cache
+    Free_Block * keep_last = cache.head;
+    for (int i = 1;  i < cache.count - BATCH;  ++i)
+        keep_last = keep_last->next;
+
+    Free_Block * first = keep_last->next;
+    Free_Block * last = first;
+    while (last->next) last = last->next;
+
+    keep_last->next = 0;
+    cache.count -= BATCH;
+
+    Depot & depot = depots[cls];
+    ACE_Guard<Adaptive_Lock> guard(depot.lock);
+    last->next = depot.head;
+    depot.head = first;
+    depot.count += BATCH;
+}
+
+char *
+Slab_Allocator::
+allocate_large(size_t bytes)
+{
+    char * result = (char *)malloc(bytes);
+    if (!result) throw std::bad_alloc();
+    __sync_fetch_and_add(&large_allocations, 1);
+    return result;
+}
+
+void
+Slab_Allocator::
+deallocate_large(char * ptr)
+{
+    free(ptr);
+}
+
+Slab_Allocator::Stats
+Slab_Allocator::
+stats()
+{
+    Stats result;
+    result.slab_bytes = slab_bytes;
+    result.large_allocations = large_allocations;
+
+    for (unsigned i = 0;  i < NUM_CLASSES;  ++i) {
+        ACE_Guard<Adaptive_Lock> guard(depots[i].lock);
+        result.depot_blocks += depots[i].count;
+    }
+
+    return result;
+}
+
+} // namespace JMVCC
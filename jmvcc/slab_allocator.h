@@ -0,0 +1,151 @@
+/* slab_allocator.h                                                -*- C++ -*-
+   Jeremy Barnes, 23 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Allocator for small blocks of a few sizes, such as version tables.
+*/
+
+#ifndef __jmvcc__slab_allocator_h__
+#define __jmvcc__slab_allocator_h__
+
+#include "jml/compiler/compiler.h"
+#include <stddef.h>
+#include <stdint.h>
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* SLAB_ALLOCATOR                                                            */
+/*****************************************************************************/
+
+/** Allocator for the small blocks that are allocated and freed on every
+    commit, such as version tables.  Blocks are rounded up to one of a few
+    size classes (every 16 bytes up to 256, then every 64 bytes up to 1024;
+    anything bigger goes to malloc), and carved out of slabs of
+    SLAB_SIZE bytes.
+
+    Each thread has a cache of free blocks of each size class, so that most
+    allocations and frees are a few instructions with no atomic operations.
+    When a thread's cache of a class gets too big (which happens to the
+    thread doing the cleanups, when they are deferred with
+    schedule_cleanup()), half of it goes to a shared depot, from which
+    threads with an empty cache refill themselves.  A block can therefore
+    be freed by any thread, not just the one that allocated it.  A thread's
+    cache goes to the depot when it exits.
+
+    Slabs are never given back to the system; the memory used is that of
+    the most blocks of each size that were ever in use at once.
+
+    All of the state is global, so the allocator itself is empty (and takes
+    no space in a Version_Table), and any copy can free what another
+    allocated.  Blocks are aligned to 16 bytes.
+
+    It has the interface of std::allocator<char> that Version_Table uses.
+*/
+
+struct Slab_Allocator {
+
+    enum {
+        MAX_SMALL = 256,           ///< Size classes every 16 bytes up to here
+        MAX_SIZE = 1024,           ///< Size classes every 64 bytes up to here
+        NUM_CLASSES = MAX_SMALL / 16 + (MAX_SIZE - MAX_SMALL) / 64,
+        SLAB_SIZE = 64 * 1024,     ///< Bytes allocated at once for a class
+        CACHE_LIMIT = 64           ///< Most blocks cached per thread per class
+    };
+
+    static int size_class(size_t bytes)
+    {
+        if (bytes <= MAX_SMALL) return (bytes - 1) >> 4;
+        return MAX_SMALL / 16 + ((bytes - MAX_SMALL - 1) >> 6);
+    }
+
+    static size_t class_size(int cls)
+    {
+        if (cls < MAX_SMALL / 16) return (cls + 1) * 16;
+        return MAX_SMALL + (cls - MAX_SMALL / 16 + 1) * 64;
+    }
+
+    /** A free block, linked through its first word. */
+    struct Free_Block {
+        Free_Block * next;
+    };
+
+    /** One thread's free blocks of one size class. */
+    struct Thread_Cache {
+        Free_Block * head;
+        int count;
+    };
+
+    /** All of a thread's free blocks. */
+    struct Thread_Caches {
+        Thread_Cache classes[NUM_CLASSES];
+
+        /// Set once the caches will be given back when the thread exits
+        bool registered;
+    };
+
+    char * allocate(size_t bytes)
+    {
+        if (JML_UNLIKELY(bytes == 0 || bytes > MAX_SIZE))
+            return allocate_large(bytes);
+
+        Thread_Cache & cache = t_caches.classes[size_class(bytes)];
+        Free_Block * result = cache.head;
+        if (JML_UNLIKELY(!result))
+            return allocate_slow(size_class(bytes));
+
+        cache.head = result->next;
+        --cache.count;
+        return reinterpret_cast<char *>(result);
+    }
+
+    void deallocate(char * ptr, size_t bytes)
+    {
+        if (!ptr) return;
+
+        if (JML_UNLIKELY(bytes == 0 || bytes > MAX_SIZE)) {
+            deallocate_large(ptr);
+            return;
+        }
+
+        Thread_Cache & cache = t_caches.classes[size_class(bytes)];
+        if (JML_UNLIKELY(cache.count >= CACHE_LIMIT || !t_caches.registered)) {
+            deallocate_slow(ptr, size_class(bytes));
+            return;
+        }
+
+        Free_Block * block = reinterpret_cast<Free_Block *>(ptr);
+        block->next = cache.head;
+        cache.head = block;
+        ++cache.count;
+    }
+
+    bool operator == (const Slab_Allocator &) const { return true; }
+    bool operator != (const Slab_Allocator &) const { return false; }
+
+    struct Stats {
+        Stats()
+            : slab_bytes(0), depot_blocks(0), large_allocations(0)
+        {
+        }
+
+        size_t slab_bytes;         ///< Bytes in slabs, over all classes
+        size_t depot_blocks;       ///< Free blocks in the shared depot
+        size_t large_allocations;  ///< Number too big for a size class
+    };
+
+    static Stats stats();
+
+private:
+    static __thread Thread_Caches t_caches;
+
+    char * allocate_slow(int cls);
+    void deallocate_slow(char * ptr, int cls);
+    char * allocate_large(size_t bytes);
+    void deallocate_large(char * ptr);
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__slab_allocator_h__ */
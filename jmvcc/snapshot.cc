@@ -7,6 +7,9 @@
 #include "transaction.h"
 #include "jml/utils/pair_utils.h"
 #include "jml/arch/atomic_ops.h"
+#include "garbage.h"
+#include <deque>
+#include <pthread.h>
 
 
 using namespace std;
@@ -20,6 +23,19 @@ Epoch earliest_epoch_ = 1;
 Snapshot_Info snapshot_info;
 
 
+/*****************************************************************************/
+/* SNAPSHOT_ENTRY                                                            */
+/*****************************************************************************/
+
+void
+Snapshot_Entry::
+add_cleanup(const Cleanup & cleanup)
+{
+    ACE_Guard<Adaptive_Lock> guard(lock);
+    cleanups.push_back(cleanup);
+}
+
+
 /*****************************************************************************/
 /* SNAPSHOT_INFO                                                             */
 /*****************************************************************************/
@@ -154,54 +170,98 @@ Snapshot_Info snapshot_info;
       v900
 */
 
-Epoch
+/* Snapshot Registry
+
+   Transactions are started and restarted much more often than new epochs
+   are created, so most registrations are for the newest entry.  We do those
+   without the lock:
+
+   - A snapshot joins the newest entry by incrementing its reference count,
+     as long as the entry is for the current epoch and the count is not
+     zero.  An entry that has got to zero is being removed, and may not be
+     joined again.
+   - A snapshot that is not the last one in its entry leaves it by
+     decrementing the count.
+
+   Everything else (creating an entry, dropping the last reference and the
+   cleanup handoff described above) happens under the lock.  Whilst the lock
+   is held, every entry in the list has at least one snapshot, as the one
+   that drops the last reference removes the entry before releasing it.
+
+   Entries are freed via the garbage collector, as a thread that is joining
+   the newest entry can still be looking at one that has just been removed.
+*/
+
 Snapshot_Info::
-register_snapshot(Snapshot * snapshot)
+Snapshot_Info()
+    : oldest(0), newest(0), num_entries(0)
 {
-    ACE_Guard<Mutex> guard(lock);
-    snapshot->epoch_ = get_current_epoch();
+}
+
+bool
+Snapshot_Info::
+join_newest(Snapshot * snapshot)
+{
+    bool result = false;
+
+    // Stops the entry from being freed under us
+    enter_critical();
+
+    Epoch epoch = get_current_epoch();
+    Entry * entry = newest;
+
+    if (entry && entry->epoch == epoch) {
+        for (int n = entry->snapshots;  n > 0 && !result;
+             n = entry->snapshots)
+            result = __sync_bool_compare_and_swap(&entry->snapshots, n, n + 1);
+    }
+
+    leave_critical();
+
+    if (result) snapshot->entry_ = entry;
 
-    // TODO: since we know it will be inserted at the end, we can do a more
-    // efficient lookup that only looks at the end.
+    return result;
+}
 
-    Entries::iterator previous_most_recent;
-    if (entries.empty()) previous_most_recent = entries.end();
-    else previous_most_recent = boost::prior(entries.end());
+Epoch
+Snapshot_Info::
+register_snapshot(Snapshot * snapshot)
+{
+    if (join_newest(snapshot))
+        return snapshot->epoch();
 
-    entries[snapshot->epoch_].snapshots.insert(snapshot);
+    ACE_Guard<Mutex> guard(lock);
+    Epoch epoch = get_current_epoch();
 
     /* INVARIANT: a registered snapshot should always go at the end of the
        list of snapshots; it is new and should therefore always be the last
        one.  We check it here. */
-    Entries::iterator it = entries.find(snapshot->epoch_);
-    if (it == entries.end())
-        throw Exception("inserted but not found");
-    if (it != boost::prior(entries.end())) {
+    if (newest && newest->epoch > epoch) {
         cerr << "stale snapshot" << endl;
         dump_unlocked();
-        cerr << "snapshot->epoch_ = " << snapshot->epoch_ << endl;
+        cerr << "epoch = " << epoch << endl;
         throw Exception("inserted stale snapshot");
     }
 
-    /* Since we don't clean up anything based upon the most recent snapshot,
-       we now need to look at what was the most recent snapshot and see if
-       it needs to be cleaned up. */
-    if (previous_most_recent != it && previous_most_recent != entries.end()) {
-        /* Do we need to clean it up? */
-        // NOTE: calling this function RELEASES the lock; we can't tough
-        // entries after.
-        if (previous_most_recent->second.snapshots.empty())
-            perform_cleanup(previous_most_recent, guard);
+    if (newest && newest->epoch == epoch) {
+        // Entries in the list can't be dying as we hold the lock
+        atomic_add(newest->snapshots, 1);
+        snapshot->entry_ = newest;
+        return epoch;
     }
 
-    return snapshot->epoch_;
-}
+    Entry * entry = new Entry(epoch);
+    entry->prev = newest;
+    if (newest) newest->next = entry;
+    else oldest = entry;
+    ++num_entries;
 
-void Snapshot_Info::Entry::
-add_cleanup(const Cleanup_Entry & cleanup)
-{
-    ACE_Guard<Spinlock> guard(lock);
-    cleanups.push_back(cleanup);
+    // Must be fully constructed before join_newest() can see it
+    memory_barrier();
+    newest = entry;
+
+    snapshot->entry_ = entry;
+    return epoch;
 }
 
 void
@@ -210,141 +270,136 @@ remove_snapshot(Snapshot * snapshot)
 {
     snapshot->status = RESTARTING0;
 
-    ACE_Guard<Mutex> guard(lock);
-
-    if (entries.empty())
-        throw Exception("remove_snapshot: empty entries");
-    
-    snapshot->status = RESTARTING0A;
-    
-    Entries::iterator it = entries.find(snapshot->epoch());
-    if (it == entries.end()) {
+    Entry * entry = snapshot->entry_;
+    if (!entry) {
         cerr << "-------- snapshot not found -----------" << endl;
         cerr << "snapshot = " << snapshot << endl;
         cerr << "current_trans = " << current_trans << endl;
-        cerr << "snapshot->epoch() = " << snapshot->epoch() << endl;
-        snapshot_info.dump_unlocked();
-        //snapshot->dump();
+        snapshot_info.dump();
         if (current_trans)
             current_trans->dump();
         cerr << "-------- end snapshot not found -----------" << endl;
-            throw Exception("snapshot not found");
+        throw Exception("snapshot not found");
     }
-    
-    /* Is this the most recent snapshot?  If so, we can't clean up,
-       even if we're removing the last entry, as there might be a
-       new snapshot created with the same epoch. */
-    //bool most_recent = (it == boost::prior(entries.end()));
-    
-    Entry & entry = it->second;
-    
-    if (!entry.snapshots.count(snapshot)) {
+
+    // If we're not the last snapshot in the entry, we can just leave
+    for (int n = entry->snapshots;  n > 1;  n = entry->snapshots) {
+        if (__sync_bool_compare_and_swap(&entry->snapshots, n, n - 1)) {
+            snapshot->entry_ = 0;
+            return;
+        }
+    }
+
+    ACE_Guard<Mutex> guard(lock);
+
+    snapshot->status = RESTARTING0A;
+
+    // Others may have joined in the meantime; if not, we are the last and
+    // nobody can join any more
+    int remaining = __sync_sub_and_fetch(&entry->snapshots, 1);
+    if (remaining < 0) {
         cerr << "-------- snapshot out of sync -----------" << endl;
-        snapshot_info.dump();
-        //snapshot->dump();
+        dump_unlocked();
         if (current_trans)
             current_trans->dump();
         cerr << "-------- end snapshot out of sync -----------" << endl;
         
         throw Exception("snapshots out of sync");
     }
-    
-    
-    entry.snapshots.erase(snapshot);
-    
+
+    snapshot->entry_ = 0;
+
     // NOTE: this must be last in the function; it causes the guard to be
     // released
-    if (entry.snapshots.empty() /* && !most_recent*/)
-        perform_cleanup(it, guard);
+    if (remaining == 0)
+        perform_cleanup(entry, guard);
 }
 
 void
 Snapshot_Info::
-perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard)
+perform_cleanup(Entry * entry, ACE_Guard<Mutex> & guard)
 {
     // TODO: try to hold the lock for less time here.  We only really need
     // the lock to add things to the previous snapshot.
     
-    if (!it->second.snapshots.empty())
+    if (entry->snapshots != 0)
         throw Exception("perform_cleanup with snapshots");
-    //if (it == boost::prior(entries.end()) && it->first == get_current_epoch())
-    //    throw Exception("cleaning up most recent entry");
-    if (it == entries.end())
-        throw Exception("cleaning up invalid entry");
 
     /* Find where the previous snapshot is; any that can't be deleted
        here (due to being needed by a later snapshot) will need to be
        moved to that list */
-    Entry * prev_snapshot = 0;
-    Epoch prev_epoch = 0;
+    Entry * prev_snapshot = entry->prev;
+    Entry * next_snapshot = entry->next;
+    Epoch prev_epoch = (prev_snapshot ? prev_snapshot->epoch : 0);
     
-    Entries::iterator itnext = boost::next(it);
-
-    if (it != entries.begin()) {
-        Entries::iterator jt = boost::prior(it);
-        
-        prev_snapshot = &jt->second;
-        prev_epoch = jt->first;
-    }
-    else {
+    if (!prev_snapshot) {
         // Earliest epoch has changed, as this is the earliest known
         // and it just disappeared.
         try {
-            if (itnext == entries.end())
+            if (!next_snapshot)
                 set_earliest_epoch(get_current_epoch());
-            else set_earliest_epoch(itnext->first);
+            else set_earliest_epoch(next_snapshot->epoch);
         } catch (const std::exception & exc) {
             cerr << "exception setting earliest epoch" << endl;
             dump_unlocked();
-            cerr << "itnext == entries.end() = "
-                 << (itnext == entries.end()) << endl;
-            if (itnext != entries.end())
-                cerr << "itnext->first = " << itnext->first
+            cerr << "next_snapshot = " << next_snapshot << endl;
+            if (next_snapshot)
+                cerr << "next_snapshot->epoch = " << next_snapshot->epoch
                      << endl;
             throw;
         }
     }
     
-    //cerr << "prev_epoch = " << prev_epoch << endl;
-    //cerr << "prev_snapshot = " << prev_snapshot << endl;
-    
     int num_to_cleanup = 0;
     
-    Entry & entry = it->second;
-
     // List of things to clean up once we release the guard
     vector<Cleanup_Entry> to_clean_up;
+
+    // usage() looks at the cleanups with only the entry's lock held
+    ACE_Guard<Adaptive_Lock> entry_guard(entry->lock);
     
-    for (unsigned i = 0;  i < entry.cleanups.size();  ++i) {
-        Versioned_Object * obj = entry.cleanups[i].object;
-        Epoch valid_from = entry.cleanups[i].valid_from;
-        
-        //cerr << "epoch = " << epoch << endl;
+    for (unsigned i = 0;  i < entry->cleanups.size();  ++i) {
+        Versioned_Object * obj = entry->cleanups[i].object;
+        Epoch valid_from = entry->cleanups[i].valid_from;
         
         if (prev_epoch >= valid_from && prev_snapshot) {
             // still needed by prev snapshot
-            //prev_snapshot->cleanups.push_back(make_pair(obj, valid_from));
             prev_snapshot->add_cleanup(Cleanup_Entry(obj, valid_from));
         }
         else {
             // not needed anymore
-            entry.cleanups[num_to_cleanup++] = entry.cleanups[i];
+            entry->cleanups[num_to_cleanup++] = entry->cleanups[i];
         }
     }
     
-    entry.cleanups.resize(num_to_cleanup);
+    entry->cleanups.resize(num_to_cleanup);
     
-    to_clean_up.swap(entry.cleanups);
+    to_clean_up.swap(entry->cleanups);
+
+    entry_guard.release();
 
-    Epoch snapshot_epoch = it->first;
+    Epoch snapshot_epoch = entry->epoch;
 
-    entries.erase(it);
+    // Take it out of the list
+    if (prev_snapshot) prev_snapshot->next = next_snapshot;
+    else oldest = next_snapshot;
+    if (next_snapshot) next_snapshot->prev = prev_snapshot;
+    else newest = prev_snapshot;
+    --num_entries;
 
     // Release the guard so that we can lock the objects
     guard.release();
+
+    schedule_small_cleanup(Delete_Object<Entry>(entry));
     
     // Now do the actual cleanups with no lock held, to avoid deadlock (we can't
     // take the object lock with the snapshot_info lock held).
+    run_cleanups(to_clean_up, snapshot_epoch);
+}
+
+void run_cleanups_serial(const Snapshot_Entry::Cleanups & to_clean_up,
+                         Epoch snapshot_epoch)
+{
     for (unsigned i = 0;  i < to_clean_up.size();  ++i) {
         Versioned_Object * obj = to_clean_up[i].object;
         Epoch valid_from = to_clean_up[i].valid_from;
@@ -363,26 +418,280 @@ perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard)
     }
 }
 
+
+/*****************************************************************************/
+/* PARALLEL CLEANUP                                                          */
+/*****************************************************************************/
+
+/* When an entry with a lot of cleanups goes, we split them into one
+   partition per thread and let the cleanup workers run all but one of the
+   partitions; the thread that removed the entry runs the last one and waits
+   for the others.
+
+   Partitioning is by object, so all of the cleanups for an object end up in
+   the same partition and run in the same order as they would serially.
+   Different objects are independent.
+*/
+
+struct Cleanup_Group;
+
+struct Cleanup_Job {
+    Snapshot_Entry::Cleanups cleanups;
+    Cleanup_Group * group;
+};
+
+struct Cleanup_Group {
+    Cleanup_Group(Epoch snapshot_epoch)
+        : snapshot_epoch(snapshot_epoch), outstanding(0)
+    {
+    }
+
+    Epoch snapshot_epoch;
+    int outstanding;      ///< Jobs not yet finished
+    std::string error;    ///< First error from a job
+};
+
+ACE_Thread_Mutex cleanup_pool_lock;
+ACE_Condition_Thread_Mutex cleanup_pool_work(cleanup_pool_lock);
+ACE_Condition_Thread_Mutex cleanup_pool_done(cleanup_pool_lock);
+
+std::deque<Cleanup_Job *> cleanup_jobs;
+vector<pthread_t> cleanup_threads;
+bool cleanup_pool_stop = false;
+size_t parallel_cleanup_threshold = 10000;
+
+/// Copy of cleanup_threads.size() that can be read without the lock, so
+/// that the serial path of run_cleanups() doesn't need to take it.  It's
+/// only a hint: whether there are workers to take the jobs is checked
+/// again under cleanup_pool_lock.
+volatile int parallel_cleanup_threads = 0;
+
+inline unsigned cleanup_partition(const Versioned_Object * obj,
+                                  unsigned npartitions)
+{
+    size_t val = reinterpret_cast<size_t>(obj) >> 4;
+    return (val ^ (val >> 10) ^ (val >> 20)) % npartitions;
+}
+
+void * run_cleanup_thread(void *)
+{
+    ACE_Guard<ACE_Thread_Mutex> guard(cleanup_pool_lock);
+
+    for (;;) {
+        while (cleanup_jobs.empty() && !cleanup_pool_stop)
+            cleanup_pool_work.wait();
+
+        if (cleanup_jobs.empty()) break;
+
+        Cleanup_Job * job = cleanup_jobs.front();
+        cleanup_jobs.pop_front();
+        Cleanup_Group & group = *job->group;
+
+        guard.release();
+
+        std::string error;
+        try {
+            // The objects' version tables are protected by the garbage
+            // collector
+            enter_critical();
+            try {
+                run_cleanups_serial(job->cleanups, group.snapshot_epoch);
+            } catch (...) {
+                leave_critical();
+                throw;
+            }
+            leave_critical();
+        } catch (const std::exception & exc) {
+            error = exc.what();
+        } catch (...) {
+            error = "unknown exception";
+        }
+
+        guard.acquire();
+
+        if (group.error.empty()) group.error = error;
+        if (--group.outstanding == 0)
+            cleanup_pool_done.broadcast();
+    }
+
+    return 0;
+}
+
 void
 Snapshot_Info::
-register_cleanup(Versioned_Object * obj, Epoch valid_from_to_cleanup)
+run_cleanups(const Cleanups & to_clean_up, Epoch snapshot_epoch)
 {
-    // This is always called with the commit lock held, so:
-    // 1.  The cleanups cannot happen at the same time;
-    // 2.  There is only one thing here at a given time
-    
-    // NOTE: this is called with the object's lock held
-    Entries::iterator it;
+    unsigned nthreads = parallel_cleanup_threads;
+
+    if (nthreads == 0 || to_clean_up.size() < parallel_cleanup_threshold) {
+        run_cleanups_serial(to_clean_up, snapshot_epoch);
+        return;
+    }
+
+    unsigned npartitions = nthreads + 1;
+
+    vector<Cleanup_Job> jobs(npartitions);
+    Cleanup_Group group(snapshot_epoch);
+
+    for (unsigned i = 0;  i < npartitions;  ++i) {
+        jobs[i].cleanups.reserve(to_clean_up.size() / npartitions * 2);
+        jobs[i].group = &group;
+    }
+
+    for (unsigned i = 0;  i < to_clean_up.size();  ++i) {
+        unsigned p = cleanup_partition(to_clean_up[i].object, npartitions);
+        jobs[p].cleanups.push_back(to_clean_up[i]);
+    }
 
     {
-        ACE_Guard<Mutex> guard(lock);
+        ACE_Guard<ACE_Thread_Mutex> guard(cleanup_pool_lock);
+
+        // The pool may have been stopped by set_parallel_cleanup() since we
+        // looked.  Workers that are being stopped still finish the jobs
+        // that are queued, but once they're joined there is nobody to run
+        // them, so in that case we don't queue anything.
+        if (cleanup_threads.empty() || cleanup_pool_stop) {
+            guard.release();
+            run_cleanups_serial(to_clean_up, snapshot_epoch);
+            return;
+        }
+
+        for (unsigned i = 1;  i < npartitions;  ++i) {
+            if (jobs[i].cleanups.empty()) continue;
+            cleanup_jobs.push_back(&jobs[i]);
+            ++group.outstanding;
+        }
+        cleanup_pool_work.broadcast();
+    }
+
+    // We do the first one ourselves
+    std::string error;
+    try {
+        run_cleanups_serial(jobs[0].cleanups, snapshot_epoch);
+    } catch (const std::exception & exc) {
+        error = exc.what();
+    }
+
+    // The jobs refer to our stack, so we wait for them even on error
+    ACE_Guard<ACE_Thread_Mutex> guard(cleanup_pool_lock);
+    while (group.outstanding > 0)
+        cleanup_pool_done.wait();
+
+    if (error.empty()) error = group.error;
+    if (!error.empty())
+        throw Exception("parallel cleanup: " + error);
+}
 
-        if (entries.empty())
-            throw Exception("register_cleanup with no snapshots");
+/// Held for the whole of set_parallel_cleanup(), so that only one caller
+/// at a time starts and stops the workers
+ACE_Thread_Mutex cleanup_config_lock;
 
-        it = boost::prior(entries.end());
-        it->second.add_cleanup(Cleanup_Entry(obj, valid_from_to_cleanup));
+/// Stop and join all of the workers.  Must be called with
+/// cleanup_config_lock held.
+void stop_cleanup_threads()
+{
+    {
+        ACE_Guard<ACE_Thread_Mutex> guard(cleanup_pool_lock);
+        parallel_cleanup_threads = 0;
+        cleanup_pool_stop = true;
+        cleanup_pool_work.broadcast();
     }
+
+    // Only changed with cleanup_config_lock held, so we can read it
+    // without the pool lock
+    for (unsigned i = 0;  i < cleanup_threads.size();  ++i)
+        pthread_join(cleanup_threads[i], 0);
+
+    ACE_Guard<ACE_Thread_Mutex> guard(cleanup_pool_lock);
+    cleanup_threads.clear();
+    cleanup_pool_stop = false;
+}
+
+void
+Snapshot_Info::
+set_parallel_cleanup(int nthreads, size_t threshold)
+{
+    if (nthreads < 0)
+        throw Exception("set_parallel_cleanup: negative thread count");
+
+    ACE_Guard<ACE_Thread_Mutex> config_guard(cleanup_config_lock);
+
+    stop_cleanup_threads();
+
+    ACE_Guard<ACE_Thread_Mutex> guard(cleanup_pool_lock);
+    parallel_cleanup_threshold = threshold;
+
+    for (int i = 0;  i < nthreads;  ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, run_cleanup_thread, 0) != 0) {
+            // Don't leave a partial pool behind
+            guard.release();
+            stop_cleanup_threads();
+            throw Exception("couldn't create cleanup thread");
+        }
+        cleanup_threads.push_back(thread);
+    }
+
+    parallel_cleanup_threads = cleanup_threads.size();
+}
+
+int
+Snapshot_Info::
+get_parallel_cleanup() const
+{
+    return parallel_cleanup_threads;
+}
+
+/// Thread-specific data: buffer of cleanups when a Cleanup_Buffer is alive
+__thread Snapshot_Entry::Cleanups * t_cleanup_buffer = 0;
+__thread bool t_cleanup_buffering = false;
+
+void
+Snapshot_Info::
+register_cleanup(Versioned_Object * obj, Epoch valid_from_to_cleanup)
+{
+    if (t_cleanup_buffering) {
+        t_cleanup_buffer
+            ->push_back(Cleanup_Entry(obj, valid_from_to_cleanup));
+        return;
+    }
+
+    // This is called by a commit (usually via a Cleanup_Buffer, once the
+    // commit stripes have been released) after its epoch has been published
+    // and whilst the committing transaction's snapshot is still registered.
+    // So there is always a newest entry, and no snapshot that registers
+    // after us can see the version, so that entry is late enough to clean
+    // it up.
+    //
+    // Nothing orders the registrations for the same object: a later commit
+    // may get in first and put its cleanup on an older entry, and with
+    // parallel cleanup two entries' cleanups can run at the same time.  So
+    // Versioned_Object::cleanup() has to cope with being called for any of
+    // its old versions in any order.
+    ACE_Guard<Mutex> guard(lock);
+
+    if (!newest)
+        throw Exception("register_cleanup with no snapshots");
+
+    newest->add_cleanup(Cleanup_Entry(obj, valid_from_to_cleanup));
+}
+
+void
+Snapshot_Info::
+register_cleanups(const Cleanups & cleanups)
+{
+    if (cleanups.empty()) return;
+
+    // Same reasoning as register_cleanup(): the newest entry is late enough
+    // for all of them.
+    ACE_Guard<Mutex> guard(lock);
+
+    if (!newest)
+        throw Exception("register_cleanups with no snapshots");
+
+    ACE_Guard<Adaptive_Lock> entry_guard(newest->lock);
+    newest->cleanups.insert(newest->cleanups.end(),
+                            cleanups.begin(), cleanups.end());
 }
 
 void
@@ -390,8 +699,9 @@ Snapshot_Info::
 compress_epochs()
 {
     // We have to block any commits that are happening so that we can't get
-    // any new epochs
-    ACE_Guard<ACE_Mutex> commit_guard(commit_lock);
+    // any new epochs, and wait for those already in progress to finish
+    ACE_Guard<Adaptive_Lock> commit_guard(commit_lock);
+    wait_for_commits_in_progress();
 
     ACE_Guard<Mutex> guard(lock);
     
@@ -446,7 +756,7 @@ compress_epochs()
        Later on, it may be possible to avoid taking the commit lock.
     */
 
-    if (entries.empty())
+    if (!oldest)
         return;
 
     // TODO: must have strong exception guarantee here, but it needs to be
@@ -458,7 +768,7 @@ compress_epochs()
     bool debug = false;
 
     if (debug) {
-        cerr << "compress epochs: " << entries.size() << " entries" << endl;
+        cerr << "compress epochs: " << num_entries << " entries" << endl;
 
         dump_unlocked();
     }
@@ -466,18 +776,15 @@ compress_epochs()
     hash_map<Epoch, vector<Versioned_Object *> > extra_versions;
 
     int i = 1; // starting epoch number
-    for (Entries::iterator it = entries.begin(), end = entries.end();
-         it != end;  /* no inc it */ ++i) {
-        int old_epoch = it->first;
-        int new_epoch = i;
+    for (Entry * it = oldest;  it;  it = it->next, ++i) {
+        Epoch old_epoch = it->epoch;
+        Epoch new_epoch = i;
 
         if (debug)
             cerr << "renaming " << old_epoch << " to " << new_epoch << endl;
 
-        if (old_epoch == new_epoch) {
-            ++it;
+        if (old_epoch == new_epoch)
             continue;  // nothing to do
-        }
 
         if (new_epoch > old_epoch) {
             cerr << "new_epoch = " << new_epoch << endl;
@@ -485,7 +792,7 @@ compress_epochs()
             throw Exception("logic error in compress_epochs()");
         }
         
-        Entry & entry = it->second;
+        Entry & entry = *it;
 
         if (debug)
             cerr << entry.cleanups.size() << " cleanups" << endl;
@@ -569,24 +876,11 @@ compress_epochs()
             dump_unlocked();
         }
 
-        for (set<Snapshot *>::iterator
-                 jt = entry.snapshots.begin(),
-                 jend = entry.snapshots.end();
-             jt != jend;  ++jt)
-            (*jt)->rename_epoch(old_epoch, new_epoch);
+        // Renaming the entry renames all of its snapshots
+        entry.epoch = new_epoch;
 
         // Make sure writes are visible before we continue
         memory_barrier();
-
-        if (entries.count(new_epoch))
-            throw Exception("new epoch already there");
-        Entry & new_entry = entries[new_epoch];
-        new_entry.snapshots.swap(entry.snapshots);
-        new_entry.cleanups.swap(entry.cleanups);
-
-        Entries::iterator new_it = boost::next(it);
-        entries.erase(it);
-        it = new_it;
     }
 
     if (debug) {
@@ -609,22 +903,13 @@ dump_unlocked(std::ostream & stream)
     stream << "  current_trans: " << current_trans << " epoch "
            << (current_trans ? current_trans->epoch() : 0)
            << endl;
-    stream << "  snapshot epochs: " << entries.size() << endl;
+    stream << "  snapshot epochs: " << num_entries << endl;
     int i = 0;
-    for (map<Epoch, Entry>::const_iterator
-             it = entries.begin(), end = entries.end();
-         it != end;  ++it, ++i) {
-        const Entry & entry = it->second;
-        stream << "  " << i << " at epoch " << it->first << endl;
-        stream << "    " << entry.snapshots.size() << " snapshots"
+    for (const Entry * it = oldest;  it;  it = it->next, ++i) {
+        const Entry & entry = *it;
+        stream << "  " << i << " at epoch " << entry.epoch << endl;
+        stream << "    " << entry.snapshots << " snapshots"
              << endl;
-        int j = 0;
-        for (set<Snapshot *>::const_iterator
-                 jt = entry.snapshots.begin(), jend = entry.snapshots.end();
-             jt != jend;  ++jt, ++j)
-            stream << "      " << j << " " << *jt << " epoch "
-                   << (*jt)->epoch() << " status " << (*jt)->status
-                   << endl;
         stream << "    " << entry.cleanups.size() << " cleanups" << endl;
         for (unsigned j = 0;  j < entry.cleanups.size();  ++j)
             stream << "      " << j << ": object " << entry.cleanups[j].object
@@ -647,18 +932,81 @@ validate_unlocked() const
     
 }
 
+Snapshot_Info::Usage
+Snapshot_Info::
+usage(bool by_type) const
+{
+    Usage result;
+
+    // Entries are freed through the garbage collector, so those that we
+    // saw in the list stay valid whilst we're in a critical section, even
+    // once they've been taken out of it.
+    if (by_type) enter_critical();
+
+    vector<const Entry *> entries;
+
+    {
+        ACE_Guard<Mutex> guard(lock);
+
+        result.entries = num_entries;
+        if (oldest) result.oldest_epoch = oldest->epoch;
+
+        if (by_type) entries.reserve(num_entries);
+
+        for (const Entry * it = oldest;  it;  it = it->next) {
+            // Snapshots can join or leave the entry without the lock
+            int snapshots = it->snapshots;
+            if (snapshots > 0) result.snapshots += snapshots;
+
+            ACE_Guard<Adaptive_Lock> entry_guard(it->lock);
+            result.versions_retained += it->cleanups.size();
+
+            if (by_type) entries.push_back(it);
+        }
+    }
+
+    if (!by_type) return result;
+
+    // Looking at every version is slow, so we do it without the list lock
+    // and only hold up commits adding to one entry at a time.  Whilst an
+    // object is in an entry's cleanups, it hasn't been cleaned up yet (see
+    // perform_cleanup()).  Versions that move between entries as we go may
+    // be counted twice or not at all.
+    try {
+        for (unsigned i = 0;  i < entries.size();  ++i) {
+            const Entry * it = entries[i];
+            ACE_Guard<Adaptive_Lock> entry_guard(it->lock);
+
+            for (Cleanups::const_iterator
+                     jt = it->cleanups.begin(),
+                     jend = it->cleanups.end();
+                 jt != jend;  ++jt)
+                result.by_type[&typeid(*jt->object)] += 1;
+        }
+    } catch (...) {
+        leave_critical();
+        throw;
+    }
+
+    leave_critical();
+
+    return result;
+}
+
 Epoch
 Snapshot_Info::
 has_cleanup(Epoch snapshot_epoch, const Versioned_Object * object) const
 {
     ACE_Guard<Mutex> guard (lock);
-    Entries::const_iterator it = entries.find(snapshot_epoch);
+    const Entry * it = oldest;
+    while (it && it->epoch != snapshot_epoch)
+        it = it->next;
 
-    if (it == entries.end()) return 0;
+    if (!it) return 0;
 
     for (Cleanups::const_iterator
-             jt = it->second.cleanups.begin(),
-             jend = it->second.cleanups.end();
+             jt = it->cleanups.begin(),
+             jend = it->cleanups.end();
          jt != jend;  ++jt)
         if (jt->object == object)
             return jt->valid_from;
@@ -667,6 +1015,50 @@ has_cleanup(Epoch snapshot_epoch, const Versioned_Object * object) const
 }
 
 
+/*****************************************************************************/
+/* CLEANUP_BUFFER                                                            */
+/*****************************************************************************/
+
+Cleanup_Buffer::
+Cleanup_Buffer()
+    : outermost(!t_cleanup_buffering)
+{
+    if (!outermost) return;
+
+    if (!t_cleanup_buffer)
+        t_cleanup_buffer = new Snapshot_Entry::Cleanups();
+    t_cleanup_buffering = true;
+}
+
+Cleanup_Buffer::
+~Cleanup_Buffer()
+{
+    if (!outermost) return;
+
+    try {
+        flush();
+    } catch (const std::exception & exc) {
+        // Can't throw from a destructor; don't leave them to be registered
+        // by the next commit
+        cerr << "error flushing cleanup buffer: " << exc.what() << endl;
+        t_cleanup_buffer->clear();
+    }
+
+    t_cleanup_buffering = false;
+}
+
+void
+Cleanup_Buffer::
+flush()
+{
+    if (!outermost || t_cleanup_buffer->empty()) return;
+
+    // Keep the memory for the next commit
+    snapshot_info.register_cleanups(*t_cleanup_buffer);
+    t_cleanup_buffer->clear();
+}
+
+
 /*****************************************************************************/
 /* SNAPSHOT                                                                  */
 /*****************************************************************************/
@@ -689,19 +1081,4 @@ std::ostream & operator << (std::ostream & stream, const Status & status)
     }
 }
 
-void
-Snapshot::
-rename_epoch(Epoch old_epoch, Epoch new_epoch)
-{
-    if (false) {
-        cerr << "rename_epoch at " << this << endl;
-        cerr << "epoch_ = " << epoch_ << endl;
-        cerr << "old_epoch = " << old_epoch << endl;
-        cerr << "new_epoch = " << new_epoch << endl;
-    }
-    if (epoch_ != old_epoch)
-        throw Exception("wrong old epoch");
-    epoch_ = new_epoch;
-}
-
 } // namespace JMVCC
@@ -13,12 +13,13 @@
 #include <set>
 #include <vector>
 #include <iostream>
+#include <typeinfo>
 #include <ace/Mutex.h>
 #include <ace/Synch.h>
 #include "jml/utils/string_functions.h"
 #include <boost/utility.hpp>
 #include "jmvcc_defs.h"
-#include "spinlock.h"
+#include "adaptive_lock.h"
 
 class test0;   // for testing code
 
@@ -82,17 +83,71 @@ inline Epoch get_earliest_epoch()
 
  */
 
+/** All of the snapshots at a given epoch share one of these entries.  The
+    entries are kept in a list in epoch order; a snapshot holds a reference
+    to its entry, which is freed (via the garbage collector) once the last
+    reference has gone.
+*/
+struct Snapshot_Entry {
+    Snapshot_Entry(Epoch epoch)
+        : epoch(epoch), snapshots(1), prev(0), next(0)
+    {
+    }
+
+    struct Cleanup {
+        Cleanup(Versioned_Object * object = 0,
+                Epoch valid_from = 0)
+            : object(object), valid_from(valid_from)
+        {
+        }
+
+        Versioned_Object * object;
+        Epoch valid_from;
+    };
+
+    typedef std::vector<Cleanup> Cleanups;
+
+    /// Epoch of the snapshots.  Only changed by compress_epochs().
+    Epoch epoch;
+
+    /// Number of snapshots referencing the entry.  Once it reaches zero it
+    /// never increases again.
+    volatile int snapshots;
+
+    /// Versions to clean up once the entry goes
+    Cleanups cleanups;
+    mutable Adaptive_Lock lock;
+
+    /// Previous (earlier) and next (later) entries
+    Snapshot_Entry * prev;
+    Snapshot_Entry * next;
+
+    void add_cleanup(const Cleanup & cleanup);
+};
+
 /// Information about transactions in progress
 struct Snapshot_Info {
+    Snapshot_Info();
+
     // Register the snapshot for the current epoch.  Returns the number of
     // the epoch it was registered under.
     Epoch register_snapshot(Snapshot * snapshot);
 
     void remove_snapshot(Snapshot * snapshot);
 
+    /** Register the version of obj that became valid at the given epoch to
+        be cleaned up once nothing can see it.  If a Cleanup_Buffer is
+        active in this thread, it is buffered until the buffer is flushed.
+    */
     void register_cleanup(Versioned_Object * obj,
                           Epoch valid_from_to_cleanup);
 
+    /** Register a set of cleanups at once; same as calling register_cleanup()
+        on each of them, but with one lock acquisition.
+    */
+    void register_cleanups(const std::vector<Snapshot_Entry::Cleanup>
+                           & cleanups);
+
     void dump(std::ostream & stream = std::cerr);
 
     void validate() const
@@ -101,7 +156,31 @@ struct Snapshot_Info {
         validate_unlocked();
     }
 
-    size_t entry_count() const { return entries.size(); }
+    size_t entry_count() const { return num_entries; }
+
+    /// Contention statistics for the lock on the list of entries
+    Adaptive_Lock::Stats lock_stats() const { return lock.stats(); }
+
+    /// What the snapshots that are alive are holding up
+    struct Usage {
+        Usage()
+            : entries(0), snapshots(0), oldest_epoch(0), versions_retained(0)
+        {
+        }
+
+        size_t entries;            ///< Number of distinct epochs
+        size_t snapshots;          ///< Number of snapshots
+        Epoch oldest_epoch;        ///< Zero if there are no snapshots
+        size_t versions_retained;  ///< Versions waiting to be cleaned up
+
+        /// Versions waiting to be cleaned up, by type of object
+        std::map<const std::type_info *, size_t> by_type;
+    };
+
+    /** Gather the usage.  Filling in by_type means looking at every version
+        waiting to be cleaned up, which is done without holding up the
+        snapshots (but does hold up commits for one entry at a time). */
+    Usage usage(bool by_type = false) const;
 
     /** Compress a range of epochs to remove holes from the epoch space and
         start back at zero.  Used once the epochs start to get too high:
@@ -110,44 +189,50 @@ struct Snapshot_Info {
     */
     void compress_epochs();
 
+    /** Run the version cleanups of an entry that has gone on nthreads worker
+        threads as well as the calling thread, when there are at least
+        threshold of them.  Useful when long-lived snapshots accumulate a
+        lot of cleanups.  Zero threads (the default) runs them all in the
+        calling thread.  Cleanups that start whilst the pool is being
+        changed run in the calling thread.  Concurrent calls are
+        serialized.  If a worker can't be started, none are left running.
+    */
+    void set_parallel_cleanup(int nthreads, size_t threshold = 10000);
+
+    int get_parallel_cleanup() const;
+
     /** For testing.  Check if the given epoch has the given object in it,
         and returns the valid_from of that object.  Slow and inefficient. */
     Epoch has_cleanup(Epoch snapshot_epoch,
                       const Versioned_Object * object) const;
 
 private:
-    typedef ACE_Mutex Mutex;
+    /* Adding a snapshot to an existing entry or removing one that isn't the
+       last is lock-free; lock is only needed to add or remove an entry, or
+       to change the list of entries. */
+    typedef Adaptive_Lock Mutex;
     mutable Mutex lock;
 
-    struct Cleanup_Entry {
-        Cleanup_Entry(Versioned_Object * object = 0,
-                      Epoch valid_from = 0)
-            : object(object), valid_from(valid_from)
-        {
-        }
-
-        Versioned_Object * object;
-        Epoch valid_from;
-    };
-
-    typedef std::vector<Cleanup_Entry> Cleanups;
-
-    struct Entry {
-        std::set<Snapshot *> snapshots;
-        Cleanups cleanups;
+    typedef Snapshot_Entry Entry;
+    typedef Entry::Cleanup Cleanup_Entry;
+    typedef Entry::Cleanups Cleanups;
 
-        void add_cleanup(const Cleanup_Entry & cleanup);
-        mutable Spinlock lock;
-    };
+    /// Oldest and newest entries in the list
+    Entry * oldest;
+    Entry * volatile newest;
+    size_t num_entries;
 
-    typedef std::map<Epoch, Entry> Entries;
-    Entries entries;
+    /// Try to add the snapshot to the newest entry without taking the lock
+    bool join_newest(Snapshot * snapshot);
 
     void dump_unlocked(std::ostream & stream = std::cerr);
 
     void validate_unlocked() const;
 
-    void perform_cleanup(Entries::iterator it, ACE_Guard<Mutex> & guard);
+    void perform_cleanup(Entry * entry, ACE_Guard<Mutex> & guard);
+
+    /// Call cleanup() on the objects, in parallel if it's worth it
+    void run_cleanups(const Cleanups & to_clean_up, Epoch snapshot_epoch);
     
     friend class ::test0;
     template<class Var> friend void test0_type();
@@ -155,6 +240,30 @@ private:
 
 extern Snapshot_Info snapshot_info;
 
+
+/*****************************************************************************/
+/* CLEANUP_BUFFER                                                            */
+/*****************************************************************************/
+
+/** Whilst one of these is alive, the cleanups that the thread registers
+    with Snapshot_Info::register_cleanup() are held in a thread-local
+    buffer.  They are registered all at once by flush() (or the destructor).
+    Used by commits so that they don't take the lock for each object.
+
+    The buffer must be flushed whilst the committing transaction's snapshot
+    is still registered.  Nested buffers are allowed; only the outermost one
+    flushes.
+*/
+struct Cleanup_Buffer : boost::noncopyable {
+    Cleanup_Buffer();
+    ~Cleanup_Buffer();
+
+    void flush();
+
+private:
+    bool outermost;
+};
+
 /// A snapshot provides a view of all objects that is frozen at the moment
 /// the shapshot was created.  Provides a read-only view.
 ///
@@ -193,17 +302,17 @@ struct Snapshot : boost::noncopyable {
 
     void restart();
 
-    Epoch epoch() const { return epoch_; }
+    /// Epoch at which snapshot was taken.  It is stored in the entry that
+    /// is shared with the other snapshots at that epoch.
+    Epoch epoch() const { return entry_ ? entry_->epoch : 0; }
 
     void set_epoch(Epoch new_epoch);
 
     int retries() const { return retries_; }
 
-    void rename_epoch(Epoch old_epoch, Epoch new_epoch);
-
 private:
     friend class Snapshot_Info;
-    Epoch epoch_;  ///< Epoch at which snapshot was taken
+    Snapshot_Entry * entry_;
     int retries_;
 
     void register_me();
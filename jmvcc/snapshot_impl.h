@@ -18,7 +18,7 @@ namespace JMVCC {
 inline
 Snapshot::
 Snapshot()
-    : retries_(0), status(UNINITIALIZED)
+    : entry_(0), retries_(0), status(UNINITIALIZED)
 {
     register_me();
 }
@@ -58,7 +58,7 @@ void
 Snapshot::
 set_epoch(Epoch new_epoch)
 {
-    if (new_epoch != epoch_) {
+    if (new_epoch != epoch()) {
         snapshot_info.remove_snapshot(this);
         register_me();
     }        
@@ -0,0 +1,406 @@
+/* stats.cc
+   Jeremy Barnes, 19 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Statistics about commits, snapshots, locks and reclamation.
+*/
+
+#include "stats.h"
+#include "snapshot.h"
+#include "sandbox.h"
+#include "transaction.h"
+#include "jml/arch/demangle.h"
+#include "jml/arch/exception.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/utils/string_functions.h"
+#include <pthread.h>
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* LATENCY_HISTOGRAM                                                         */
+/*****************************************************************************/
+
+void
+Latency_Histogram::
+clear()
+{
+    count = total_ns = max_ns = 0;
+    for (unsigned i = 0;  i < NUM_BUCKETS;  ++i)
+        buckets[i] = 0;
+}
+
+double
+Latency_Histogram::
+mean() const
+{
+    return (count ? (double)total_ns / count : 0.0);
+}
+
+uint64_t
+Latency_Histogram::
+bucket_min(unsigned bucket)
+{
+    if (bucket < SUB_BUCKETS) return bucket;
+    unsigned shift = bucket / SUB_BUCKETS - 1;
+    return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+}
+
+uint64_t
+Latency_Histogram::
+bucket_max(unsigned bucket)
+{
+    if (bucket == NUM_BUCKETS - 1) return (uint64_t)-1;
+    return bucket_min(bucket + 1) - 1;
+}
+
+uint64_t
+Latency_Histogram::
+percentile(double fraction) const
+{
+    if (!count) return 0;
+
+    // Number of samples at or below the one we want
+    uint64_t wanted = (uint64_t)(fraction * count);
+    if (wanted < 1) wanted = 1;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0;  i < NUM_BUCKETS;  ++i) {
+        seen += buckets[i];
+        if (seen >= wanted)
+            return std::min<uint64_t>(bucket_max(i), max_ns);
+    }
+
+    return max_ns;
+}
+
+Latency_Histogram &
+Latency_Histogram::
+operator += (const Latency_Histogram & other)
+{
+    count += other.count;
+    total_ns += other.total_ns;
+    max_ns = std::max(max_ns, other.max_ns);
+    for (unsigned i = 0;  i < NUM_BUCKETS;  ++i)
+        buckets[i] += other.buckets[i];
+    return *this;
+}
+
+
+/*****************************************************************************/
+/* COMMIT_STATS                                                              */
+/*****************************************************************************/
+
+const char * print(Commit_Phase phase)
+{
+    switch (phase) {
+    case PHASE_CHECK:   return "check";
+    case PHASE_PREPARE: return "prepare";
+    case PHASE_LOCK:    return "lock";
+    case PHASE_EPOCH:   return "epoch";
+    case PHASE_SETUP:   return "setup";
+    case PHASE_PUBLISH: return "publish";
+    case PHASE_CONFIRM: return "confirm";
+    case PHASE_RELEASE: return "release";
+    case PHASE_TOTAL:   return "total";
+    default:
+        throw Exception("unknown commit phase");
+    }
+}
+
+const char * print(Abort_Reason reason)
+{
+    switch (reason) {
+    case ABORT_CHECK:     return "check";
+    case ABORT_SETUP:     return "setup";
+    case ABORT_DOOMED:    return "doomed";
+    case ABORT_BARGED:    return "barged";
+    case ABORT_EXCEPTION: return "exception";
+    default:
+        throw Exception("unknown abort reason");
+    }
+}
+
+uint64_t
+Commit_Stats::
+total_aborts() const
+{
+    uint64_t result = 0;
+    for (unsigned i = 0;  i < NUM_ABORT_REASONS;  ++i)
+        result += aborts[i];
+    return result;
+}
+
+void
+Commit_Stats::
+clear()
+{
+    commits = commits_retried = retries = max_retries = 0;
+    for (unsigned i = 0;  i < NUM_ABORT_REASONS;  ++i)
+        aborts[i] = 0;
+    for (unsigned i = 0;  i < NUM_COMMIT_PHASES;  ++i)
+        phases[i].clear();
+}
+
+Commit_Stats &
+Commit_Stats::
+operator += (const Commit_Stats & other)
+{
+    commits += other.commits;
+    for (unsigned i = 0;  i < NUM_ABORT_REASONS;  ++i)
+        aborts[i] += other.aborts[i];
+    commits_retried += other.commits_retried;
+    retries += other.retries;
+    max_retries = std::max(max_retries, other.max_retries);
+    for (unsigned i = 0;  i < NUM_COMMIT_PHASES;  ++i)
+        phases[i] += other.phases[i];
+    return *this;
+}
+
+
+/*****************************************************************************/
+/* THREAD STATISTICS                                                         */
+/*****************************************************************************/
+
+/* Each thread counts its commits in its own record, so that there is no
+   sharing between threads.  The records are on a list that is only ever
+   added to, so get_mvcc_stats() can walk it without a lock.  When a thread
+   exits its record is handed on to the next new thread, with its counts
+   intact.
+*/
+
+/// Incremented by reset_mvcc_stats().  Statistics from an earlier
+/// generation are cleared by their thread before it next adds to them, and
+/// ignored until then.
+volatile int stats_generation = 0;
+
+struct Thread_Stats {
+    Thread_Stats()
+        : in_use(1), generation(stats_generation), next(0)
+    {
+    }
+
+    Commit_Stats stats;
+    volatile int in_use;
+    volatile int generation;  ///< stats_generation when last cleared
+    Thread_Stats * next;
+};
+
+Thread_Stats * volatile thread_stats_list = 0;
+
+__thread Thread_Stats * t_thread_stats = 0;
+
+pthread_key_t thread_stats_key;
+pthread_once_t thread_stats_once = PTHREAD_ONCE_INIT;
+
+void release_thread_stats(void * arg)
+{
+    Thread_Stats * stats = reinterpret_cast<Thread_Stats *>(arg);
+    memory_barrier();
+    stats->in_use = 0;
+}
+
+void create_thread_stats_key()
+{
+    pthread_key_create(&thread_stats_key, release_thread_stats);
+}
+
+Thread_Stats * new_thread_stats()
+{
+    pthread_once(&thread_stats_once, create_thread_stats_key);
+
+    Thread_Stats * result = 0;
+
+    // Reuse the record of a thread that has gone
+    for (Thread_Stats * it = thread_stats_list;  it && !result;  it = it->next)
+        if (!it->in_use && __sync_bool_compare_and_swap(&it->in_use, 0, 1))
+            result = it;
+
+    if (!result) {
+        result = new Thread_Stats();
+        for (;;) {
+            Thread_Stats * head = thread_stats_list;
+            result->next = head;
+            if (__sync_bool_compare_and_swap(&thread_stats_list, head, result))
+                break;
+        }
+    }
+
+    pthread_setspecific(thread_stats_key, result);
+    t_thread_stats = result;
+    return result;
+}
+
+inline Commit_Stats & thread_stats()
+{
+    Thread_Stats * result = t_thread_stats;
+    if (JML_UNLIKELY(!result)) result = new_thread_stats();
+
+    // Only the owner writes to the statistics, so it does the reset
+    int generation = stats_generation;
+    if (JML_UNLIKELY(result->generation != generation)) {
+        result->stats.clear();
+        memory_barrier();
+        result->generation = generation;
+    }
+
+    return result->stats;
+}
+
+void
+Commit_Timer::
+record()
+{
+    Commit_Stats & stats = thread_stats();
+
+    if (outcome == NUM_ABORT_REASONS) ++stats.commits;
+    else ++stats.aborts[outcome];
+
+    times[PHASE_TOTAL] = stats_clock() - start;
+
+    for (unsigned i = 0;  i < NUM_COMMIT_PHASES;  ++i)
+        if (times[i] != NOT_REACHED)
+            stats.phases[i].record(times[i]);
+}
+
+void record_commit_retries(int retries)
+{
+    if (retries <= 0) return;
+
+    Commit_Stats & stats = thread_stats();
+    ++stats.commits_retried;
+    stats.retries += retries;
+    stats.max_retries = std::max<uint64_t>(stats.max_retries, retries);
+}
+
+
+/*****************************************************************************/
+/* MVCC_STATS                                                                */
+/*****************************************************************************/
+
+MVCC_Stats::
+MVCC_Stats()
+    : early_conflicts(0), barged_commits(0), current_epoch(0),
+      oldest_snapshot_epoch(0), live_snapshots(0), snapshot_entries(0),
+      versions_retained(0)
+{
+}
+
+void
+MVCC_Stats::
+dump(std::ostream & stream) const
+{
+    stream << "commits: " << commits.commits << " committed, "
+           << commits.total_aborts() << " aborted (";
+    for (unsigned i = 0;  i < NUM_ABORT_REASONS;  ++i)
+        stream << (i ? ", " : "") << print(Abort_Reason(i)) << " "
+               << commits.aborts[i];
+    stream << ")" << endl;
+
+    stream << "  " << commits.commits_retried << " needed retries; "
+           << commits.retries << " retries, max " << commits.max_retries
+           << endl;
+    stream << "  " << early_conflicts << " early conflicts, "
+           << barged_commits << " barged" << endl;
+
+    stream << "commit phases (ns):" << endl;
+    for (unsigned i = 0;  i < NUM_COMMIT_PHASES;  ++i) {
+        const Latency_Histogram & h = commits.phases[i];
+        stream << format("  %-8s %10lld  mean %10.0f  p50 %10lld  "
+                         "p99 %10lld  max %10lld",
+                         print(Commit_Phase(i)), (long long)h.count,
+                         h.mean(), (long long)h.percentile(0.5),
+                         (long long)h.percentile(0.99), (long long)h.max_ns)
+               << endl;
+    }
+
+    stream << "snapshots: " << live_snapshots << " in "
+           << snapshot_entries << " epochs; current epoch "
+           << current_epoch << ", oldest " << oldest_snapshot_epoch << endl;
+
+    stream << "versions retained: " << versions_retained << endl;
+    for (map<string, size_t>::const_iterator
+             it = versions_retained_by_type.begin(),
+             end = versions_retained_by_type.end();
+         it != end;  ++it)
+        stream << "  " << it->first << ": " << it->second << endl;
+
+    stream << "reclamation: " << reclamation.pending_cleanups
+           << " cleanups in " << reclamation.pending_batches
+           << " batches pending, " << reclamation.queue_depth
+           << " batches queued (max " << reclamation.max_queue_depth
+           << "); " << reclamation.batches_inline << " inline, "
+           << reclamation.batches_background << " in background" << endl;
+    if (reclamation.batches_background)
+        stream << format("  background latency mean %.6fs max %.6fs",
+                         reclamation.total_latency
+                             / reclamation.batches_background,
+                         reclamation.max_latency)
+               << endl;
+
+    stream << "slabs: " << slab.slab_bytes << " bytes, "
+           << slab.depot_blocks << " blocks free in depot; "
+           << slab.large_allocations << " too big for a slab" << endl;
+
+    const Adaptive_Lock::Stats * locks[3]
+        = { &commit_lock, &commit_stripes, &snapshot_lock };
+    const char * lock_names[3]
+        = { "commit_lock", "commit stripes", "snapshot lock" };
+
+    for (unsigned i = 0;  i < 3;  ++i)
+        stream << lock_names[i] << ": " << locks[i]->acquisitions
+               << " acquisitions, " << locks[i]->contended << " contended, "
+               << locks[i]->spins << " spins, " << locks[i]->parks
+               << " parks" << endl;
+}
+
+MVCC_Stats get_mvcc_stats(bool by_type)
+{
+    MVCC_Stats result;
+
+    int generation = stats_generation;
+    for (Thread_Stats * it = thread_stats_list;  it;  it = it->next)
+        if (it->generation == generation)
+            result.commits += it->stats;
+
+    result.early_conflicts = get_num_early_conflicts();
+    result.barged_commits = get_num_barged_commits();
+
+    result.current_epoch = get_current_epoch();
+
+    Snapshot_Info::Usage usage = snapshot_info.usage(by_type);
+    result.live_snapshots = usage.snapshots;
+    result.snapshot_entries = usage.entries;
+    result.oldest_snapshot_epoch
+        = (usage.oldest_epoch ? usage.oldest_epoch : result.current_epoch);
+    result.versions_retained = usage.versions_retained;
+
+    for (map<const type_info *, size_t>::const_iterator
+             it = usage.by_type.begin(),
+             end = usage.by_type.end();
+         it != end;  ++it)
+        result.versions_retained_by_type[demangle(it->first->name())]
+            += it->second;
+
+    result.reclamation = get_reclamation_stats();
+    result.slab = Slab_Allocator::stats();
+
+    result.commit_lock = commit_lock.stats();
+    result.commit_stripes = Commit_Stripes::lock_stats();
+    result.snapshot_lock = snapshot_info.lock_stats();
+
+    return result;
+}
+
+void reset_mvcc_stats()
+{
+    atomic_add(stats_generation, 1);
+}
+
+} // namespace JMVCC
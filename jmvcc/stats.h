@@ -0,0 +1,260 @@
+/* stats.h                                                         -*- C++ -*-
+   Jeremy Barnes, 19 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Statistics about commits, snapshots, locks and reclamation.
+*/
+
+#ifndef __jmvcc__stats_h__
+#define __jmvcc__stats_h__
+
+#include "jmvcc_defs.h"
+#include "adaptive_lock.h"
+#include "garbage.h"
+#include "slab_allocator.h"
+#include <stdint.h>
+#include <time.h>
+#include <iostream>
+#include <string>
+#include <map>
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* LATENCY_HISTOGRAM                                                         */
+/*****************************************************************************/
+
+/** Histogram of times in nanoseconds, in power of two buckets: bucket i
+    holds those in [2^i, 2^(i+1)).  Percentiles are therefore only accurate
+    to within a factor of two, which is enough to see where the time goes.
+*/
+
+struct Latency_Histogram {
+    /** Each power of two is split into SUB_BUCKETS linear buckets, so that
+        a bucket is no more than 1/SUB_BUCKETS of the values in it wide.
+        Goes up to about 18 minutes. */
+    enum { SUB_BUCKET_BITS = 3,
+           SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+           MAX_BITS = 40,
+           NUM_BUCKETS = (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS };
+
+    Latency_Histogram()
+    {
+        clear();
+    }
+
+    uint64_t count;             ///< Number of samples
+    uint64_t total_ns;          ///< Sum of the samples
+    uint64_t max_ns;            ///< Biggest sample
+    uint64_t buckets[NUM_BUCKETS];
+
+    void record(uint64_t ns)
+    {
+        int bucket = NUM_BUCKETS - 1;
+        if (ns < SUB_BUCKETS) bucket = ns;
+        else {
+            // The top SUB_BUCKET_BITS + 1 bits pick the bucket
+            int bits = 63 - __builtin_clzll(ns);
+            if (bits < MAX_BITS)
+                bucket = (bits - SUB_BUCKET_BITS + 1) * SUB_BUCKETS
+                    + ((ns >> (bits - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+        }
+        ++buckets[bucket];
+        ++count;
+        total_ns += ns;
+        if (ns > max_ns) max_ns = ns;
+    }
+
+    void clear();
+
+    /// Mean in nanoseconds; zero if there are no samples
+    double mean() const;
+
+    /** The given fraction (0 to 1) of the samples are at or below this many
+        nanoseconds; percentile(0.99) is the p99.  It's the upper bound of
+        the bucket, so it is at most 1/SUB_BUCKETS (12.5%) too high.  Zero
+        if there are no samples. */
+    uint64_t percentile(double fraction) const;
+
+    /// Lowest and highest values that go in the given bucket
+    static uint64_t bucket_min(unsigned bucket);
+    static uint64_t bucket_max(unsigned bucket);
+
+    Latency_Histogram & operator += (const Latency_Histogram & other);
+};
+
+/// Monotonic clock in nanoseconds, for timing commits
+inline uint64_t stats_clock()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*****************************************************************************/
+/* COMMIT_STATS                                                              */
+/*****************************************************************************/
+
+/** The phases of a commit; see Sandbox::commit(). */
+enum Commit_Phase {
+    PHASE_CHECK,      ///< Looking for conflicts, with nothing locked
+    PHASE_PREPARE,    ///< prepare() of the objects, with nothing locked
+    PHASE_LOCK,       ///< Waiting for the commit stripes
+    PHASE_EPOCH,      ///< Allocating an epoch (waiting for commit_lock)
+    PHASE_SETUP,      ///< setup() of the objects
+    PHASE_PUBLISH,    ///< Waiting for earlier epochs to be published
+    PHASE_CONFIRM,    ///< commit() or rollback() of the objects
+    PHASE_RELEASE,    ///< Releasing the stripes, cleanups and clear()
+    PHASE_TOTAL,      ///< The whole commit, whatever happened
+    NUM_COMMIT_PHASES
+};
+
+const char * print(Commit_Phase phase);
+
+/** Why a commit failed. */
+enum Abort_Reason {
+    ABORT_CHECK,      ///< check() found a conflict
+    ABORT_SETUP,      ///< setup() found a conflict
+    ABORT_DOOMED,     ///< Early conflict detection had already found one
+    ABORT_BARGED,     ///< Gave way to a higher priority transaction
+    ABORT_EXCEPTION,  ///< Something threw during the commit
+    NUM_ABORT_REASONS
+};
+
+const char * print(Abort_Reason reason);
+
+/** Counters for commits.  Each thread keeps its own, so that counting
+    costs nothing but a few increments; get_mvcc_stats() adds them up.
+*/
+struct Commit_Stats {
+    Commit_Stats()
+    {
+        clear();
+    }
+
+    uint64_t commits;                     ///< Number that succeeded
+    uint64_t aborts[NUM_ABORT_REASONS];   ///< Number that failed, by reason
+    uint64_t commits_retried;  ///< Succeeded only after failing at least once
+    uint64_t retries;          ///< Failures before those eventually succeeded
+    uint64_t max_retries;      ///< Most failures before one succeeded
+
+    /// How long each phase took, for commits that got that far
+    Latency_Histogram phases[NUM_COMMIT_PHASES];
+
+    uint64_t total_aborts() const;
+
+    void clear();
+
+    Commit_Stats & operator += (const Commit_Stats & other);
+};
+
+/** Times the phases of a commit; see Sandbox::commit().  When it goes out
+    of scope, the times and the outcome are added to the thread's
+    statistics.  Unless committed() or aborted() is called, it counts as
+    aborted by an exception.
+*/
+struct Commit_Timer {
+    Commit_Timer()
+        : start(stats_clock()), last(start), outcome(ABORT_EXCEPTION)
+    {
+        for (unsigned i = 0;  i < NUM_COMMIT_PHASES;  ++i)
+            times[i] = NOT_REACHED;
+    }
+
+    ~Commit_Timer()
+    {
+        record();
+    }
+
+    /// The given phase has just finished
+    void phase(Commit_Phase phase)
+    {
+        uint64_t now = stats_clock();
+        times[phase] = now - last;
+        last = now;
+    }
+
+    void committed() { outcome = NUM_ABORT_REASONS; }
+
+    void aborted(Abort_Reason reason) { outcome = reason; }
+
+private:
+    static const uint64_t NOT_REACHED = (uint64_t)-1;
+    uint64_t start, last;
+    uint64_t times[NUM_COMMIT_PHASES];
+    Abort_Reason outcome;  ///< NUM_ABORT_REASONS if it committed
+
+    void record();
+};
+
+/** Record that a transaction committed after failing retries times. */
+void record_commit_retries(int retries);
+
+
+/*****************************************************************************/
+/* MVCC_STATS                                                                */
+/*****************************************************************************/
+
+/** Everything that we know about how the system is doing. */
+struct MVCC_Stats {
+    MVCC_Stats();
+
+    /// Commits, added up over all threads
+    Commit_Stats commits;
+
+    /// Transactions found to conflict before they tried to commit
+    size_t early_conflicts;
+
+    /// Commits that gave way to a higher priority transaction
+    size_t barged_commits;
+
+    Epoch current_epoch;
+
+    /// Epoch of the oldest snapshot alive, which stops everything after it
+    /// from being cleaned up; the current epoch if there are no snapshots
+    Epoch oldest_snapshot_epoch;
+
+    size_t live_snapshots;     ///< Snapshots (including transactions) alive
+    size_t snapshot_entries;   ///< Distinct epochs that they are in
+
+    /// Old versions waiting for the snapshots that can see them to finish
+    size_t versions_retained;
+
+    /// The same, by type of object.  Only filled in by get_mvcc_stats(true).
+    std::map<std::string, size_t> versions_retained_by_type;
+
+    /// Memory waiting to be reclaimed, and how long it's taking
+    Reclamation_Stats reclamation;
+
+    /// Memory for version tables
+    Slab_Allocator::Stats slab;
+
+    /// Contention on the locks
+    Adaptive_Lock::Stats commit_lock;
+    Adaptive_Lock::Stats commit_stripes;
+    Adaptive_Lock::Stats snapshot_lock;
+
+    void dump(std::ostream & stream = std::cerr) const;
+};
+
+/** Gather the statistics.  Cheap enough to call every second or so; with
+    by_type it needs to look at every version waiting to be cleaned up, and
+    so can take a while when a long lived snapshot is holding a lot of them
+    up.
+*/
+MVCC_Stats get_mvcc_stats(bool by_type = false);
+
+/** Set the commit statistics back to zero.  Lock and reclamation statistics
+    keep counting.  Each thread clears its own statistics the next time it
+    records something, and until then they aren't counted, so this is safe
+    to call whilst other threads are committing.  Commits that are in
+    progress at the same time may or may not be counted.
+*/
+void reset_mvcc_stats();
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__stats_h__ */
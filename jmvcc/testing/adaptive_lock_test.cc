@@ -0,0 +1,218 @@
+/* adaptive_lock_test.cc
+   Jeremy Barnes, 16 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test for the adaptive lock.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "jml/utils/string_functions.h"
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <ace/Synch.h>
+#include "jml/arch/timers.h"
+#include "jmvcc/adaptive_lock.h"
+#include <unistd.h>
+#include <sched.h>
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+using boost::unit_test::test_suite;
+
+BOOST_AUTO_TEST_CASE( test_adaptive_lock_basics )
+{
+    Adaptive_Lock lock;
+
+    BOOST_CHECK_EQUAL(lock.acquire(), 0);
+    BOOST_CHECK_EQUAL(lock.tryacquire(), -1);
+    BOOST_CHECK_EQUAL(errno, EBUSY);
+    BOOST_CHECK_EQUAL(lock.release(), 0);
+
+    {
+        ACE_Guard<Adaptive_Lock> guard(lock);
+        BOOST_CHECK(guard.locked());
+        BOOST_CHECK_EQUAL(lock.tryacquire(), -1);
+    }
+
+    BOOST_CHECK_EQUAL(lock.tryacquire(), 0);
+    lock.release();
+
+    Adaptive_Lock::Stats stats = lock.stats();
+    BOOST_CHECK_EQUAL(stats.acquisitions, 3);
+    BOOST_CHECK_EQUAL(stats.contended, 0);
+    BOOST_CHECK_EQUAL(stats.parks, 0);
+
+    lock.reset_stats();
+    BOOST_CHECK_EQUAL(lock.stats().acquisitions, 0);
+}
+
+// A thread that finds the lock held for a long time ends up asleep, and is
+// woken up when it's released
+BOOST_AUTO_TEST_CASE( test_adaptive_lock_parks )
+{
+    Adaptive_Lock lock;
+    boost::barrier barrier(2);
+
+    struct Waiter {
+        static void run(Adaptive_Lock & lock, boost::barrier & barrier)
+        {
+            barrier.wait();
+            ACE_Guard<Adaptive_Lock> guard(lock);
+        }
+    };
+
+    lock.acquire();
+    boost::thread thread(boost::bind(&Waiter::run, boost::ref(lock),
+                                     boost::ref(barrier)));
+    barrier.wait();
+    usleep(50000);
+    lock.release();
+    thread.join();
+
+    Adaptive_Lock::Stats stats = lock.stats();
+    BOOST_CHECK_EQUAL(stats.acquisitions, 2);
+    BOOST_CHECK_EQUAL(stats.contended, 1);
+    BOOST_CHECK_GE(stats.parks, 1);
+}
+
+void increment_thread(Adaptive_Lock & lock, size_t & counter, int iter,
+                      boost::barrier & barrier)
+{
+    barrier.wait();
+
+    for (unsigned i = 0;  i < iter;  ++i) {
+        ACE_Guard<Adaptive_Lock> guard(lock);
+        // Not atomic; only the lock stops us from losing updates
+        size_t val = counter;
+        if (i % 64 == 0) sched_yield();
+        counter = val + 1;
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_adaptive_lock_contended )
+{
+    int nthreads = 8, niter = 50000;
+
+    Adaptive_Lock lock;
+    size_t counter = 0;
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    Timer timer;
+    for (unsigned i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&increment_thread, boost::ref(lock),
+                                     boost::ref(counter), niter,
+                                     boost::ref(barrier)));
+    tg.join_all();
+
+    Adaptive_Lock::Stats stats = lock.stats();
+
+    cerr << format("%d threads: %.3fs, %lld acquisitions, %lld contended, "
+                   "%lld spins, %lld parks",
+                   nthreads, timer.elapsed_wall(),
+                   (long long)stats.acquisitions, (long long)stats.contended,
+                   (long long)stats.spins, (long long)stats.parks)
+         << endl;
+
+    BOOST_CHECK_EQUAL(counter, nthreads * niter);
+    BOOST_CHECK_EQUAL(stats.acquisitions, nthreads * niter);
+    BOOST_CHECK_LE(stats.contended, stats.acquisitions);
+}
+
+struct Flag_Set {
+    Flag_Set(const volatile int & flag)
+        : flag(flag)
+    {
+    }
+
+    const volatile int & flag;
+
+    bool operator () () const { return flag != 0; }
+};
+
+void wait_for_flag(Wait_Queue & queue, const volatile int & flag,
+                   boost::barrier & barrier)
+{
+    barrier.wait();
+    queue.wait(Flag_Set(flag));
+}
+
+// A thread that waits for a long time ends up asleep, and is woken up by
+// notify()
+BOOST_AUTO_TEST_CASE( test_wait_queue_parks )
+{
+    Wait_Queue queue;
+    volatile int flag = 0;
+    boost::barrier barrier(2);
+
+    // Already true: returns straight away
+    flag = 1;
+    queue.wait(Flag_Set(flag));
+    BOOST_CHECK_EQUAL(queue.parks(), 0);
+    flag = 0;
+
+    boost::thread thread(boost::bind(&wait_for_flag, boost::ref(queue),
+                                     boost::cref(flag),
+                                     boost::ref(barrier)));
+    barrier.wait();
+    usleep(50000);
+    flag = 1;
+    queue.notify();
+    thread.join();
+
+    BOOST_CHECK_GE(queue.parks(), 1);
+}
+
+struct Counter_Reached {
+    Counter_Reached(const volatile int & counter, int value)
+        : counter(counter), value(value)
+    {
+    }
+
+    const volatile int & counter;
+    int value;
+
+    bool operator () () const { return counter >= value; }
+};
+
+// Each thread waits for the counter to get to its turn before incrementing
+// it, like commits publishing their epochs; a lost wakeup hangs
+void take_turns(Wait_Queue & queue, volatile int & counter, int thread,
+                int nthreads, int niter, boost::barrier & barrier)
+{
+    barrier.wait();
+
+    for (int i = 0;  i < niter;  ++i) {
+        int turn = i * nthreads + thread;
+        queue.wait(Counter_Reached(counter, turn));
+        counter = turn + 1;
+        queue.notify();
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_wait_queue_turns )
+{
+    int nthreads = 4, niter = 5000;
+
+    Wait_Queue queue;
+    volatile int counter = 0;
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    for (unsigned i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&take_turns, boost::ref(queue),
+                                     boost::ref(counter), i, nthreads, niter,
+                                     boost::ref(barrier)));
+    tg.join_all();
+
+    cerr << "wait queue: " << queue.parks() << " parks" << endl;
+
+    BOOST_CHECK_EQUAL(counter, nthreads * niter);
+}
@@ -86,6 +86,37 @@ BOOST_AUTO_TEST_CASE(test_cleanup_no_critical_section)
     BOOST_CHECK_EQUAL(v, 1);
 }
 
+void add_to_var(void * var, void * val)
+{
+    *reinterpret_cast<int *>(var) += reinterpret_cast<size_t>(val);
+}
+
+BOOST_AUTO_TEST_CASE(test_raw_cleanup)
+{
+    int v = 0, v2 = 0;
+
+    enter_critical();
+
+    schedule_raw_cleanup(add_to_var, &v, reinterpret_cast<void *>(2));
+    schedule_small_cleanup(Set_Var(v2, 3));
+
+    // Enough to need more than one segment
+    for (unsigned i = 0;  i < 100;  ++i)
+        schedule_raw_cleanup(add_to_var, &v, reinterpret_cast<void *>(1));
+
+    BOOST_CHECK_EQUAL(v, 0);
+    BOOST_CHECK_EQUAL(v2, 0);
+
+    leave_critical();
+
+    BOOST_CHECK_EQUAL(v, 102);
+    BOOST_CHECK_EQUAL(v2, 3);
+
+    // Outside a critical section, it runs straight away
+    schedule_raw_cleanup(add_to_var, &v, reinterpret_cast<void *>(1));
+    BOOST_CHECK_EQUAL(v, 103);
+}
+
 size_t num_live = 0;
 size_t max_num_live = 0;
 
@@ -235,6 +266,8 @@ void run_garbage_test(int nthreads, int niter, int mode)
     
     tg.join_all();
 
+    wait_for_reclamation();
+
     cerr << "garbage collector status at end" << endl;
 
     BOOST_CHECK_EQUAL(errors, 0);
@@ -272,6 +305,81 @@ BOOST_AUTO_TEST_CASE(garbage_torture)
     run_garbage_test_mode(3);
 }
 
+BOOST_AUTO_TEST_CASE(test_background_reclamation)
+{
+    Reclamation_Stats before = get_reclamation_stats();
+
+    set_background_reclamation(2, 16);
+    BOOST_CHECK_EQUAL(get_background_reclamation(), 2);
+
+    run_garbage_test_mode(0);
+    run_garbage_test_mode(3);
+
+    Reclamation_Stats after = get_reclamation_stats();
+
+    cerr << "batches inline " << after.batches_inline - before.batches_inline
+         << " background " << after.batches_background
+         << " max queue depth " << after.max_queue_depth
+         << " mean latency "
+         << after.total_latency / after.batches_background * 1e6 << "us"
+         << " max latency " << after.max_latency * 1e6 << "us" << endl;
+
+    BOOST_CHECK(after.batches_background > before.batches_background);
+    BOOST_CHECK_EQUAL(after.queue_depth, 0);
+    BOOST_CHECK(after.max_queue_depth <= 16);
+
+    set_background_reclamation(0);
+    BOOST_CHECK_EQUAL(get_background_reclamation(), 0);
+
+    // Back to running cleanups inline
+    int v = 0;
+    enter_critical();
+    schedule_cleanup(Set_Var(v, 1));
+    leave_critical();
+    BOOST_CHECK_EQUAL(v, 1);
+}
+
+void hold_critical(boost::barrier & entered, boost::barrier & finished)
+{
+    enter_critical();
+    entered.wait();
+    finished.wait();
+    leave_critical();
+}
+
+// A critical section that stays open holds up the cleanups scheduled
+// whilst it's open, but the readers that come and go in the meantime
+// don't each have to look for them
+BOOST_AUTO_TEST_CASE(test_long_critical_section)
+{
+    boost::barrier entered(2), finished(2);
+    boost::thread holder(boost::bind(&hold_critical, boost::ref(entered),
+                                     boost::ref(finished)));
+    entered.wait();
+
+    int v = 0;
+    enter_critical();
+    schedule_cleanup(Set_Var(v, 1));
+    leave_critical();
+    BOOST_CHECK_EQUAL(v, 0);
+
+    size_t scans_before = get_reclamation_stats().scans;
+
+    for (unsigned i = 0;  i < 1000;  ++i) {
+        enter_critical();
+        leave_critical();
+    }
+
+    BOOST_CHECK_EQUAL(get_reclamation_stats().scans, scans_before);
+    BOOST_CHECK_EQUAL(v, 0);
+
+    // Once the holder goes, so does the cleanup
+    finished.wait();
+    holder.join();
+
+    BOOST_CHECK_EQUAL(v, 1);
+}
+
 BOOST_AUTO_TEST_CASE(test_recursive_cleanup)
 {
     int v = 0;
@@ -280,3 +388,91 @@ BOOST_AUTO_TEST_CASE(test_recursive_cleanup)
 
     BOOST_CHECK_EQUAL(v, 1);
 }
+
+struct Scaling_Thread {
+
+    boost::barrier & barrier;
+    int niter;
+    int write_every;
+    int thread;
+    Checked_Object ** vals;
+    int & errors;
+
+    Scaling_Thread(boost::barrier & barrier, int niter, int write_every,
+                   int thread, Checked_Object ** vals, int & errors)
+        : barrier(barrier), niter(niter), write_every(write_every),
+          thread(thread), vals(vals), errors(errors)
+    {
+    }
+
+    void operator () ()
+    {
+        int local_errors = 0;
+
+        barrier.wait();
+
+        for (unsigned iter = 0;  iter < niter;  ++iter) {
+            enter_critical();
+
+            if (vals[thread]->get() != iter) ++local_errors;
+
+            if (write_every && iter % write_every == 0) {
+                Checked_Object * old = vals[thread];
+                vals[thread] = new Checked_Object(iter + 1);
+                schedule_cleanup(Delete_Object<Checked_Object>(old));
+            }
+            else vals[thread]->val = iter + 1;
+
+            leave_critical();
+        }
+
+        atomic_add(errors, local_errors);
+    }
+};
+
+void run_scaling_test(int nthreads, int niter, int write_every)
+{
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+
+    Checked_Object * vals[nthreads];
+    for (unsigned i = 0;  i < nthreads;  ++i)
+        vals[i] = new Checked_Object(0);
+
+    int errors = 0;
+
+    Timer timer;
+    for (unsigned i = 0;  i < nthreads;  ++i)
+        tg.create_thread(Scaling_Thread(barrier, niter, write_every, i,
+                                        vals, errors));
+    tg.join_all();
+
+    double elapsed = timer.elapsed_wall();
+
+    cerr << format("%3d threads, write every %4d: %8.2fns per critical section",
+                   nthreads, write_every,
+                   elapsed * 1e9 / (1.0 * niter * nthreads))
+         << endl;
+
+    BOOST_CHECK_EQUAL(errors, 0);
+    BOOST_CHECK_EQUAL(num_live, nthreads);
+    BOOST_CHECK_EQUAL(get_num_in_critical(), 0);
+
+    for (unsigned i = 0;  i < nthreads;  ++i) {
+        BOOST_CHECK_EQUAL(vals[i]->get(), niter);
+        delete vals[i];
+    }
+
+    BOOST_CHECK_EQUAL(num_live, 0);
+}
+
+// Not a correctness test as such: shows how the cost of a critical section
+// scales with the number of threads, for readers only and with some writers
+BOOST_AUTO_TEST_CASE(test_critical_section_scaling)
+{
+    int write_every[3] = { 0, 100, 1 };
+
+    for (unsigned w = 0;  w < 3;  ++w)
+        for (int nthreads = 1;  nthreads <= 16;  nthreads *= 2)
+            run_scaling_test(nthreads, 100000, write_every[w]);
+}
@@ -6,3 +6,5 @@ $(eval $(call test,epoch_compression_test,jmvcc arch boost_thread-mt,boost))
 $(eval $(call test,garbage_test,jmvcc arch boost_thread-mt,boost))
 $(eval $(call test,sandbox_test,jmvcc arch boost_thread-mt,boost))
 $(eval $(call test,version_table_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,adaptive_lock_test,jmvcc arch boost_thread-mt,boost))
+$(eval $(call test,slab_allocator_test,jmvcc arch boost_thread-mt,boost))
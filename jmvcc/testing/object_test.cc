@@ -22,12 +22,14 @@
 #include "jml/arch/exception_handler.h"
 #include "jml/arch/threads.h"
 #include <set>
+#include <algorithm>
 #include "jml/arch/timers.h"
 #include "jml/arch/backtrace.h"
 #include <sched.h>
 #include "jmvcc/transaction.h"
 #include "jmvcc/versioned.h"
 #include "jmvcc/versioned2.h"
+#include "jmvcc/versioned_small.h"
 #include "jml/arch/demangle.h"
 #include "jml/utils/testing/live_counting_obj.h"
 
@@ -87,9 +89,9 @@ void test0_type()
         
         // Check that the snapshot is properly there
         BOOST_REQUIRE_EQUAL(snapshot_info.entry_count(), 1);
-        BOOST_CHECK_EQUAL(snapshot_info.entries.begin()->first, get_current_epoch());
-        BOOST_REQUIRE_EQUAL(snapshot_info.entries.begin()->second.snapshots.size(), 1);
-        BOOST_CHECK_EQUAL(*snapshot_info.entries.begin()->second.snapshots.begin(), &trans1);
+        BOOST_CHECK_EQUAL(snapshot_info.oldest->epoch, get_current_epoch());
+        BOOST_REQUIRE_EQUAL(snapshot_info.oldest->snapshots, 1);
+        BOOST_CHECK_EQUAL(trans1.epoch(), get_current_epoch());
         
         // Check that the correct value is copied over
         BOOST_CHECK_EQUAL(myval.mutate(), 6);
@@ -109,10 +111,9 @@ void test0_type()
 
         // Check that the snapshot is properly there
         BOOST_REQUIRE_EQUAL(snapshot_info.entry_count(), 1);
-        BOOST_CHECK_EQUAL(snapshot_info.entries.begin()->first,
-                          get_current_epoch());
-        BOOST_REQUIRE_EQUAL(snapshot_info.entries.begin()->second.snapshots.size(), 1);
-        BOOST_CHECK_EQUAL(*snapshot_info.entries.begin()->second.snapshots.begin(), &trans1);
+        BOOST_CHECK_EQUAL(snapshot_info.oldest->epoch, get_current_epoch());
+        BOOST_REQUIRE_EQUAL(snapshot_info.oldest->snapshots, 1);
+        BOOST_CHECK_EQUAL(trans1.epoch(), get_current_epoch());
         
         // Finish the transaction without committing it
     }
@@ -142,6 +143,7 @@ BOOST_AUTO_TEST_CASE( test0 )
 {
     test0_type<Versioned<int> >();
     test0_type<Versioned2<int> >();
+    test0_type<Versioned_Small<int> >();
 }
 
 template<class Var>
@@ -517,6 +519,9 @@ BOOST_AUTO_TEST_CASE( test1 )
     run_object_test<Versioned2<int> >(2,  50000);
     run_object_test<Versioned2<int> >(10, 10000);
 
+    run_object_test<Versioned_Small<int> >(1, 100000);
+    run_object_test<Versioned_Small<int> >(10, 10000);
+
     run_object_test<Versioned<int> >(1, 100000);
     run_object_test<Versioned<int> >(10, 10000);
     run_object_test<Versioned<int> >(100, 1000);
@@ -567,7 +572,7 @@ struct Object_Test_Thread2 {
                     total += vars[i].read();
 
                 if (total != 0) {
-                    ACE_Guard<ACE_Mutex> guard(commit_lock);
+                    ACE_Guard<Adaptive_Lock> guard(commit_lock);
                     cerr << "--------------- total not zero" << endl;
                     snapshot_info.dump();
                     cerr << "total is " << total << endl;
@@ -658,6 +663,8 @@ BOOST_AUTO_TEST_CASE( test2 )
     run_object_test2<Versioned2<int> >(10, 10000, 100);
     run_object_test2<Versioned<int> >(100, 1000, 10);
     run_object_test2<Versioned2<int> >(100, 1000, 10);
+    run_object_test2<Versioned_Small<int> >(10, 10000, 100);
+    run_object_test2<Versioned_Small<int> >(100, 1000, 10);
     run_object_test2<Versioned<int> >(1000, 100, 100);
     run_object_test2<Versioned2<int> >(1000, 100, 100);
 
@@ -674,6 +681,98 @@ BOOST_AUTO_TEST_CASE( test2 )
          << "s" << endl;
 }
 
+template<class Var>
+void disjoint_commit_thread(Var & var, int iter, boost::barrier & barrier,
+                            size_t & failures)
+{
+    // Wait for all threads to start up before we continue
+    barrier.wait();
+
+    int local_failures = 0;
+
+    for (unsigned i = 0;  i < iter;  ++i) {
+        Local_Transaction trans;
+        int tries = 0;
+        do {
+            ++tries;
+            var.mutate() += 1;
+        } while (!trans.commit());
+
+        local_failures += tries - 1;
+    }
+
+    atomic_add(failures, local_failures);
+}
+
+template<class Var>
+void run_disjoint_commit_test(int nthreads, int niter)
+{
+    cerr << endl << "testing disjoint commits with " << nthreads
+         << " threads and " << niter << " iter"
+         << " class " << demangle(typeid(Var).name()) << endl;
+
+    Epoch starting_epoch = get_current_epoch();
+
+    {
+        Var vals[nthreads];
+        boost::barrier barrier(nthreads);
+        boost::thread_group tg;
+
+        size_t failures = 0;
+
+        Timer timer;
+        for (unsigned i = 0;  i < nthreads;  ++i)
+            tg.create_thread(boost::bind(&disjoint_commit_thread<Var>,
+                                         boost::ref(vals[i]),
+                                         niter,
+                                         boost::ref(barrier),
+                                         boost::ref(failures)));
+
+        tg.join_all();
+
+        cerr << "elapsed: " << timer.elapsed() << endl;
+
+        // Nobody shares an object, so nothing should have failed.  Each
+        // commit should have had its own epoch, unless they were grouped,
+        // in which case at least one group should have shared an epoch.
+        BOOST_CHECK_EQUAL(failures, 0);
+        if (get_group_commit())
+            BOOST_CHECK_LT(get_current_epoch(),
+                           starting_epoch + nthreads * niter);
+        else BOOST_CHECK_EQUAL(get_current_epoch(),
+                               starting_epoch + nthreads * niter);
+
+        Local_Transaction trans;
+        for (unsigned i = 0;  i < nthreads;  ++i)
+            BOOST_CHECK_EQUAL(vals[i].read(), niter);
+    }
+
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_disjoint_commits )
+{
+    run_disjoint_commit_test<Versioned<int> >(10, 10000);
+    run_disjoint_commit_test<Versioned2<int> >(10, 10000);
+    run_disjoint_commit_test<Versioned2<int> >(100, 1000);
+    run_disjoint_commit_test<Versioned_Small<int> >(10, 10000);
+}
+
+BOOST_AUTO_TEST_CASE( test_group_commit )
+{
+    cerr << endl << endl << "========= test group commit" << endl;
+
+    set_group_commit(true);
+
+    run_disjoint_commit_test<Versioned2<int> >(10, 10000);
+    run_object_test2<Versioned<int> >(10, 10000, 100);
+    run_object_test2<Versioned2<int> >(10, 10000, 100);
+    run_object_test2<Versioned2<int> >(100, 1000, 10);
+    run_object_test2<Versioned2<Obj> >(100, 100,  10);
+
+    set_group_commit(false);
+}
+
 BOOST_AUTO_TEST_CASE( test_all_objects_destroyed )
 {
     cerr << endl << endl << "========= test all objects destroyed" << endl;
@@ -700,4 +799,199 @@ BOOST_AUTO_TEST_CASE( test_all_objects_destroyed )
          << "s" << endl;
 }
 
+/* Contention manager stress test: many threads fighting over a handful of
+   variables, each transaction reading them all and moving one unit from
+   one to another.  For each policy, reports the throughput and the latency
+   of a transaction from its first try to its successful commit. */
+
+template<class Var>
+void contention_thread(Var * vars, int nvars, int iter,
+                       boost::barrier & barrier,
+                       vector<double> & latencies,
+                       size_t & failures, size_t & errors)
+{
+    barrier.wait();
+
+    size_t local_failures = 0, local_errors = 0;
+    latencies.reserve(iter);
+
+    for (unsigned i = 0;  i < iter;  ++i) {
+        int var1 = random() % nvars, var2 = random() % nvars;
+
+        Timer timer;
+
+        // The same transaction is used for retries, so that the contention
+        // manager can keep track of it
+        Local_Transaction trans;
+        for (;;) {
+            ssize_t total = 0;
+            for (unsigned j = 0;  j < nvars;  ++j)
+                total += vars[j].read();
+            local_errors += (total != 0);
+
+            vars[var1].mutate() -= 1;
+            vars[var2].mutate() += 1;
+
+            if (trans.commit()) break;
+            ++local_failures;
+        }
+
+        latencies.push_back(timer.elapsed_wall());
+    }
+
+    atomic_add(failures, local_failures);
+    atomic_add(errors, local_errors);
+}
+
+template<class Var>
+void run_contention_test(const std::string & name,
+                         Contention_Manager * manager,
+                         int nthreads, int niter, int nvars)
+{
+    set_default_contention_manager(manager);
+
+    size_t barged_before = get_num_barged_commits();
+
+    {
+        Var vars[nvars];
+        boost::barrier barrier(nthreads);
+        boost::thread_group tg;
+
+        vector<vector<double> > latencies(nthreads);
+        size_t failures = 0, errors = 0;
+
+        Timer timer;
+        for (unsigned i = 0;  i < nthreads;  ++i)
+            tg.create_thread(boost::bind(&contention_thread<Var>,
+                                         vars, nvars, niter,
+                                         boost::ref(barrier),
+                                         boost::ref(latencies[i]),
+                                         boost::ref(failures),
+                                         boost::ref(errors)));
+        tg.join_all();
+
+        double elapsed = timer.elapsed_wall();
+
+        vector<double> all;
+        for (unsigned i = 0;  i < nthreads;  ++i)
+            all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+        std::sort(all.begin(), all.end());
+
+        size_t n = all.size();
+        cerr << format("%-8s %3d threads %3d vars: %8.0f commits/s "
+                       "%5.2f retries/commit %6zd barged  latency us: "
+                       "p50 %8.1f p99 %8.1f max %8.1f",
+                       name.c_str(), nthreads, nvars, n / elapsed,
+                       failures * 1.0 / n,
+                       get_num_barged_commits() - barged_before,
+                       all[n / 2] * 1e6, all[n * 99 / 100] * 1e6,
+                       all[n - 1] * 1e6)
+             << endl;
+
+        BOOST_CHECK_EQUAL(errors, 0);
+
+        Local_Transaction trans;
+        ssize_t total = 0;
+        for (unsigned i = 0;  i < nvars;  ++i)
+            total += vars[i].read();
+        BOOST_CHECK_EQUAL(total, 0);
+    }
+
+    set_default_contention_manager(0);
+
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_contention_managers )
+{
+    cerr << endl << endl << "========= test contention managers" << endl;
+
+    Backoff_Contention_Manager backoff;
+    Age_Contention_Manager age;
+    Karma_Contention_Manager karma;
+
+    for (unsigned i = 0;  i < 2;  ++i) {
+        int nthreads = (i == 0 ? 4 : 16), nvars = (i == 0 ? 2 : 8);
+        int niter = 20000 / nthreads;
+        run_contention_test<Versioned2<int> >("none", 0,
+                                              nthreads, niter, nvars);
+        run_contention_test<Versioned2<int> >("backoff", &backoff,
+                                              nthreads, niter, nvars);
+        run_contention_test<Versioned2<int> >("age", &age,
+                                              nthreads, niter, nvars);
+        run_contention_test<Versioned2<int> >("karma", &karma,
+                                              nthreads, niter, nvars);
+    }
+}
+
+/* Read throughput: each thread runs short transactions that read a few
+   variables, either as read-write transactions or read-only ones.  The
+   reads per second should scale with the number of cores. */
+
+template<class Trans>
+void read_thread(const Versioned2<int> * vars, int nvars, int iter,
+                 boost::barrier & barrier, size_t & errors)
+{
+    barrier.wait();
+
+    size_t local_errors = 0;
+
+    for (unsigned i = 0;  i < iter;  ++i) {
+        Trans trans;
+        int total = 0;
+        for (unsigned j = 0;  j < nvars;  ++j)
+            total += vars[j].read();
+        local_errors += (total != nvars);
+    }
+
+    atomic_add(errors, local_errors);
+}
+
+template<class Trans>
+double run_read_test(int nthreads, int niter, int nvars)
+{
+    Versioned2<int> vars[nvars];
+    {
+        Local_Transaction trans;
+        for (unsigned i = 0;  i < nvars;  ++i)
+            vars[i].write(1);
+        BOOST_CHECK(trans.commit());
+    }
+
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+    size_t errors = 0;
+
+    Timer timer;
+    for (unsigned i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&read_thread<Trans>, vars, nvars, niter,
+                                     boost::ref(barrier),
+                                     boost::ref(errors)));
+    tg.join_all();
+
+    double elapsed = timer.elapsed_wall();
+
+    BOOST_CHECK_EQUAL(errors, 0);
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+
+    return nthreads * niter * nvars / elapsed;
+}
+
+BOOST_AUTO_TEST_CASE( test_read_only_throughput )
+{
+    cerr << endl << endl << "========= test read-only throughput" << endl;
+
+    int nvars = 10, niter = 100000;
+
+    for (int nthreads = 1;  nthreads <= 8;  nthreads *= 2) {
+        double rw = run_read_test<Local_Transaction>(nthreads, niter, nvars);
+        double ro = run_read_test<Read_Only_Transaction>(nthreads, niter,
+                                                         nvars);
+        cerr << format("%d threads: read-write %10.0f reads/s  "
+                       "read-only %10.0f reads/s (%.2fx)",
+                       nthreads, rw, ro, ro / rw)
+             << endl;
+    }
+}
+
 #endif
@@ -16,6 +16,7 @@
 #include <iostream>
 #include <boost/thread.hpp>
 #include "jmvcc/sandbox.h"
+#include "jmvcc/arena.h"
 #include "jmvcc/versioned.h"
 #include "jmvcc/versioned2.h"
 #include "jml/utils/testing/live_counting_obj.h"
@@ -48,6 +49,67 @@ BOOST_AUTO_TEST_CASE( test_sandbox_calls_destructors )
     BOOST_CHECK_EQUAL(constructed, destroyed);
 }
 
+// Clearing the sandbox destroys the local values and the memory is reused
+BOOST_AUTO_TEST_CASE( test_sandbox_clear_reuses_memory )
+{
+    constructed = destroyed = 0;
+
+    {
+        Versioned<Obj> ver1(0), ver2(0);
+
+        Sandbox sandbox;
+
+        const Obj * v1 = sandbox.local_value<Obj>(&ver1, Obj(1));
+        const Obj * v2 = sandbox.local_value<Obj>(&ver2, Obj(2));
+        BOOST_CHECK_EQUAL(constructed, destroyed + 4);
+
+        sandbox.clear();
+        BOOST_CHECK_EQUAL(constructed, destroyed + 2);
+        BOOST_CHECK_EQUAL(sandbox.num_local_values(), 0);
+
+        const Obj * v1b = sandbox.local_value<Obj>(&ver1, Obj(3));
+        const Obj * v2b = sandbox.local_value<Obj>(&ver2, Obj(4));
+        BOOST_CHECK_EQUAL(v1, v1b);
+        BOOST_CHECK_EQUAL(v2, v2b);
+        BOOST_CHECK_EQUAL(*v1b, 3);
+        BOOST_CHECK_EQUAL(*v2b, 4);
+    }
+
+    BOOST_CHECK_EQUAL(constructed, destroyed);
+}
+
+BOOST_AUTO_TEST_CASE( test_arena )
+{
+    Arena arena;
+
+    size_t last_capacity = 0;
+    char * first = 0;
+
+    for (unsigned pass = 0;  pass < 4;  ++pass) {
+        vector<char *> allocated;
+        for (unsigned i = 0;  i < 1000;  ++i) {
+            char * mem = (char *)arena.allocate(24, 8);
+            BOOST_CHECK_EQUAL((size_t)mem % 8, 0);
+            std::fill(mem, mem + 24, (char)i);
+            allocated.push_back(mem);
+        }
+
+        // Nothing overlapped
+        for (unsigned i = 0;  i < 1000;  ++i)
+            BOOST_CHECK_EQUAL(allocated[i][0], (char)i);
+
+        // Once the biggest block that is kept is big enough, nothing more
+        // is allocated
+        if (pass >= 3) {
+            BOOST_CHECK_EQUAL(arena.capacity(), last_capacity);
+            BOOST_CHECK_EQUAL(allocated[0], first);
+        }
+
+        last_capacity = arena.capacity();
+        first = allocated[0];
+        arena.reset();
+    }
+}
 
 size_t counter = 1;
 
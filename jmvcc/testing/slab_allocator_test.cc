@@ -0,0 +1,158 @@
+/* slab_allocator_test.cc
+   Jeremy Barnes, 23 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Test for the slab allocator.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <iostream>
+#include <vector>
+#include "jmvcc/slab_allocator.h"
+#include "jmvcc/version_table.h"
+
+using namespace ML;
+using namespace JMVCC;
+using namespace std;
+
+using boost::unit_test::test_suite;
+
+BOOST_AUTO_TEST_CASE( test_slab_allocator_size_classes )
+{
+    BOOST_CHECK_EQUAL(Slab_Allocator::size_class(1), 0);
+    BOOST_CHECK_EQUAL(Slab_Allocator::size_class(16), 0);
+    BOOST_CHECK_EQUAL(Slab_Allocator::size_class(17), 1);
+    BOOST_CHECK_EQUAL(Slab_Allocator::size_class(1024),
+                      Slab_Allocator::NUM_CLASSES - 1);
+
+    for (size_t bytes = 1;  bytes <= Slab_Allocator::MAX_SIZE;  ++bytes) {
+        int cls = Slab_Allocator::size_class(bytes);
+        BOOST_REQUIRE(cls >= 0 && cls < Slab_Allocator::NUM_CLASSES);
+        size_t size = Slab_Allocator::class_size(cls);
+        BOOST_REQUIRE(size >= bytes);
+        BOOST_REQUIRE(size % 16 == 0);
+        if (cls > 0)
+            BOOST_REQUIRE(Slab_Allocator::class_size(cls - 1) < bytes);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_slab_allocator_reuse )
+{
+    Slab_Allocator allocator;
+
+    char * p1 = allocator.allocate(24);
+    BOOST_CHECK_EQUAL((size_t)p1 % 16, 0);
+    allocator.deallocate(p1, 24);
+
+    // The most recently freed block of the class comes straight back
+    char * p2 = allocator.allocate(32);
+    BOOST_CHECK_EQUAL(p1, p2);
+    allocator.deallocate(p2, 32);
+
+    // Too big for a size class
+    char * p3 = allocator.allocate(Slab_Allocator::MAX_SIZE + 1);
+    BOOST_CHECK(Slab_Allocator::stats().large_allocations > 0);
+    allocator.deallocate(p3, Slab_Allocator::MAX_SIZE + 1);
+}
+
+namespace {
+
+void allocate_blocks(vector<char *> & blocks, size_t n, size_t bytes)
+{
+    Slab_Allocator allocator;
+    for (unsigned i = 0;  i < n;  ++i) {
+        blocks.push_back(allocator.allocate(bytes));
+        // Write all over it, so that we find any overlap
+        memset(blocks.back(), i, bytes);
+    }
+}
+
+void free_blocks(vector<char *> & blocks, size_t bytes)
+{
+    Slab_Allocator allocator;
+    for (unsigned i = 0;  i < blocks.size();  ++i) {
+        if (blocks[i][0] != (char)i || blocks[i][bytes - 1] != (char)i)
+            throw Exception("block was overwritten");
+        allocator.deallocate(blocks[i], bytes);
+    }
+    blocks.clear();
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_slab_allocator_free_in_another_thread )
+{
+    // This is what happens to version tables whose cleanup is deferred:
+    // they are freed by whichever thread runs the cleanups
+    size_t n = 100000, bytes = 200;
+    vector<char *> blocks;
+
+    {
+        boost::thread allocator(boost::bind(allocate_blocks,
+                                            boost::ref(blocks), n, bytes));
+        allocator.join();
+    }
+
+    size_t slab_bytes = Slab_Allocator::stats().slab_bytes;
+    BOOST_CHECK(slab_bytes >= n * bytes);
+
+    {
+        boost::thread freer(boost::bind(free_blocks, boost::ref(blocks),
+                                        bytes));
+        freer.join();
+    }
+
+    // The freeing thread gave everything back when it exited, so another
+    // thread can allocate it all again without any more slabs
+    BOOST_CHECK(Slab_Allocator::stats().depot_blocks >= n);
+
+    {
+        boost::thread allocator(boost::bind(allocate_blocks,
+                                            boost::ref(blocks), n, bytes));
+        allocator.join();
+    }
+
+    BOOST_CHECK_EQUAL(Slab_Allocator::stats().slab_bytes, slab_bytes);
+
+    free_blocks(blocks, bytes);
+}
+
+namespace {
+
+typedef Version_Table<int> Slab_VT;
+
+/// Grow a table one entry at a time by copying it, as a commit does
+void grow_and_free_tables(int n)
+{
+    for (unsigned i = 0;  i < n;  ++i) {
+        Slab_VT * vt = Slab_VT::create(1, 1);
+        for (unsigned j = 0;  j < 5;  ++j) {
+            Slab_VT * vt2
+                = vt->copy(Slab_VT::capacity_for_append(vt->size() + 1));
+            vt2->push_back(j + 2, j + 2);
+            Slab_VT::free(vt, NEVER_PUBLISHED, SHARED);
+            vt = vt2;
+        }
+        if (vt->value_at_epoch(6) != 6)
+            throw Exception("wrong value");
+        Slab_VT::free(vt, NEVER_PUBLISHED, EXCLUSIVE);
+    }
+}
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_version_table_slab_allocator )
+{
+    // The first time through allocates a slab for each size of table
+    grow_and_free_tables(1);
+    size_t slab_bytes = Slab_Allocator::stats().slab_bytes;
+
+    // After that, the same blocks get reused
+    grow_and_free_tables(10000);
+    BOOST_CHECK_EQUAL(Slab_Allocator::stats().slab_bytes, slab_bytes);
+}
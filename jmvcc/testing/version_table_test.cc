@@ -15,9 +15,11 @@
 #include "jml/utils/testing/testing_allocator.h"
 #include <boost/test/unit_test.hpp>
 #include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
 #include <iostream>
 #include "jmvcc/version_table.h"
 #include "jml/utils/testing/live_counting_obj.h"
+#include "jml/arch/timers.h"
 
 using namespace ML;
 using namespace JMVCC;
@@ -232,3 +234,235 @@ BOOST_AUTO_TEST_CASE( test_version_table_pointer3 )
     BOOST_CHECK_EQUAL(alloc.bytes_outstanding, 0);
 }
 
+BOOST_AUTO_TEST_CASE( test_version_table_append )
+{
+    typedef Version_Table<Obj, No_Cleanup<Obj>, Testing_Allocator> VT;
+    Testing_Allocator_Data alloc;
+
+    constructed = destroyed = 0;
+
+    VT * vt = VT::create(Obj(1), 3, alloc);
+
+    BOOST_CHECK(vt->append(5, 2));
+    BOOST_CHECK(vt->append(8, 3));
+    BOOST_CHECK_EQUAL(vt->size(), 3);
+
+    // No more room
+    BOOST_CHECK(!vt->append(10, 4));
+    BOOST_CHECK_EQUAL(vt->size(), 3);
+    BOOST_CHECK_EQUAL(constructed, destroyed + 3);
+
+    BOOST_CHECK_EQUAL(vt->value_at_epoch(1), 1);
+    BOOST_CHECK_EQUAL(vt->value_at_epoch(4), 1);
+    BOOST_CHECK_EQUAL(vt->value_at_epoch(5), 2);
+    BOOST_CHECK_EQUAL(vt->value_at_epoch(7), 2);
+    BOOST_CHECK_EQUAL(vt->value_at_epoch(8), 3);
+    BOOST_CHECK_EQUAL(vt->value_at_epoch(100), 3);
+
+    // Copying seals it; the copy can be appended to but the original can't
+    VT * vt2 = vt->copy(VT::capacity_for_append(vt->size()));
+    BOOST_CHECK(vt->sealed());
+    BOOST_CHECK(!vt2->sealed());
+    BOOST_CHECK_EQUAL(vt2->size(), 3);
+
+    BOOST_CHECK(vt2->append(10, 4));
+    BOOST_CHECK_EQUAL(vt2->value_at_epoch(9), 3);
+    BOOST_CHECK_EQUAL(vt2->value_at_epoch(10), 4);
+
+    VT::free(vt, NEVER_PUBLISHED, SHARED);
+    VT::free(vt2, NEVER_PUBLISHED, EXCLUSIVE);
+
+    BOOST_CHECK_EQUAL(constructed, destroyed);
+
+    BOOST_CHECK_EQUAL(alloc.objects_outstanding, 0);
+    BOOST_CHECK_EQUAL(alloc.bytes_outstanding, 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_version_table_cleanup_seals )
+{
+    typedef Version_Table<int> VT;
+
+    VT * vt = VT::create(1, 4);
+    BOOST_CHECK(vt->append(5, 2));
+    BOOST_CHECK(vt->append(8, 3));
+
+    VT * vt2 = vt->cleanup(5);
+    BOOST_REQUIRE(vt2);
+    BOOST_CHECK(vt->sealed());
+    BOOST_CHECK(!vt->append(10, 4));
+
+    // The compacted table has room for one more in place
+    BOOST_CHECK_EQUAL(vt2->size(), 2);
+    BOOST_CHECK(vt2->append(10, 4));
+    BOOST_CHECK_EQUAL(vt2->value_at_epoch(1), 1);
+    BOOST_CHECK_EQUAL(vt2->value_at_epoch(9), 3);
+    BOOST_CHECK_EQUAL(vt2->value_at_epoch(10), 4);
+
+    VT::free(vt, NEVER_PUBLISHED, SHARED);
+    VT::free(vt2, NEVER_PUBLISHED, EXCLUSIVE);
+}
+
+BOOST_AUTO_TEST_CASE( test_version_table_stolen )
+{
+    typedef Version_Table<vector<int> > VT;
+
+    VT * vt = VT::create(vector<int>(3, 1), 2);
+
+    // The vector's memory goes into the table without being copied
+    vector<int> v(1000, 7);
+    const int * data = &v[0];
+    BOOST_CHECK(vt->append_stolen(5, v));
+    BOOST_CHECK(v.empty());
+    BOOST_CHECK_EQUAL(&vt->value_at_epoch(5)[0], data);
+    BOOST_CHECK_EQUAL(vt->value_at_epoch(4).size(), 3);
+
+    // No more room; it's left alone
+    vector<int> w(10, 9);
+    BOOST_CHECK(!vt->append_stolen(8, w));
+    BOOST_CHECK_EQUAL(w.size(), 10);
+
+    // Taken by a copy of the table, then given back when the copy isn't
+    // used
+    VT * vt2 = vt->copy(VT::capacity_for_append(vt->size() + 1));
+    vt2->back().valid_to = 8;
+    vt2->push_back_stolen(1, w);
+    BOOST_CHECK(w.empty());
+    BOOST_CHECK_EQUAL(vt2->value_at_epoch(8).size(), 10);
+
+    vt2->give_back(w);
+    BOOST_CHECK_EQUAL(w.size(), 10);
+    BOOST_CHECK(vt2->value_at_epoch(8).empty());
+
+    VT::free(vt2, NEVER_PUBLISHED, SHARED);
+    VT::free(vt, NEVER_PUBLISHED, EXCLUSIVE);
+
+    // Something that isn't worth swapping is copied
+    constructed = destroyed = 0;
+    {
+        typedef Version_Table<Obj> Obj_VT;
+        Obj_VT * vt = Obj_VT::create(Obj(1), 2);
+        Obj val(2);
+        BOOST_CHECK(vt->append_stolen(5, val));
+        BOOST_CHECK_EQUAL(val, 2);
+        BOOST_CHECK_EQUAL(vt->value_at_epoch(5), 2);
+        Obj_VT::free(vt, NEVER_PUBLISHED, EXCLUSIVE);
+    }
+    BOOST_CHECK_EQUAL(constructed, destroyed);
+}
+
+namespace {
+
+typedef Version_Table<int> Append_VT;
+
+struct Append_Reader {
+    Append_Reader(Append_VT * volatile & vt, volatile bool & finished,
+                  int & errors)
+        : vt(vt), finished(finished), errors(errors)
+    {
+    }
+
+    Append_VT * volatile & vt;
+    volatile bool & finished;
+    int & errors;
+
+    void operator () ()
+    {
+        while (!finished) {
+            const Append_VT * d = vt;
+
+            // The value written at epoch e is e, and epochs are appended
+            // in order, so we should never see anything newer than what
+            // we asked for.
+            int sz = d->size();
+            for (int epoch = 1;  epoch < 2 * sz;  ++epoch) {
+                int val = d->value_at_epoch(epoch);
+                if (val > epoch) ++errors;
+            }
+        }
+    }
+};
+
+} // file scope
+
+BOOST_AUTO_TEST_CASE( test_version_table_append_concurrent )
+{
+    Append_VT * volatile vt = Append_VT::create(1, 8);
+    volatile bool finished = false;
+    int errors = 0;
+
+    vector<Append_VT *> old_tables;
+
+    boost::thread_group tg;
+    for (unsigned i = 0;  i < 2;  ++i)
+        tg.create_thread(Append_Reader(vt, finished, errors));
+
+    // Append in place until it's full, then copy the first half and keep
+    // going.  The old tables are kept around until the end, since we're not
+    // in a critical section.
+    for (int epoch = 2;  epoch < 2000;  ++epoch) {
+        if (vt->append(epoch, epoch)) continue;
+
+        Append_VT * vt2 = vt->copy(Append_VT::capacity_for_append(8));
+        while (vt2->size() > 4)
+            vt2->pop_back(NEVER_PUBLISHED, EXCLUSIVE);
+        BOOST_CHECK(vt2->append(epoch, epoch));
+        Append_VT * old_vt = vt;
+        old_tables.push_back(old_vt);
+        memory_barrier();
+        vt = vt2;
+    }
+
+    finished = true;
+    tg.join_all();
+
+    BOOST_CHECK_EQUAL(errors, 0);
+
+    for (unsigned i = 0;  i < old_tables.size();  ++i)
+        Append_VT::free(old_tables[i], NEVER_PUBLISHED, SHARED);
+    Append_VT::free(vt, NEVER_PUBLISHED, EXCLUSIVE);
+}
+
+BOOST_AUTO_TEST_CASE( test_value_at_epoch_history_length )
+{
+    typedef Version_Table<int> VT;
+
+    // Entry i is valid from epoch 10 * i until 10 * (i + 1) - 1.  We check
+    // every lookup against a linear scan, then time lookups over the whole
+    // history and of the newest value.
+    for (int length = 1;  length <= 1024;  length *= 2) {
+        VT * vt = VT::create(length);
+        for (int i = 0;  i < length;  ++i)
+            vt->push_back(i == length - 1 ? 1 : 10 * (i + 1), i);
+
+        for (Epoch epoch = 1;  epoch < 10 * length + 10;  ++epoch) {
+            int expected = 0;
+            for (int i = length - 1;  i > 0;  --i) {
+                if (epoch >= vt->element(i - 1).valid_to) {
+                    expected = i;
+                    break;
+                }
+            }
+            BOOST_CHECK_EQUAL(vt->value_at_epoch(epoch), expected);
+        }
+
+        int n = 10000000 / (length + 10) + 100000;
+        int total = 0;
+
+        Timer timer;
+        for (int i = 0;  i < n;  ++i)
+            total += vt->value_at_epoch((i * 7919u) % (10 * length) + 1);
+        double elapsed_any = timer.elapsed_wall();
+
+        timer.restart();
+        for (int i = 0;  i < n;  ++i)
+            total += vt->value_at_epoch(10 * length + (i & 7));
+        double elapsed_newest = timer.elapsed_wall();
+
+        cerr << format("history %4d: %6.2fns per lookup, %6.2fns newest",
+                       length, elapsed_any / n * 1e9,
+                       elapsed_newest / n * 1e9)
+             << " (" << total << ")" << endl;
+
+        VT::free(vt, NEVER_PUBLISHED, EXCLUSIVE);
+    }
+}
@@ -25,9 +25,13 @@
 #include "jml/arch/timers.h"
 #include "jml/arch/backtrace.h"
 #include <sched.h>
+#include <unistd.h>
 #include "jmvcc/transaction.h"
 #include "jmvcc/versioned.h"
 #include "jmvcc/versioned2.h"
+#include "jmvcc/versioned_small.h"
+#include "jmvcc/versioned_counter.h"
+#include "jmvcc/stats.h"
 #include "jml/utils/testing/live_counting_obj.h"
 
 
@@ -281,3 +285,1024 @@ BOOST_AUTO_TEST_CASE( test_versioned_frees_everything )
     
     BOOST_CHECK_EQUAL(constructed, destroyed);
 }
+
+BOOST_AUTO_TEST_CASE( test_versioned2_inline_value )
+{
+    cerr << endl << "================ versioned2 inline value" << endl;
+
+    constructed = destroyed = 0;
+
+    {
+        Versioned2<Obj> var(0);
+        BOOST_CHECK_EQUAL(var.history_size(), 0);
+
+        for (int i = 1;  i <= 3;  ++i) {
+            {
+                // Keeps the old version alive until it's destroyed
+                Local_Transaction old;
+
+                {
+                    Local_Transaction t;
+                    var.mutate() = i;
+                    BOOST_CHECK(t.commit());
+                }
+
+                BOOST_CHECK_EQUAL(var.history_size(), 1);
+                BOOST_CHECK_EQUAL(var.read(), i - 1);
+            }
+
+            // The old version was cleaned up and the new one went inline
+            BOOST_CHECK_EQUAL(var.history_size(), 0);
+
+            Local_Transaction t;
+            BOOST_CHECK_EQUAL(var.read(), i);
+        }
+    }
+
+    BOOST_CHECK_EQUAL(constructed, destroyed);
+}
+
+BOOST_AUTO_TEST_CASE( test_commit_registers_cleanups_together )
+{
+    cerr << endl << "================ batched cleanup registration" << endl;
+
+    current_epoch_ = 700;
+    earliest_epoch_ = 700;
+
+    {
+        Versioned2<int> var1(0), var2(0), var3(0);
+
+        // Keeps the old versions alive
+        auto_ptr<Transaction> t1(new Transaction(false /* use_critical */));
+
+        {
+            Local_Transaction t;
+            var1.mutate() = 1;
+            var2.mutate() = 2;
+            var3.mutate() = 3;
+            BOOST_CHECK(t.commit());
+        }
+
+        // All three were registered on the entry for t1
+        BOOST_CHECK_EQUAL(snapshot_info.has_cleanup(700, &var1), 1);
+        BOOST_CHECK_EQUAL(snapshot_info.has_cleanup(700, &var2), 1);
+        BOOST_CHECK_EQUAL(snapshot_info.has_cleanup(700, &var3), 1);
+
+        BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 1);
+
+        delete t1.release();
+
+        {
+            Local_Transaction t;
+            BOOST_CHECK_EQUAL(var1.read(), 1);
+            BOOST_CHECK_EQUAL(var2.read(), 2);
+            BOOST_CHECK_EQUAL(var3.read(), 3);
+        }
+    }
+
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+}
+
+template<class Var>
+void commit_value(Var & var, int value)
+{
+    Local_Transaction t;
+    var.mutate() = value;
+    BOOST_CHECK(t.commit());
+}
+
+// Cleanups for the same object can be registered in any order, as they are
+// registered after the stripes are released.  Make a later commit's
+// cleanup land on an older entry than an earlier one's, so that the newer
+// of the two old versions is cleaned up first.
+template<class Var>
+void do_out_of_order_cleanup_test()
+{
+    current_epoch_ = 800;
+    earliest_epoch_ = 800;
+
+    {
+        Var var(0);
+
+        auto_ptr<Transaction> old(new Transaction(false /* use_critical */));
+        auto_ptr<Transaction> t1(new Transaction(false /* use_critical */));
+        auto_ptr<Transaction> r801, r802;
+
+        {
+            // Holds back the cleanup for the first commit
+            Cleanup_Buffer late;
+
+            current_trans = t1.get();
+            var.mutate() = 1;
+            BOOST_CHECK(t1->commit());
+            current_trans = 0;
+
+            r801.reset(new Transaction(false /* use_critical */));
+
+            // Registers its cleanup straight away on the entry for r801
+            boost::thread committer(boost::bind(&commit_value<Var>,
+                                                boost::ref(var), 2));
+            committer.join();
+
+            r802.reset(new Transaction(false /* use_critical */));
+
+            BOOST_CHECK_EQUAL(snapshot_info.has_cleanup(801, &var), 801);
+            BOOST_CHECK_EQUAL(snapshot_info.has_cleanup(802, &var), 0);
+        }
+
+        // The first commit's cleanup went on the newest entry
+        BOOST_CHECK_EQUAL(snapshot_info.has_cleanup(802, &var), 1);
+        BOOST_CHECK_EQUAL(var.history_size(), 2);
+
+        current_trans = old.get();
+        BOOST_CHECK_EQUAL(var.read(), 0);
+        current_trans = r801.get();
+        BOOST_CHECK_EQUAL(var.read(), 1);
+        current_trans = 0;
+
+        delete old.release();
+        delete t1.release();
+        BOOST_CHECK_EQUAL(var.history_size(), 2);
+
+        // Cleans up the version from 801, leaving the older one in place
+        delete r801.release();
+        BOOST_CHECK_EQUAL(var.history_size(), 1);
+
+        current_trans = r802.get();
+        BOOST_CHECK_EQUAL(var.read(), 2);
+        current_trans = 0;
+
+        delete r802.release();
+        BOOST_CHECK_EQUAL(var.history_size(), 0);
+
+        Local_Transaction t;
+        BOOST_CHECK_EQUAL(var.read(), 2);
+    }
+
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_out_of_order_cleanup_registration )
+{
+    cerr << endl << "================ out of order cleanups" << endl;
+
+    do_out_of_order_cleanup_test<Versioned<int> >();
+    do_out_of_order_cleanup_test<Versioned2<int> >();
+    do_out_of_order_cleanup_test<Versioned_Small<int> >();
+}
+
+// An object whose setup always fails, so that we can see what happens to
+// the objects on either side of it
+struct Failing_Setup : public Versioned2<int> {
+    virtual void * setup(Epoch old_epoch, Epoch new_epoch, void * new_value)
+    {
+        return 0;
+    }
+};
+
+BOOST_AUTO_TEST_CASE( test_failed_setup_frees_prepared_values )
+{
+    cerr << endl << "================ failed setup frees prepared" << endl;
+
+    constructed = destroyed = 0;
+
+    {
+        Versioned<Obj> before(0), after(0);
+        Failing_Setup failing;
+
+        {
+            Local_Transaction t;
+            before.mutate() = 1;   // prepared, set up then rolled back
+            failing.mutate() = 1;
+            after.mutate() = 1;    // prepared but never set up
+            BOOST_CHECK(!t.commit());
+        }
+
+        Local_Transaction t;
+        BOOST_CHECK_EQUAL(before.read(), 0);
+        BOOST_CHECK_EQUAL(after.read(), 0);
+        BOOST_CHECK_EQUAL(before.history_size(), 0);
+    }
+
+    BOOST_CHECK_EQUAL(constructed, destroyed);
+}
+
+// An object whose setup always throws
+struct Throwing_Setup : public Versioned2<int> {
+    virtual void * setup(Epoch old_epoch, Epoch new_epoch, void * new_value)
+    {
+        throw Exception("setup failed");
+    }
+};
+
+BOOST_AUTO_TEST_CASE( test_setup_throws_after_value_taken )
+{
+    cerr << endl << "================ setup throws after value taken" << endl;
+
+    Versioned2<string> str("hello");
+    Throwing_Setup throwing;
+
+    Local_Transaction t;
+    str.mutate() = "world";      // set up (taking the string), rolled back
+    throwing.mutate() = 1;
+    BOOST_CHECK_THROW(t.commit(), ML::Exception);
+
+    // The sandbox was discarded, rather than being left with the empty
+    // string that the setup left behind
+    BOOST_CHECK_EQUAL(str.read(), "hello");
+    BOOST_CHECK_EQUAL(str.history_size(), 0);
+
+    str.mutate() += "!";
+    BOOST_CHECK(t.commit());
+    BOOST_CHECK_EQUAL(str.read(), "hello!");
+}
+
+// An object whose setup runs out of memory
+struct Bad_Alloc_Setup : public Versioned2<int> {
+    virtual void * setup(Epoch old_epoch, Epoch new_epoch, void * new_value)
+    {
+        throw std::bad_alloc();
+    }
+};
+
+BOOST_AUTO_TEST_CASE( test_setup_exception_type )
+{
+    cerr << endl << "================ setup exception type" << endl;
+
+    // A group commit throws what the setup threw, just as a commit on its
+    // own does
+    for (unsigned group = 0;  group < 2;  ++group) {
+        set_group_commit(group);
+
+        {
+            Throwing_Setup throwing;
+            Local_Transaction t;
+            throwing.mutate() = 1;
+            try {
+                t.commit();
+                BOOST_ERROR("commit didn't throw");
+            } catch (const ML::Exception & exc) {
+                BOOST_CHECK_EQUAL(string(exc.what()), "setup failed");
+            }
+        }
+
+        {
+            Bad_Alloc_Setup bad_alloc;
+            Local_Transaction t;
+            bad_alloc.mutate() = 1;
+            BOOST_CHECK_THROW(t.commit(), std::bad_alloc);
+        }
+    }
+
+    set_group_commit(false);
+}
+
+BOOST_AUTO_TEST_CASE( test_versioned_small_overflow )
+{
+    cerr << endl << "================ versioned small overflow" << endl;
+
+    BOOST_STATIC_ASSERT((boost::is_same<Select_Versioned<int>::type,
+                                        Versioned_Small<int> >::value));
+    BOOST_STATIC_ASSERT((boost::is_same<Select_Versioned<Obj>::type,
+                                        Versioned2<Obj> >::value));
+
+    typedef Versioned_Small<int, 4> Var;
+    Var var(0);
+
+    {
+        // Each of these keeps a version alive, so that we need more than
+        // fit inline
+        vector<boost::shared_ptr<Local_Transaction> > old;
+
+        for (int i = 1;  i <= 6;  ++i) {
+            old.push_back(boost::shared_ptr<Local_Transaction>
+                          (new Local_Transaction()));
+
+            Local_Transaction t;
+            var.mutate() = i;
+            BOOST_CHECK(t.commit());
+
+            BOOST_CHECK_EQUAL(var.history_size(), i);
+            BOOST_CHECK_EQUAL(var.overflowed(), i >= 4);
+        }
+
+        // Every snapshot still sees its own version
+        for (int i = 0;  i < 6;  ++i) {
+            Transaction * t = old[i].get();
+            Transaction * saved = current_trans;
+            current_trans = t;
+            BOOST_CHECK_EQUAL(var.read(), i);
+            current_trans = saved;
+        }
+
+        // Finishing the newest snapshots cleans up versions one at a time,
+        // and they go back inline when there are few enough
+        while (old.size() > 2) {
+            old.pop_back();
+            BOOST_CHECK_EQUAL(var.history_size(), old.size());
+            BOOST_CHECK_EQUAL(var.overflowed(), old.size() >= 4);
+        }
+
+        old.clear();
+        BOOST_CHECK_EQUAL(var.history_size(), 0);
+    }
+
+    {
+        // A rollback leaves everything as it was
+        Failing_Setup failing;
+        Local_Transaction t;
+        var.mutate() = 100;   // set up, then rolled back
+        failing.mutate() = 1;
+        BOOST_CHECK(!t.commit());
+    }
+
+    Local_Transaction t;
+    BOOST_CHECK_EQUAL(var.read(), 6);
+    BOOST_CHECK_EQUAL(var.history_size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_parallel_cleanup )
+{
+    cerr << endl << "================ parallel cleanup" << endl;
+
+    snapshot_info.set_parallel_cleanup(3, 100);
+    BOOST_CHECK_EQUAL(snapshot_info.get_parallel_cleanup(), 3);
+
+    int nobjects = 1000;
+
+    {
+        vector<boost::shared_ptr<Versioned2<int> > > vars;
+        for (unsigned i = 0;  i < nobjects;  ++i)
+            vars.push_back(boost::shared_ptr<Versioned2<int> >
+                           (new Versioned2<int>(i)));
+
+        // Keeps the old versions alive until it goes
+        auto_ptr<Transaction> t1(new Transaction(false /* use_critical */));
+
+        {
+            Local_Transaction t;
+            for (unsigned i = 0;  i < nobjects;  ++i)
+                vars[i]->mutate() += nobjects;
+            BOOST_CHECK(t.commit());
+        }
+
+        for (unsigned i = 0;  i < nobjects;  ++i)
+            BOOST_CHECK_EQUAL(vars[i]->history_size(), 1);
+
+        // This cleans up all of them at once
+        delete t1.release();
+
+        for (unsigned i = 0;  i < nobjects;  ++i)
+            BOOST_CHECK_EQUAL(vars[i]->history_size(), 0);
+
+        {
+            Local_Transaction t;
+            for (unsigned i = 0;  i < nobjects;  ++i)
+                BOOST_CHECK_EQUAL(vars[i]->read(), i + nobjects);
+        }
+    }
+
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+
+    snapshot_info.set_parallel_cleanup(0);
+    BOOST_CHECK_EQUAL(snapshot_info.get_parallel_cleanup(), 0);
+}
+
+struct Reconfigure_Cleanup_Pool {
+    Reconfigure_Cleanup_Pool(volatile bool & finished)
+        : finished(finished)
+    {
+    }
+
+    volatile bool & finished;
+
+    void operator () () const
+    {
+        for (unsigned i = 0;  !finished;  ++i)
+            snapshot_info.set_parallel_cleanup(i % 2 ? 0 : 2, 100);
+    }
+};
+
+BOOST_AUTO_TEST_CASE( test_parallel_cleanup_reconfigured )
+{
+    cerr << endl << "================ parallel cleanup reconfigured" << endl;
+
+    // Stopping the pool whilst a cleanup is queueing its jobs mustn't leave
+    // it waiting forever for workers that have gone.  Two threads change
+    // the pool at once, which mustn't join the same workers twice.
+    int nobjects = 200;
+
+    vector<boost::shared_ptr<Versioned2<int> > > vars;
+    for (unsigned i = 0;  i < nobjects;  ++i)
+        vars.push_back(boost::shared_ptr<Versioned2<int> >
+                       (new Versioned2<int>(i)));
+
+    volatile bool finished = false;
+    boost::thread reconfigure((Reconfigure_Cleanup_Pool(finished)));
+    boost::thread reconfigure2((Reconfigure_Cleanup_Pool(finished)));
+
+    for (unsigned iter = 0;  iter < 200;  ++iter) {
+        auto_ptr<Transaction> t1(new Transaction(false /* use_critical */));
+
+        {
+            Local_Transaction t;
+            for (unsigned i = 0;  i < nobjects;  ++i)
+                vars[i]->mutate() += 1;
+            BOOST_REQUIRE(t.commit());
+        }
+
+        delete t1.release();
+    }
+
+    finished = true;
+    reconfigure.join();
+    reconfigure2.join();
+
+    snapshot_info.set_parallel_cleanup(0);
+    BOOST_CHECK_EQUAL(snapshot_info.get_parallel_cleanup(), 0);
+
+    Local_Transaction t;
+    for (unsigned i = 0;  i < nobjects;  ++i) {
+        BOOST_CHECK_EQUAL(vars[i]->read(), i + 200);
+        BOOST_CHECK_EQUAL(vars[i]->history_size(), 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_early_conflict_detection )
+{
+    cerr << endl << "================ early conflict detection" << endl;
+
+    Versioned2<int> var(0);
+
+    for (unsigned mode = DETECT_AT_COMMIT;  mode <= DETECT_EARLY_THROW;
+         ++mode) {
+        set_conflict_detection(Conflict_Detection(mode));
+
+        size_t early_before = get_num_early_conflicts();
+
+        Transaction t1(false /* use_critical */);
+        current_trans = &t1;
+
+        var.mutate() += 1;
+        BOOST_CHECK(!t1.doomed());
+
+        // Another transaction commits a new version behind our back
+        {
+            Local_Transaction t2;
+            var.mutate() += 10;
+            BOOST_CHECK(t2.commit());
+        }
+
+        BOOST_CHECK_EQUAL(current_trans, &t1);
+
+        if (mode == DETECT_AT_COMMIT) {
+            var.mutate() += 1;
+            BOOST_CHECK(!t1.doomed());
+        }
+        else if (mode == DETECT_EARLY) {
+            var.mutate() += 1;
+            BOOST_CHECK(t1.doomed());
+
+            // Only counted once
+            var.read();
+            BOOST_CHECK_EQUAL(get_num_early_conflicts(), early_before + 1);
+        }
+        else {
+            BOOST_CHECK_THROW(var.mutate() += 1, Transaction_Conflict);
+            BOOST_CHECK(t1.doomed());
+            BOOST_CHECK_EQUAL(get_num_early_conflicts(), early_before + 1);
+        }
+
+        // Either way, the commit fails and the retry works
+        BOOST_CHECK(!t1.commit());
+        BOOST_CHECK(!t1.doomed());
+        BOOST_CHECK_EQUAL(t1.num_local_values(), 0);
+
+        int before = var.read();
+        var.mutate() += 1;
+        BOOST_CHECK(!t1.doomed());
+        BOOST_CHECK(t1.commit());
+
+        current_trans = 0;
+
+        Local_Transaction t;
+        BOOST_CHECK_EQUAL(var.read(), before + 1);
+    }
+
+    {
+        // Restarting directly rather than through a failed commit also
+        // forgets the conflict
+        set_conflict_detection(DETECT_EARLY);
+
+        Transaction t1(false /* use_critical */);
+        current_trans = &t1;
+
+        var.read();
+
+        {
+            Local_Transaction t2;
+            var.mutate() += 10;
+            BOOST_CHECK(t2.commit());
+        }
+
+        var.mutate() += 1;
+        BOOST_CHECK(t1.doomed());
+
+        t1.clear();
+        t1.restart();
+        BOOST_CHECK(!t1.doomed());
+
+        int before = var.read();
+        var.mutate() += 1;
+        BOOST_CHECK(!t1.doomed());
+        BOOST_CHECK(t1.commit());
+
+        current_trans = 0;
+
+        Local_Transaction t;
+        BOOST_CHECK_EQUAL(var.read(), before + 1);
+    }
+
+    set_conflict_detection(DETECT_AT_COMMIT);
+}
+
+BOOST_AUTO_TEST_CASE( test_contention_barging )
+{
+    cerr << endl << "================ contention barging" << endl;
+
+    // Barges on the first failure, and doesn't wait
+    Karma_Contention_Manager manager(1 /* barge_after */, 0.0, 0.0);
+
+    Versioned2<int> var(0);
+
+    BOOST_CHECK(!Commit_Stripes::any_claimed());
+
+    Transaction high(false /* use_critical */);
+    high.contention_manager = &manager;
+    current_trans = &high;
+
+    var.mutate() += 1;
+
+    {
+        Local_Transaction t;
+        var.mutate() += 10;
+        BOOST_CHECK(t.commit());
+    }
+
+    // Our commit fails, which earns us karma; we claim the object
+    BOOST_CHECK(!high.commit());
+    BOOST_CHECK_EQUAL(high.karma, 2);
+    BOOST_CHECK(Commit_Stripes::any_claimed());
+
+    // Something with less karma that writes the object gives way to us,
+    // without even trying to commit
+    size_t barged_before = get_num_barged_commits();
+    {
+        Local_Transaction low;
+        low.contention_manager = &manager;
+        var.mutate() += 100;
+        BOOST_CHECK(!low.commit());
+        BOOST_CHECK_EQUAL(get_num_barged_commits(), barged_before + 1);
+    }
+
+    BOOST_CHECK_EQUAL(current_trans, &high);
+
+    // We get through, and our claim goes away
+    var.mutate() += 1;
+    BOOST_CHECK(high.commit());
+    BOOST_CHECK_EQUAL(high.karma, 0);
+    BOOST_CHECK(!Commit_Stripes::any_claimed());
+
+    current_trans = 0;
+
+    {
+        Local_Transaction low;
+        low.contention_manager = &manager;
+        var.mutate() += 100;
+        BOOST_CHECK(low.commit());
+    }
+
+    Local_Transaction t;
+    BOOST_CHECK_EQUAL(var.read(), 111);
+    BOOST_CHECK_EQUAL(get_num_barged_commits(), barged_before + 1);
+}
+
+BOOST_AUTO_TEST_CASE( test_versioned_counter )
+{
+    cerr << endl << "================ versioned counter" << endl;
+
+    Versioned_Counter<int> counter(5);
+
+    Transaction t1(false /* use_critical */);
+    current_trans = &t1;
+
+    counter.add(3);
+    BOOST_CHECK_EQUAL(counter.read(), 8);
+
+    // Another transaction adds to it behind our back
+    {
+        Local_Transaction t2;
+        counter.add(10);
+        counter.add(1);
+        BOOST_CHECK_EQUAL(counter.read(), 16);
+        BOOST_CHECK(t2.commit());
+    }
+
+    // Our snapshot doesn't see it, but we still commit
+    BOOST_CHECK_EQUAL(counter.read(), 8);
+    BOOST_CHECK(t1.commit());
+
+    current_trans = 0;
+
+    Local_Transaction t;
+    BOOST_CHECK_EQUAL(counter.read(), 19);
+}
+
+void counter_thread(Versioned_Counter<int> & counter, int iter,
+                    bool batched, boost::barrier & barrier,
+                    size_t & failures)
+{
+    barrier.wait();
+
+    for (unsigned i = 0;  i < iter;  ++i) {
+        if (batched) {
+            counter.add_batched(1);
+            continue;
+        }
+
+        Local_Transaction trans;
+        counter.add(1);
+        if (!trans.commit()) atomic_add(failures, 1);
+    }
+}
+
+void run_counter_threads(Versioned_Counter<int> & counter,
+                         int nthreads, int iter, bool batched,
+                         size_t & failures)
+{
+    boost::barrier barrier(nthreads);
+    boost::thread_group tg;
+    for (unsigned i = 0;  i < nthreads;  ++i)
+        tg.create_thread(boost::bind(&counter_thread, boost::ref(counter),
+                                     iter, batched, boost::ref(barrier),
+                                     boost::ref(failures)));
+    tg.join_all();
+}
+
+BOOST_AUTO_TEST_CASE( test_versioned_counter_multithreaded )
+{
+    int nthreads = 8, niter = 10000;
+
+    Versioned_Counter<int> counter;
+    size_t failures = 0;
+
+    // Nobody ever fails to commit
+    run_counter_threads(counter, nthreads, niter, false, failures);
+    BOOST_CHECK_EQUAL(failures, 0);
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(counter.read(), nthreads * niter);
+    }
+
+    // Batched: nothing happens until the batch is flushed
+    Epoch before = get_current_epoch();
+    run_counter_threads(counter, nthreads, niter, true, failures);
+    BOOST_CHECK_EQUAL(get_current_epoch(), before);
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(counter.read(), nthreads * niter);
+    }
+
+    BOOST_CHECK_EQUAL(flush_delta_batch(), 1);
+    BOOST_CHECK_EQUAL(flush_delta_batch(), 0);
+    BOOST_CHECK_EQUAL(get_current_epoch(), before + 1);
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(counter.read(), 2 * nthreads * niter);
+    }
+
+    // In the background
+    set_delta_batching(0.001);
+    BOOST_CHECK_EQUAL(get_delta_batching(), 0.001);
+    run_counter_threads(counter, nthreads, niter, true, failures);
+    set_delta_batching(0.0);
+
+    {
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(counter.read(), 3 * nthreads * niter);
+    }
+
+    // Deltas for a counter that goes away go with it
+    {
+        Versioned_Counter<int> counter2;
+        counter2.add_batched(1);
+    }
+    BOOST_CHECK_EQUAL(flush_delta_batch(), 0);
+}
+
+// Something in the batch that fails to flush the first few times
+struct Throwing_Delta : public Delta_Batched {
+    Throwing_Delta(int failures)
+        : failures(failures)
+    {
+    }
+
+    volatile int failures;
+
+    virtual void take_pending()
+    {
+        if (failures > 0) {
+            --failures;
+            throw Exception("take_pending failed");
+        }
+    }
+
+    virtual bool flushed()
+    {
+        return false;
+    }
+};
+
+BOOST_AUTO_TEST_CASE( test_delta_batch_flush_throws )
+{
+    cerr << endl << "================ delta batch flush throws" << endl;
+
+    Versioned_Counter<int> counter;
+
+    {
+        // Nothing is lost when a flush throws
+        Throwing_Delta throwing(1);
+        counter.add_batched(5);
+        queue_for_delta_batch(&throwing);
+
+        BOOST_CHECK_THROW(flush_delta_batch(), ML::Exception);
+        BOOST_CHECK_EQUAL(flush_delta_batch(), 2);
+        BOOST_CHECK_EQUAL(flush_delta_batch(), 0);
+
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(counter.read(), 5);
+    }
+
+    {
+        // The background thread carries on after a failed flush
+        Throwing_Delta throwing(3);
+        counter.add_batched(1);
+        queue_for_delta_batch(&throwing);
+
+        set_delta_batching(0.001);
+        while (throwing.failures > 0)
+            usleep(1000);
+        set_delta_batching(0.0);
+
+        BOOST_CHECK_EQUAL(flush_delta_batch(), 0);
+
+        Local_Transaction trans;
+        BOOST_CHECK_EQUAL(counter.read(), 6);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_read_only_transaction )
+{
+    cerr << endl << "================ read-only transaction" << endl;
+
+    Versioned2<int> var(1);
+    Versioned<int> var1(1);
+    Versioned_Counter<int> counter(1);
+
+    {
+        Read_Only_Transaction ro;
+        BOOST_CHECK_EQUAL(current_read_only, &ro);
+        BOOST_CHECK(current_trans == 0);
+
+        // Something commits after our snapshot
+        {
+            Local_Transaction trans;
+            var.mutate() = 2;
+            var1.mutate() = 2;
+            counter.add(1);
+            BOOST_CHECK_EQUAL(var.read(), 2);
+            BOOST_CHECK(trans.commit());
+        }
+
+        // We still see our snapshot
+        BOOST_CHECK_EQUAL(current_read_only, &ro);
+        BOOST_CHECK_EQUAL(var.read(), 1);
+        BOOST_CHECK_EQUAL(var1.read(), 1);
+        BOOST_CHECK_EQUAL(counter.read(), 1);
+
+        // We can't write
+        BOOST_CHECK_THROW(var.mutate(), ML::Exception);
+
+        // Nested read-only transactions see their own snapshots
+        {
+            Read_Only_Transaction ro2;
+            BOOST_CHECK_EQUAL(var.read(), 2);
+            BOOST_CHECK_EQUAL(counter.read(), 2);
+        }
+
+        BOOST_CHECK_EQUAL(var.read(), 1);
+    }
+
+    BOOST_CHECK(current_read_only == 0);
+    BOOST_CHECK_THROW(var.read(), ML::Exception);
+
+    // Inside a read-write transaction, we see its changes
+    {
+        Local_Transaction trans;
+        var.mutate() = 3;
+        {
+            Read_Only_Transaction ro;
+            BOOST_CHECK_EQUAL(var.read(), 3);
+        }
+    }
+
+    BOOST_CHECK_EQUAL(snapshot_info.entry_count(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_mvcc_stats )
+{
+    cerr << endl << "================ mvcc stats" << endl;
+
+    reset_mvcc_stats();
+
+    Versioned2<int> var(0);
+
+    {
+        // Keeps the old versions alive
+        Local_Transaction old;
+
+        for (unsigned i = 0;  i < 3;  ++i) {
+            Local_Transaction t;
+            var.mutate() += 1;
+            BOOST_CHECK(t.commit());
+        }
+
+        {
+            Local_Transaction t1;
+            var.mutate() += 1;
+
+            {
+                Local_Transaction t2;
+                var.mutate() += 1;
+                BOOST_CHECK(t2.commit());
+            }
+
+            // Conflicts with t2, then succeeds on the retry
+            BOOST_CHECK(!t1.commit());
+            var.mutate() += 1;
+            BOOST_CHECK(t1.commit());
+        }
+
+        MVCC_Stats stats = get_mvcc_stats(true /* by_type */);
+        stats.dump(cerr);
+
+        BOOST_CHECK_EQUAL(stats.commits.commits, 5);
+        BOOST_CHECK_EQUAL(stats.commits.aborts[ABORT_CHECK], 1);
+        BOOST_CHECK_EQUAL(stats.commits.total_aborts(), 1);
+        BOOST_CHECK_EQUAL(stats.commits.commits_retried, 1);
+        BOOST_CHECK_EQUAL(stats.commits.retries, 1);
+        BOOST_CHECK_EQUAL(stats.commits.phases[PHASE_TOTAL].count, 6);
+        BOOST_CHECK_EQUAL(stats.commits.phases[PHASE_CHECK].count, 6);
+        BOOST_CHECK_EQUAL(stats.commits.phases[PHASE_SETUP].count, 5);
+        BOOST_CHECK_GE(stats.commits.phases[PHASE_TOTAL].percentile(0.99),
+                       stats.commits.phases[PHASE_TOTAL].percentile(0.5));
+
+        BOOST_CHECK_EQUAL(stats.live_snapshots, 1);
+        BOOST_CHECK_EQUAL(stats.oldest_snapshot_epoch, old.epoch());
+        BOOST_CHECK_EQUAL(stats.current_epoch, old.epoch() + 5);
+
+        // Only the version that old can see is kept; the ones in between
+        // were cleaned up as soon as they were replaced
+        BOOST_CHECK_EQUAL(stats.versions_retained, 1);
+        BOOST_CHECK_EQUAL(stats.versions_retained_by_type.size(), 1);
+        BOOST_CHECK_EQUAL(stats.versions_retained_by_type.begin()->second, 1);
+    }
+
+    MVCC_Stats stats = get_mvcc_stats();
+    BOOST_CHECK_EQUAL(stats.live_snapshots, 0);
+    BOOST_CHECK_EQUAL(stats.versions_retained, 0);
+
+    reset_mvcc_stats();
+    BOOST_CHECK_EQUAL(get_mvcc_stats().commits.commits, 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_latency_histogram )
+{
+    typedef Latency_Histogram H;
+
+    // The buckets cover everything, with no gaps, and are narrow enough
+    // (the small ones are exact; the last one takes everything too big)
+    BOOST_CHECK_EQUAL(H::bucket_min(0), 0);
+    for (unsigned i = 1;  i < H::NUM_BUCKETS;  ++i) {
+        BOOST_CHECK_EQUAL(H::bucket_min(i), H::bucket_max(i - 1) + 1);
+        uint64_t width = H::bucket_max(i) - H::bucket_min(i) + 1;
+        if (i < H::SUB_BUCKETS) BOOST_CHECK_EQUAL(width, 1);
+        else if (i < H::NUM_BUCKETS - 1)
+            BOOST_CHECK_LE(width * H::SUB_BUCKETS, H::bucket_min(i));
+    }
+
+    // Each value goes in the bucket that covers it
+    uint64_t values[] = { 0, 1, 7, 8, 9, 15, 16, 17, 100, 1000, 123456,
+                          999999999 };
+    for (unsigned i = 0;  i < sizeof(values) / sizeof(values[0]);  ++i) {
+        H h;
+        h.record(values[i]);
+        unsigned bucket = 0;
+        while (!h.buckets[bucket]) ++bucket;
+        BOOST_CHECK_LE(H::bucket_min(bucket), values[i]);
+        BOOST_CHECK_GE(H::bucket_max(bucket), values[i]);
+    }
+
+    // Percentiles are within 1/8 of the real value
+    H h;
+    for (uint64_t ns = 1000;  ns <= 100000;  ns += 1000)
+        h.record(ns);
+    BOOST_CHECK_GE(h.percentile(0.5), 50000);
+    BOOST_CHECK_LE(h.percentile(0.5), 50000 + 50000 / H::SUB_BUCKETS);
+    BOOST_CHECK_GE(h.percentile(0.99), 99000);
+    BOOST_CHECK_LE(h.percentile(0.99), 99000 + 99000 / H::SUB_BUCKETS);
+    BOOST_CHECK_EQUAL(h.percentile(1.0), 100000);
+}
+
+// A big value that counts how many times it's copied
+struct Copy_Counted {
+    Copy_Counted(int val = 0)
+        : data(1000, val)
+    {
+    }
+
+    Copy_Counted(const Copy_Counted & other)
+        : data(other.data)
+    {
+        ++copies;
+    }
+
+    vector<int> data;
+
+    static int copies;
+};
+
+int Copy_Counted::copies = 0;
+
+void swap(Copy_Counted & c1, Copy_Counted & c2)
+{
+    c1.data.swap(c2.data);
+}
+
+std::ostream & operator << (std::ostream & stream, const Copy_Counted & c)
+{
+    return stream << "Copy_Counted(" << c.data.size() << ")";
+}
+
+namespace JMVCC {
+
+template<>
+struct Swap_Into_Place<Copy_Counted> {
+    enum { value = true };
+};
+
+} // namespace JMVCC
+
+BOOST_AUTO_TEST_CASE( test_versioned2_commit_steals_value )
+{
+    cerr << endl << "================ versioned2 commit steals value" << endl;
+
+    Versioned2<Copy_Counted> var;
+
+    {
+        // Each of these keeps a version alive, so that nothing is cleaned
+        // up (which copies the table) while we're counting
+        vector<boost::shared_ptr<Local_Transaction> > old;
+
+        for (int i = 1;  i <= 3;  ++i) {
+            old.push_back(boost::shared_ptr<Local_Transaction>
+                          (new Local_Transaction()));
+
+            Copy_Counted::copies = 0;
+
+            Local_Transaction t;
+
+            // One copy from the current version into the sandbox...
+            var.mutate().data[0] = i;
+            BOOST_CHECK_EQUAL(Copy_Counted::copies, 1);
+
+            // ... and none of it to commit.  The first commit copies the
+            // inline version into the new table.
+            BOOST_CHECK(t.commit());
+            BOOST_CHECK_EQUAL(Copy_Counted::copies, (i == 1 ? 2 : 1));
+        }
+
+        BOOST_CHECK_EQUAL(var.history_size(), 3);
+        BOOST_CHECK_EQUAL(var.read().data[0], 2);
+
+        // Newest first, as each one restores the transaction before it
+        while (!old.empty()) old.pop_back();
+    }
+
+    Local_Transaction t;
+    BOOST_CHECK_EQUAL(var.read().data[0], 3);
+    BOOST_CHECK_EQUAL(var.read().data.size(), 1000);
+}
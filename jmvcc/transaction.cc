@@ -6,6 +6,13 @@
 */
 
 #include "transaction.h"
+#include "stats.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/cmp_xchg.h"
+#include "jml/compiler/compiler.h"
+#include <limits>
+#include <ace/Synch.h>
+#include <boost/exception_ptr.hpp>
 
 
 using namespace std;
@@ -16,8 +23,38 @@ namespace JMVCC {
 /// Current transaction for this thread
 __thread Transaction * current_trans = 0;
 
-/// For the moment, only one commit can happen at a time
-ACE_Mutex commit_lock;
+/// Current read-only transaction for this thread
+__thread const Snapshot * current_read_only = 0;
+
+/// Lock that orders commits
+Adaptive_Lock commit_lock;
+
+/// Highest epoch that has been handed out to a commit.  Only incremented
+/// with commit_lock held; may be decremented without it by
+/// abandon_commit_epoch().
+Epoch last_allocated_epoch = 0;
+
+/// Number of commits that have been allocated an epoch but not finished
+volatile int commits_in_progress = 0;
+
+/// Where commits wait for the epochs before theirs to be published, and
+/// compress_epochs() waits for the commits in progress to finish
+Wait_Queue commit_waiters;
+
+struct Epoch_Published {
+    Epoch_Published(Epoch epoch)
+        : epoch(epoch)
+    {
+    }
+
+    Epoch epoch;
+
+    bool operator () () const { return get_current_epoch() >= epoch; }
+};
+
+struct No_Commits_In_Progress {
+    bool operator () () const { return commits_in_progress == 0; }
+};
 
 
 void no_transaction_exception(const Versioned_Object * obj)
@@ -25,18 +62,489 @@ void no_transaction_exception(const Versioned_Object * obj)
     throw Exception("not in a transaction");
 }
 
+Epoch allocate_commit_epoch()
+{
+    ACE_Guard<Adaptive_Lock> guard(commit_lock);
+
+    // With nothing in progress, we start again from the current epoch.  This
+    // picks up any change made to the epoch from outside of a commit (for
+    // example by compress_epochs()).
+    if (commits_in_progress == 0)
+        last_allocated_epoch = get_current_epoch();
+
+    // Running out is only a possibility with 32 bit epochs; see
+    // jmvcc_defs.h
+    if (JML_UNLIKELY(last_allocated_epoch
+                     == std::numeric_limits<Epoch>::max()))
+        throw Exception("no more epochs; compress_epochs() needs to be run");
+
+    atomic_add(commits_in_progress, 1);
+
+    for (;;) {
+        Epoch old_epoch = last_allocated_epoch;
+        if (cmp_xchg(last_allocated_epoch, old_epoch, old_epoch + 1))
+            return old_epoch + 1;
+    }
+}
+
+void publish_commit_epoch(Epoch epoch)
+{
+    // Wait for the commits before ours to be published.  They already have
+    // all of their objects locked, so they won't be waiting on us.
+    commit_waiters.wait(Epoch_Published(epoch - 1));
+
+    if (get_current_epoch() != epoch - 1)
+        throw Exception("commit epochs published out of order");
+
+    // Make sure that everything that was set up is visible before anything
+    // can see the new epoch
+    memory_barrier();
+
+    set_current_epoch(epoch);
+
+    // Let the commits after ours go.  This makes sure these writes are seen
+    // before we clean up.
+    commit_waiters.notify();
+}
+
+void abandon_commit_epoch(Epoch epoch)
+{
+    // If nobody has been given an epoch after us, we can give it back
+    Epoch old_epoch = epoch;
+    if (cmp_xchg(last_allocated_epoch, old_epoch, epoch - 1))
+        return;
+
+    // Otherwise, there is a commit waiting for our epoch to be published
+    publish_commit_epoch(epoch);
+}
+
+void finish_commit()
+{
+    atomic_add(commits_in_progress, -1);
+    commit_waiters.notify();
+}
+
+void wait_for_commits_in_progress()
+{
+    commit_waiters.wait(No_Commits_In_Progress());
+
+    memory_barrier();
+}
+
+
+/*****************************************************************************/
+/* GROUP COMMIT                                                              */
+/*****************************************************************************/
+
+/* When lots of small transactions are ready to commit at the same time, each
+   one pays a fixed cost: taking commit_lock, allocating and publishing its
+   own epoch (which means waiting for all of those before it to publish
+   theirs) and so on.
+
+   In group commit mode, a transaction that is ready to commit first checks
+   and prepares itself (with no lock held, so that doomed transactions don't
+   hold up the group and the leader has less to do) and then joins a
+   queue.  If there is no leader, it becomes the
+   leader: it takes everything in the queue and commits it in rounds.  Each
+   round is made up of sandboxes whose commit stripes don't intersect; they
+   are set up and published together under a single epoch, which is safe as
+   their write sets are disjoint.  Those that fail their setup are rolled
+   back before the epoch is published.  A sandbox that conflicts with one
+   already in the round waits for the next round.
+
+   When the leader is done, it wakes up the followers, which find their
+   result waiting for them and finish off their own commit (freeing their
+   local values, new critical section, etc) in their own thread.  If more
+   transactions arrived in the meantime, one of them becomes the next
+   leader.
+
+   Note that the leader switches current_trans to each member while it is
+   setting it up or committing it, as some objects (eg TypedPVO) modify their
+   parent within the transaction being committed.
+*/
+
+bool group_commit = false;
+
+void set_group_commit(bool enabled)
+{
+    group_commit = enabled;
+}
+
+bool get_group_commit()
+{
+    return group_commit;
+}
+
+
+/*****************************************************************************/
+/* EARLY CONFLICT DETECTION                                                  */
+/*****************************************************************************/
+
+Conflict_Detection conflict_detection_ = DETECT_AT_COMMIT;
+
+size_t num_early_conflicts = 0;
+
+void set_conflict_detection(Conflict_Detection mode)
+{
+    conflict_detection_ = mode;
+}
+
+Conflict_Detection get_conflict_detection()
+{
+    return conflict_detection_;
+}
+
+size_t get_num_early_conflicts()
+{
+    return num_early_conflicts;
+}
+
+Transaction_Conflict::
+Transaction_Conflict(const Versioned_Object * object)
+    : Exception("transaction conflicts on object %p", object),
+      object(object)
+{
+}
+
+struct Group_Commit_Request {
+    Group_Commit_Request(Transaction * trans)
+        : trans(trans), result(0), done(false)
+    {
+    }
+
+    Transaction * trans;
+    Sandbox::Commit_State state;
+    Epoch result;
+    boost::exception_ptr error;  ///< Set if the commit threw an exception
+    bool done;            ///< Set once the leader has finished with us
+};
+
+typedef vector<Group_Commit_Request *> Group_Commit_Requests;
+
+ACE_Thread_Mutex group_commit_lock;
+ACE_Condition_Thread_Mutex group_commit_done(group_commit_lock);
+Group_Commit_Requests group_commit_queue;
+bool group_commit_leader = false;
+
+/** Capture the exception being handled, so that it can be rethrown in the
+    thread whose commit it belongs to as it would have been outside of a
+    group.  boost::current_exception() only keeps the type of the standard
+    exceptions, so ours are copied explicitly.  Only call from a catch
+    block. */
+boost::exception_ptr capture_commit_exception()
+{
+    try {
+        throw;
+    } catch (const Transaction_Conflict & exc) {
+        return boost::copy_exception(exc);
+    } catch (const ML::Exception & exc) {
+        return boost::copy_exception(exc);
+    } catch (...) {
+        return boost::current_exception();
+    }
+}
+
+/* Anything that goes wrong in a round is recorded in the requests that it
+   affects, and the leader carries on; if it let an exception escape then
+   the followers would never find out what happened to them.  Each follower
+   rethrows its own exception. */
+
+void run_group_commit(Group_Commit_Requests pending)
+{
+    Transaction * old_trans = current_trans;
+
+    while (!pending.empty()) {
+        Group_Commit_Requests round, deferred;
+        Commit_Stripes stripes;
+
+        for (unsigned i = 0;  i < pending.size();  ++i) {
+            Commit_Stripes member_stripes;
+            pending[i]->trans->commit_stripes(member_stripes);
+
+            if (stripes.intersects(member_stripes))
+                deferred.push_back(pending[i]);
+            else {
+                stripes.add(member_stripes);
+                round.push_back(pending[i]);
+            }
+        }
+
+        pending.swap(deferred);
+
+        Epoch new_epoch = 0;
+        try {
+            stripes.acquire();
+            try {
+                new_epoch = allocate_commit_epoch();
+            } catch (...) {
+                stripes.release();
+                throw;
+            }
+        } catch (...) {
+            // Nothing was set up, so all we need to do is to free what was
+            // prepared
+            boost::exception_ptr error = capture_commit_exception();
+            for (unsigned i = 0;  i < round.size();  ++i) {
+                round[i]->error = error;
+                current_trans = round[i]->trans;
+                round[i]->trans->unprepare_commit(round[i]->state);
+            }
+            continue;
+        }
+
+        // Registered once the stripes are released, as in Sandbox::commit()
+        Cleanup_Buffer cleanups;
+
+        // Set everything up.  Anything that fails is rolled back before the
+        // new epoch is published, so that nothing can ever see it.
+        bool any_succeeded = false;
+
+        for (unsigned i = 0;  i < round.size();  ++i) {
+            Group_Commit_Request & request = *round[i];
+            current_trans = request.trans;
+
+            bool succeeded = false;
+            try {
+                succeeded = request.trans->setup_commit(request.trans->epoch(),
+                                                        new_epoch,
+                                                        request.state);
+            } catch (...) {
+                request.error = capture_commit_exception();
+            }
+
+            if (succeeded) {
+                request.result = new_epoch;
+                any_succeeded = true;
+            }
+            else if (request.state.failed_object)
+                request.trans->rollback_commit(new_epoch, request.state);
+            else request.trans->unprepare_commit(request.state);
+        }
+
+        try {
+            if (any_succeeded)
+                publish_commit_epoch(new_epoch);
+            else abandon_commit_epoch(new_epoch);
+        } catch (...) {
+            // The epoch wasn't published, so nothing can have seen what was
+            // set up under it
+            boost::exception_ptr error = capture_commit_exception();
+            for (unsigned i = 0;  i < round.size();  ++i) {
+                Group_Commit_Request & request = *round[i];
+                if (!request.result) continue;
+                current_trans = request.trans;
+                request.trans->rollback_commit(new_epoch, request.state);
+                request.result = 0;
+                request.error = error;
+            }
+        }
+
+        for (unsigned i = 0;  i < round.size();  ++i) {
+            Group_Commit_Request & request = *round[i];
+            if (!request.result) continue;
+            current_trans = request.trans;
+            try {
+                request.trans->confirm_commit(new_epoch, request.state);
+            } catch (...) {
+                // It was committed, but the caller needs to hear about it
+                request.error = capture_commit_exception();
+            }
+        }
+
+        stripes.release();
+
+        try {
+            cleanups.flush();
+        } catch (...) {
+            boost::exception_ptr error = capture_commit_exception();
+            for (unsigned i = 0;  i < round.size();  ++i)
+                if (!round[i]->error)
+                    round[i]->error = error;
+        }
+
+        finish_commit();
+    }
+
+    current_trans = old_trans;
+}
+
 
 /*****************************************************************************/
 /* TRANSACTION                                                               */
 /*****************************************************************************/
 
+Epoch
+Transaction::
+commit_in_group()
+{
+    // Only the phases done in our own thread are timed; the rest goes down
+    // as the total
+    Commit_Timer timer;
+
+    bool ok = check_commit(epoch());
+    timer.phase(PHASE_CHECK);
+    if (!ok) {
+        timer.aborted(ABORT_CHECK);
+        clear();
+        return 0;
+    }
+
+    // The expensive part of the setup is done here in our own thread, so
+    // that the leader doesn't have to do it with the stripes held
+    Group_Commit_Request request(this);
+    prepare_commit(epoch(), request.state);
+    timer.phase(PHASE_PREPARE);
+
+    {
+        ACE_Guard<ACE_Thread_Mutex> guard(group_commit_lock);
+
+        group_commit_queue.push_back(&request);
+
+        while (!request.done) {
+            if (group_commit_leader) {
+                group_commit_done.wait();
+                continue;
+            }
+
+            // Nobody is leading; we take everything that's waiting
+            group_commit_leader = true;
+            Group_Commit_Requests batch;
+            batch.swap(group_commit_queue);
+
+            guard.release();
+            try {
+                run_group_commit(batch);
+            } catch (...) {
+                // Shouldn't happen, but if it does then the followers still
+                // need to be woken up
+                boost::exception_ptr error = capture_commit_exception();
+                for (unsigned i = 0;  i < batch.size();  ++i)
+                    if (!batch[i]->result && !batch[i]->error)
+                        batch[i]->error = error;
+            }
+            guard.acquire();
+
+            // NOTE: the requests belong to the followers, and may disappear
+            // as soon as they are marked as done
+            for (unsigned i = 0;  i < batch.size();  ++i)
+                batch[i]->done = true;
+
+            group_commit_leader = false;
+            group_commit_done.broadcast();
+        }
+    }
+
+    clear();
+
+    if (request.result) timer.committed();
+    else if (!request.error) timer.aborted(ABORT_SETUP);
+
+    if (request.error)
+        boost::rethrow_exception(request.error);
+
+    return request.result;
+}
+
+
+/*****************************************************************************/
+/* CONTENTION MANAGEMENT                                                     */
+/*****************************************************************************/
+
+size_t num_barged_commits = 0;
+
+size_t get_num_barged_commits()
+{
+    return num_barged_commits;
+}
+
+void
+Transaction::
+contention_commit_finished(bool committed, size_t work,
+                           const Commit_Stripes & stripes)
+{
+    if (committed) {
+        if (claimed_priority_) release_claims();
+        contention_manager->committed(*this);
+        return;
+    }
+
+    contention_manager->aborted(*this, work);
+
+    // Claim our write set if it's time to barge.  We keep our first claim
+    // until we commit, even if we write something else next time.
+    if (!claimed_priority_ && !stripes.empty()
+        && contention_manager->uses_barging()
+        && contention_manager->should_barge(*this)) {
+        claimed_priority_ = contention_manager->priority(*this);
+        if (claimed_priority_) {
+            claimed_stripes_.add(stripes);
+            claimed_stripes_.claim(claimed_priority_);
+        }
+    }
+
+    contention_manager->wait(*this);
+}
+
+void
+Transaction::
+release_claims()
+{
+    claimed_stripes_.unclaim(claimed_priority_);
+    claimed_priority_ = 0;
+    claimed_stripes_.clear();
+}
+
 bool
 Transaction::
 commit()
 {
     status = COMMITTING;
-    Epoch result = Sandbox::commit(epoch());
+
+    // What the contention manager needs to know, taken before the commit
+    // clears out the sandbox
+    size_t work = num_local_values();
+    Commit_Stripes stripes;
+    bool barging = contention_manager && contention_manager->uses_barging();
+
+    // Working out the stripes means sorting the write set, so we only do it
+    // if something has claimed stripes that could be ours, or if we would
+    // claim our own were this commit to fail
+    if (barging
+        && (Commit_Stripes::any_claimed()
+            || (!claimed_priority_
+                && contention_manager->should_barge(*this))))
+        commit_stripes(stripes);
+
+    Epoch result = 0;
+    if (doomed_) {
+        // We already know that it can't succeed
+        Commit_Timer timer;
+        timer.aborted(ABORT_DOOMED);
+        clear();
+    }
+    else if (barging
+             && stripes.max_claim() > contention_manager->priority(*this)) {
+        // A more important transaction wants these objects; let it go
+        // first
+        Commit_Timer timer;
+        timer.aborted(ABORT_BARGED);
+        clear();
+        atomic_add(num_barged_commits, 1);
+    }
+    else result = (group_commit
+                   ? commit_in_group() : Sandbox::commit(epoch()));
+
     status = result ? COMMITTED : FAILED;
+
+    if (result) {
+        record_commit_retries(failed_commits_);
+        failed_commits_ = 0;
+    }
+    else ++failed_commits_;
+
+    if (contention_manager)
+        contention_commit_finished(result, work, stripes);
+
     if (!result) restart();
     
     if (use_critical)
@@ -47,6 +555,19 @@ commit()
     return result;
 }
 
+void
+Transaction::
+found_conflict(const Versioned_Object * obj)
+{
+    if (!doomed_) {
+        doomed_ = true;
+        atomic_add(num_early_conflicts, 1);
+    }
+
+    if (conflict_detection_ == DETECT_EARLY_THROW)
+        throw Transaction_Conflict(obj);
+}
+
 void
 Transaction::
 dump(std::ostream & stream, int indent)
@@ -11,6 +11,7 @@
 #include "snapshot.h"
 #include "sandbox.h"
 #include "garbage.h"
+#include "contention.h"
 
 
 namespace JMVCC {
@@ -20,13 +21,97 @@ class Transaction;
 /// Current transaction for this thread
 extern __thread Transaction * current_trans;
 
+/// Current read-only transaction for this thread.  Only used when there is
+/// no current_trans.
+extern __thread const Snapshot * current_read_only;
+
 size_t current_trans_epoch();
 
-/// For the moment, only one commit can happen at a time
-extern ACE_Mutex commit_lock;
+/// Lock that orders commits.  It is only held long enough to hand out a
+/// new epoch; holding it blocks any new commit from starting (but not
+/// those already in progress; see wait_for_commits_in_progress()).
+extern Adaptive_Lock commit_lock;
+
+/** Allocate the epoch for a commit that is about to be set up.  The commit
+    must have exclusive access to all objects in its write set (see
+    Sandbox::commit()) before calling this, which guarantees that the
+    epochs for any given object are handed out in increasing order.
+
+    Every allocated epoch must later be passed to either
+    publish_commit_epoch() or abandon_commit_epoch().
+*/
+Epoch allocate_commit_epoch();
+
+/** Make the given commit epoch the current epoch.  Blocks until all of the
+    commits with earlier epochs have been published, so that the current
+    epoch always increases one at a time and a snapshot never sees a
+    partial commit.
+*/
+void publish_commit_epoch(Epoch epoch);
+
+/** Give up on an allocated epoch, because the commit failed.  If no later
+    epoch has been handed out, the epoch is simply returned; otherwise it
+    is published as an empty epoch so as not to hold up those that follow.
+*/
+void abandon_commit_epoch(Epoch epoch);
+
+/** Record that a commit that allocated an epoch has finished all of its
+    work (including committing or rolling back its objects).
+*/
+void finish_commit();
+
+/** Wait until all commits that have allocated an epoch have finished.
+    Must be called with commit_lock held, which stops any new commit from
+    starting.  Used to quiesce the system for compress_epochs().
+*/
+void wait_for_commits_in_progress();
 
 void no_transaction_exception(const Versioned_Object * obj) __attribute__((__noreturn__));
 
+/** Turn group commit on or off.  In group commit mode, transactions that
+    are ready to commit at the same time are collected by a leader thread
+    and committed together, with those that don't conflict sharing a
+    single epoch.  Off by default.
+*/
+void set_group_commit(bool enabled);
+
+bool get_group_commit();
+
+
+/** How a conflict (a newer version of an object that a transaction has
+    modified being committed after the transaction's snapshot) is found.
+    Early detection notices the conflict when the object is accessed, so
+    that the transaction doesn't do the rest of its work only to fail when
+    it tries to commit.  Only committed versions count, so a transaction is
+    never doomed by a commit that is still in progress.
+*/
+enum Conflict_Detection {
+    DETECT_AT_COMMIT,    ///< Only when committing (the default)
+    DETECT_EARLY,        ///< Mark the transaction doomed; commit() fails
+    DETECT_EARLY_THROW   ///< As DETECT_EARLY, and throw Transaction_Conflict
+};
+
+void set_conflict_detection(Conflict_Detection mode);
+
+Conflict_Detection get_conflict_detection();
+
+/// Current mode; read inline by the versioned objects
+extern Conflict_Detection conflict_detection_;
+
+/// Number of transactions that found a conflict early, and so didn't run
+/// to the end before failing
+size_t get_num_early_conflicts();
+
+/** Thrown from the accessors of a versioned object in DETECT_EARLY_THROW
+    mode when the transaction is found to conflict.  The transaction should
+    stop what it's doing and call commit(), which will fail and restart it.
+*/
+struct Transaction_Conflict : public ML::Exception {
+    Transaction_Conflict(const Versioned_Object * object);
+
+    const Versioned_Object * object;
+};
+
 
 
 /*****************************************************************************/
@@ -37,20 +122,77 @@ void no_transaction_exception(const Versioned_Object * obj) __attribute__((__nor
 struct Transaction : public Snapshot, public Sandbox {
 
     Transaction(bool use_critical = true)
-        : use_critical(use_critical)
+        : use_critical(use_critical),
+          contention_manager(get_default_contention_manager()),
+          contention_ticket(0), karma(0),
+          doomed_(false), failed_commits_(0), claimed_priority_(0)
     {
     }
 
     ~Transaction()
     {
+        if (claimed_priority_) release_claims();
     }
 
     bool commit();
 
+    /** Move the snapshot up to the current epoch, as Snapshot::restart()
+        does.  Conflicts found against the old snapshot no longer apply, so
+        the transaction is no longer doomed. */
+    void restart()
+    {
+        doomed_ = false;
+        Snapshot::restart();
+    }
+
+    /** Has the transaction already been found to conflict?  If so, commit()
+        will fail without trying. */
+    bool doomed() const { return doomed_; }
+
+    /** Called by an object that this transaction has modified, with the
+        epoch that its newest version is valid from.  If that version was
+        committed after our snapshot, we can't commit. */
+    void check_conflict(const Versioned_Object * obj, Epoch valid_from)
+    {
+        if (valid_from > epoch() && valid_from <= get_current_epoch())
+            found_conflict(obj);
+    }
+
     void dump(std::ostream & stream = std::cerr, int indent = 0);
 
     // Do we use critical sections?
     bool use_critical;
+
+    /** Decides what happens when commit() fails; see contention.h.  Null
+        means that nothing happens. */
+    Contention_Manager * contention_manager;
+
+    /* State for the contention manager, kept over retries */
+    uint64_t contention_ticket;   ///< Order in which we started; 0 if unknown
+    uint64_t karma;               ///< Work lost in failed commits
+
+private:
+    /// Commit as part of a group; see set_group_commit()
+    Epoch commit_in_group();
+
+    /// Mark as doomed, and throw if we're in DETECT_EARLY_THROW mode
+    void found_conflict(const Versioned_Object * obj);
+
+    /// Let the contention manager know how the commit went
+    void contention_commit_finished(bool committed, size_t work,
+                                    const Commit_Stripes & stripes);
+
+    /// Remove the claims that we made when barging
+    void release_claims();
+
+    bool doomed_;
+
+    /// Number of times commit() has failed since it last succeeded
+    int failed_commits_;
+
+    /// Stripes that we claimed when barging, with the priority we used
+    Commit_Stripes claimed_stripes_;
+    uint64_t claimed_priority_;
 };
 
 struct In_Out_Critical {
@@ -78,6 +220,28 @@ struct Local_Transaction : public In_Out_Critical, public Transaction {
 };
 
 
+/*****************************************************************************/
+/* READ_ONLY_TRANSACTION                                                     */
+/*****************************************************************************/
+
+/** A transaction that can only read.  It is just a snapshot in a critical
+    section, with no sandbox, so it's cheap to set up and reads go straight
+    to the versions without looking for a local value.  Trying to modify an
+    object inside one fails as if there were no transaction.
+
+    Inside a read-write transaction it has no effect: reads (and writes)
+    still go through that transaction, so that they see its changes.  A
+    read-write transaction inside one works as usual.
+*/
+struct Read_Only_Transaction : public In_Out_Critical, public Snapshot {
+    Read_Only_Transaction();
+
+    ~Read_Only_Transaction();
+
+    const Snapshot * old_read_only;
+};
+
+
 } // namespace JMVCC
 
 #include "transaction_impl.h"
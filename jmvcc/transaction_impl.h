@@ -34,6 +34,26 @@ Local_Transaction::
     current_trans = old_trans;
 }
 
+
+/*****************************************************************************/
+/* READ_ONLY_TRANSACTION                                                     */
+/*****************************************************************************/
+
+inline
+Read_Only_Transaction::
+Read_Only_Transaction()
+{
+    old_read_only = current_read_only;
+    current_read_only = this;
+}
+
+inline
+Read_Only_Transaction::
+~Read_Only_Transaction()
+{
+    current_read_only = old_read_only;
+}
+
 } // namespace JMVCC
 
 #endif /*  __jmvcc__transaction_impl_h__ */
@@ -10,7 +10,17 @@
 
 #include "garbage.h"
 #include "transaction.h"
+#include "slab_allocator.h"
 #include "jml/arch/exception.h"
+#include "jml/arch/cmp_xchg.h"
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <sched.h>
 
 namespace JMVCC {
 
@@ -49,6 +59,113 @@ struct DeleteCleanup {
 };
 
 
+/*****************************************************************************/
+/* SWAP_INTO_PLACE                                                           */
+/*****************************************************************************/
+
+/** Whether a value of type T that is about to be thrown away (such as a
+    sandbox's value when it is committed) should be swapped into its new
+    home rather than copied.  This is worth it for types that own a lot of
+    memory but can be swapped in a few instructions, such as the standard
+    containers and strings.  It can be specialized for other types with a
+    cheap swap(), which is found by argument dependent lookup.
+
+    It is false by default, as std::swap() on any other type is three
+    copies.
+*/
+template<typename T>
+struct Swap_Into_Place {
+    enum { value = false };
+};
+
+template<typename C, typename Tr, typename A>
+struct Swap_Into_Place<std::basic_string<C, Tr, A> > {
+    enum { value = true };
+};
+
+template<typename T, typename A>
+struct Swap_Into_Place<std::vector<T, A> > {
+    enum { value = true };
+};
+
+template<typename T, typename A>
+struct Swap_Into_Place<std::deque<T, A> > {
+    enum { value = true };
+};
+
+template<typename T, typename A>
+struct Swap_Into_Place<std::list<T, A> > {
+    enum { value = true };
+};
+
+template<typename K, typename V, typename C, typename A>
+struct Swap_Into_Place<std::map<K, V, C, A> > {
+    enum { value = true };
+};
+
+template<typename K, typename V, typename C, typename A>
+struct Swap_Into_Place<std::multimap<K, V, C, A> > {
+    enum { value = true };
+};
+
+template<typename K, typename C, typename A>
+struct Swap_Into_Place<std::set<K, C, A> > {
+    enum { value = true };
+};
+
+template<typename K, typename C, typename A>
+struct Swap_Into_Place<std::multiset<K, C, A> > {
+    enum { value = true };
+};
+
+/** Construct a value at mem from val, which is about to be thrown away.  If
+    Swap_Into_Place says so, the contents of val are taken and it is left
+    default constructed; otherwise it is copied.  give_back() undoes it, for
+    when the new value won't be used after all.
+*/
+template<typename T, bool Swap = Swap_Into_Place<T>::value>
+struct Steal_Value {
+    static T * construct(void * mem, T & val)
+    {
+        return new (mem) T(val);
+    }
+
+    static void give_back(T & stolen, T & val)
+    {
+    }
+};
+
+template<typename T>
+struct Steal_Value<T, true> {
+    static T * construct(void * mem, T & val)
+    {
+        T * result = new (mem) T();
+        using std::swap;
+        swap(*result, val);
+        return result;
+    }
+
+    static void give_back(T & stolen, T & val)
+    {
+        using std::swap;
+        swap(stolen, val);
+    }
+};
+
+/** Allocate a value from val, taking its contents if Swap_Into_Place says
+    so. */
+template<typename T>
+T * new_stolen_value(T & val)
+{
+    void * mem = operator new(sizeof(T));
+    try {
+        return Steal_Value<T>::construct(mem, val);
+    } catch (...) {
+        operator delete(mem);
+        throw;
+    }
+}
+
 /** Enum that tells us whether a particular data item has been published or
     not.  If it has been published, then any cleanup must be deferred.
     Otherwise, cleanups can happen straight away.
@@ -76,8 +193,29 @@ enum Sharing {
 /* VERSION_TABLE                                                             */
 /*****************************************************************************/
 
+/** Cleanups of values (ValCleanup) and of tables are scheduled with
+    schedule_small_cleanup(), and so must be bitwise copyable and no bigger
+    than two pointers.
+
+    A table that has been published can still grow in place with append(),
+    as long as it has spare capacity; readers only look at the first size()
+    entries and the size is published last.  Anything that makes a copy of
+    the table in order to replace it first seals it, so that an append can't
+    be lost by being made to a table that is about to disappear.  This means
+    that every table that has been replaced is sealed.
+
+    The valid_to epochs are stored in a column of their own, separately from
+    the values, so that finding the value for an epoch only touches the
+    cache lines holding the epochs even when there is a long history.
+
+    Tables are allocated and freed on nearly every commit, and most of them
+    only hold a few entries, so by default they come from a Slab_Allocator.
+    The allocator is stored in the table, and a copy of it is taken to free
+    the table once the table has been destroyed.
+*/
+
 template<typename T, typename ValCleanup = No_Cleanup<T>,
-         typename Allocator = std::allocator<char> >
+         typename Allocator = Slab_Allocator>
 struct Version_Table {
 
     // This structure provides a list of values.  Each one is tagged with the
@@ -95,43 +233,104 @@ struct Version_Table {
         T value;
     };
 
-    uint32_t size() const { return itl.last; }
+    /** Reference to an entry in the table.  The two parts of it aren't
+        stored together, so we can't return an Entry &.
+    */
+    template<typename E, typename V>
+    struct Entry_Ref_Base {
+        Entry_Ref_Base(E & valid_to, V & value)
+            : valid_to(valid_to), value(value)
+        {
+        }
+
+        E & valid_to;
+        V & value;
+    };
+
+    typedef Entry_Ref_Base<Epoch, T> Entry_Ref;
+    typedef Entry_Ref_Base<const Epoch, const T> Const_Entry_Ref;
+
+    uint32_t size() const { return itl.last & ~(SEALED | APPENDING); }
+
+    uint32_t capacity() const { return itl.capacity; }
+
+    /** Capacity to allocate for a table that needs to hold size entries and
+        will probably be appended to. */
+    static size_t capacity_for_append(size_t size)
+    {
+        return std::max<size_t>(size * 2, 4);
+    }
 
     ~Version_Table()
     {
         size_t sz = size();
+        T * vals = values();
         for (unsigned i = 0;  i < sz;  ++i)
-            history[i].value.~T();
+            vals[i].~T();
     }
 
-    /// Return the value for the given epoch
+    /** Return the value for the given epoch.  Entry i is valid from
+        valid_to[i - 1] onwards, so we need the number of entries (not
+        counting the last, whose valid_to means nothing) whose valid_to is
+        at or before the epoch.  Most reads are of the newest value, so we
+        check for that first; otherwise we do a binary search over the
+        valid_to column, written so that the compiler can use conditional
+        moves instead of branches.
+    */
     const T & value_at_epoch(Epoch epoch) const
     {
-        for (int i = itl.last - 1;  i > 0;  --i) {
-            Epoch valid_from = history[i - 1].valid_to;
-            if (epoch >= valid_from)
-                return history[i].value;
+        int sz = size();
+        const T * vals = values();
+
+        if (sz < 2 || epoch >= valid_to[sz - 2])
+            return vals[sz - 1];
+
+        // Search valid_to[0] to valid_to[sz - 3]; we know that
+        // valid_to[sz - 2] is after the epoch.
+        size_t len = sz - 2;
+        if (len == 0) return vals[0];
+
+        const Epoch * base = valid_to;
+        while (len > 1) {
+            size_t half = len / 2;
+            base = (base[half] <= epoch ? base + half : base);
+            len -= half;
         }
-            
-        return history[0].value;
+
+        return vals[(base - valid_to) + (*base <= epoch)];
     }
-        
+
+    /** Start loading what value_at_epoch() will look at, for when we
+        know about a lookup well before we do it.  The size and capacity
+        that say where things are aren't known until the table is in
+        cache, so we ask for the first two lines, which hold the whole of
+        a table of a few entries.  Prefetching memory past the end of the
+        table is harmless.
+    */
+    void prefetch() const
+    {
+        __builtin_prefetch(this);
+        __builtin_prefetch(reinterpret_cast<const char *>(this) + 64);
+    }
+
     Version_Table * copy(size_t new_capacity) const
     {
+        seal();
+
         if (new_capacity < size())
             throw Exception("new capacity is wrong");
 
         return create(*this, new_capacity);
     }
 
-    Entry & front()
+    Entry_Ref front()
     {
-        return history[0];
+        return element_unchecked(0);
     }
 
-    const Entry & front() const
+    Const_Entry_Ref front() const
     {
-        return history[0];
+        return element_unchecked(0);
     }
 
     struct RunValueDestructor {
@@ -156,67 +355,145 @@ struct Version_Table {
         if (ValCleanup::useful && sharing == EXCLUSIVE) {
             ValCleanup vc(back().value);
             if (published == PUBLISHED)
-                schedule_cleanup(vc);
+                schedule_small_cleanup(vc);
             else vc();
         }
 
         RunValueDestructor cleanup(back().value);
         
         if (published == PUBLISHED)
-            schedule_cleanup(cleanup);
+            schedule_small_cleanup(cleanup);
         else cleanup();
         
         --itl.last;
     }
 
-    void push_back(Epoch valid_to, const T & val)
+    /** Add a new value valid from new_epoch onwards to the end of the table
+        without copying it.  This can happen while readers are looking at
+        the table; they won't see the new entry until it's complete.
+
+        Only one thread at a time may append to a given table (the commit
+        stripe for the object makes sure of this).  Returns false if there's
+        no spare capacity or the table has been sealed, in which case the
+        caller needs to make a copy instead.
+    */
+    bool append(Epoch new_epoch, const T & val)
     {
-        push_back(Entry(valid_to, val));
+        return append_itl(new_epoch, const_cast<T &>(val), false);
     }
 
+    /** As append(), but val is about to be thrown away, so its contents are
+        taken rather than copied if Swap_Into_Place says so.  If it returns
+        false then val is left as it was.
+    */
+    bool append_stolen(Epoch new_epoch, T & val)
+    {
+        return append_itl(new_epoch, val, true);
+    }
+
+    /** Stop any more entries from being appended in place, so that a
+        consistent copy can be made.  If an append is in progress, waits
+        for it to finish.
+    */
+    void seal() const
+    {
+        uint32_t & last = const_cast<uint32_t &>(itl.last);
+
+        for (;;) {
+            uint32_t old_last = last;
+            if (old_last & SEALED) return;
+            if (old_last & APPENDING) {
+                sched_yield();
+                continue;
+            }
+            if (cmp_xchg(last, old_last, old_last | SEALED)) return;
+        }
+    }
+
+    bool sealed() const { return itl.last & SEALED; }
+
     void push_back(const Entry & entry)
     {
-        if (itl.last == itl.capacity) {
+        push_back(entry.valid_to, entry.value);
+    }
+
+    void push_back(Epoch entry_valid_to, const T & val)
+    {
+        if (itl.last == itl.capacity || (itl.last & (SEALED | APPENDING))) {
             using namespace std;
             cerr << "last = " << itl.last << endl;
             cerr << "capacity = " << itl.capacity << endl;
             throw Exception("can't push back");
         }
-        new (&history[itl.last].value) T(entry.value);
-        history[itl.last].valid_to = entry.valid_to;
+        new (&values()[itl.last]) T(val);
+        valid_to[itl.last] = entry_valid_to;
             
         memory_barrier();
 
         ++itl.last;
     }
+
+    /** Push back a value that is about to be thrown away, taking its
+        contents rather than copying it if Swap_Into_Place says so (see
+        Steal_Value).  If the table is then not used, give_back() returns
+        them to val. */
+    void push_back_stolen(Epoch entry_valid_to, T & val)
+    {
+        if (itl.last == itl.capacity || (itl.last & (SEALED | APPENDING)))
+            throw Exception("can't push back");
+
+        Steal_Value<T>::construct(&values()[itl.last], val);
+        valid_to[itl.last] = entry_valid_to;
+
+        memory_barrier();
+
+        ++itl.last;
+    }
+
+    /** Give the contents of the last value, which was added with
+        push_back_stolen(), back to where they were taken from.  Only for
+        tables that were never published. */
+    void give_back(T & val)
+    {
+        Steal_Value<T>::give_back(back().value, val);
+    }
         
-    const Entry & back() const
+    Const_Entry_Ref back() const
     {
-        return history[itl.last - 1];
+        return element_unchecked(size() - 1);
     }
 
-    Entry & back()
+    Entry_Ref back()
     {
-        return history[itl.last - 1];
+        return element_unchecked(size() - 1);
     }
 
-    Entry & element(int index)
+    Entry_Ref element(int index)
     {
         if (index < 0 || index >= size())
             throw Exception("invalid element");
-        return history[index];
+        return element_unchecked(index);
     }
 
-    const Entry & element(int index) const
+    Const_Entry_Ref element(int index) const
     {
         if (index < 0 || index >= size())
             throw Exception("invalid element");
-        return history[index];
+        return element_unchecked(index);
+    }
+
+    /// Offset of the values from the start of the table; they come after
+    /// the valid_to column.
+    static size_t values_offset(size_t capacity)
+    {
+        size_t align = __alignof__(T);
+        size_t offset = sizeof(Version_Table) + capacity * sizeof(Epoch);
+        return (offset + align - 1) / align * align;
     }
 
     static size_t bytes_for_capacity(size_t capacity)
     {
-        return sizeof(Version_Table) + capacity * sizeof(Entry);
+        return values_offset(capacity) + capacity * sizeof(T);
     }
     
     struct Deleter {
@@ -231,18 +508,19 @@ struct Version_Table {
 
             // Clean up the objects
             if (ValCleanup::useful && sharing == EXCLUSIVE) {
-                for (unsigned i = 0;  i < version_table->itl.last;  ++i) {
-                    ValCleanup vc(version_table->history[i].value);
+                for (unsigned i = 0;  i < version_table->size();  ++i) {
+                    ValCleanup vc(version_table->values()[i]);
                     vc();
                 }
             }
             
-            // TODO: how to avoid destroying the allocator before we use it?
+            // The allocator lives in the table, so we need our own copy to
+            // free the table with once it's been destroyed
+            Allocator allocator(version_table->itl);
 
             version_table->~Version_Table();
-            version_table->itl.deallocate
-                (reinterpret_cast<char *>(version_table),
-                 bytes_for_capacity(capacity));
+            allocator.deallocate(reinterpret_cast<char *>(version_table),
+                                 bytes_for_capacity(capacity));
         }
 
         Version_Table * version_table;
@@ -255,7 +533,7 @@ struct Version_Table {
         Deleter deleter(version_table, sharing);
         if (published == NEVER_PUBLISHED)
             deleter();
-        else schedule_cleanup(deleter);
+        else schedule_small_cleanup(deleter);
     }
 
     static Version_Table * create(size_t capacity,
@@ -273,7 +551,7 @@ struct Version_Table {
         // TODO: exception safety...
         void * d = allocator.allocate(bytes_for_capacity(capacity));
         Version_Table * d2 = new (d) Version_Table(capacity, allocator);
-        d2->push_back(Entry(1,  val));
+        d2->push_back(1, val);
         return d2;
     }
 
@@ -288,39 +566,44 @@ struct Version_Table {
 
     Version_Table * cleanup(Epoch unused_valid_from) const
     {
+        seal();
+
         Version_Table * version_table2 = create(size(), itl);
         
         // Copy them, skipping the one that matched
         
+        const T * vals = values();
+        T * vals2 = version_table2->values();
+
         // TODO: optimize
         Epoch valid_from = 1;
         bool found = false;
-        for (unsigned i = 0, e = itl.last, j = 0; i != e;  ++i) {
+        for (unsigned i = 0, e = size(), j = 0; i != e;  ++i) {
             if (valid_from == unused_valid_from
                 || (i == 0
-                    && unused_valid_from < front().valid_to)) {
+                    && unused_valid_from < valid_to[0])) {
                 // Remove this element, once nothing can look at it
 
                 if (found)
                     throw Exception("two with the same valid_from value");
                 found = true;
                 if (j != 0)
-                    version_table2->history[j - 1].valid_to = history[i].valid_to;
+                    version_table2->valid_to[j - 1] = valid_to[i];
                 // Call the cleanup function
                 if (ValCleanup::useful) {
-                    ValCleanup vc(history[i].value);
-                    schedule_cleanup(vc);
+                    ValCleanup vc(vals[i]);
+                    schedule_small_cleanup(vc);
                 }
             }
             else {
                 // Copy element i to element j
-                new (&version_table2->history[j].value) T(history[i].value);
-                version_table2->history[j].valid_to = history[i].valid_to;
+                new (&vals2[j]) T(vals[i]);
+                version_table2->valid_to[j] = valid_to[i];
                 ++j;
                 ++version_table2->itl.last;
             }
             
-            valid_from = history[i].valid_to;
+            valid_from = valid_to[i];
         }
         
         if (!found) {
@@ -337,15 +620,17 @@ struct Version_Table {
     std::pair<Version_Table *, Epoch>
     rename_epoch(Epoch old_valid_from, Epoch new_valid_from) const
     {
+        seal();
+
         int s = size();
         
         if (s == 0)
             throw Exception("renaming with no values");
         
-        if (old_valid_from < history[0].valid_to) {
+        if (old_valid_from < valid_to[0]) {
             // The last one doesn't have a valid_from, so we assume that
             // it's ok and leave it.
-            Epoch e = (s == 2 ? history[1].valid_to : 0);
+            Epoch e = (s == 2 ? valid_to[1] : 0);
             return std::make_pair(const_cast<Version_Table *>(this), e);
         }
         
@@ -360,11 +645,11 @@ struct Version_Table {
         Epoch result = 0;
         bool found = false;
         for (unsigned i = 0;  i != s;  ++i) {
-            if (d2->history[i].valid_to != old_valid_from) continue;
-            d2->history[i].valid_to = new_valid_from;
+            if (d2->valid_to[i] != old_valid_from) continue;
+            d2->valid_to[i] = new_valid_from;
             found = true;
             if (i == s - 3)
-                result = d2->history[s - 2].valid_to;
+                result = d2->valid_to[s - 2];
             break;
         }
 
@@ -377,6 +662,44 @@ struct Version_Table {
     }
 
 private:
+    // Flags stored in the top bits of itl.last
+    enum {
+        SEALED    = 0x80000000,  ///< Can no longer be appended to
+        APPENDING = 0x40000000   ///< An append is in progress
+    };
+
+    bool append_itl(Epoch new_epoch, T & val, bool steal)
+    {
+        uint32_t last = itl.last;
+        if ((last & (SEALED | APPENDING)) || last == 0
+            || last == itl.capacity)
+            return false;
+
+        // The slot past the end is invisible to everyone else, so we can
+        // construct the value there before we claim the table.
+        if (steal) Steal_Value<T>::construct(&values()[last], val);
+        else new (&values()[last]) T(val);
+        valid_to[last] = 1;
+
+        // Claim it, so that nobody can seal it while the previous entry's
+        // valid_to is being changed
+        uint32_t old_last = last;
+        if (!cmp_xchg(itl.last, old_last, last | APPENDING)) {
+            if (steal) Steal_Value<T>::give_back(values()[last], val);
+            values()[last].~T();
+            return false;
+        }
+
+        // Readers with the old size never look at the valid_to of the last
+        // entry, so it's safe to change it now
+        valid_to[last - 1] = new_epoch;
+
+        memory_barrier();
+
+        itl.last = last + 1;
+        return true;
+    }
+
     // Use the empty base optimization for the allocator
     struct Itl : public Allocator {
         Itl(uint32_t capacity, const Allocator & allocator)
@@ -385,10 +708,35 @@ private:
         }
 
         uint32_t capacity;   // Number allocated
-        uint32_t last;       // Index of last valid entry
+        uint32_t last;       // Index of last valid entry, plus flags
     } itl;
 
-    Entry history[0];  // real ones are allocated after
+    // The valid_to column is allocated after the table, followed by the
+    // values
+    Epoch valid_to[0];
+
+    T * values()
+    {
+        return reinterpret_cast<T *>
+            (reinterpret_cast<char *>(this) + values_offset(itl.capacity));
+    }
+
+    const T * values() const
+    {
+        return reinterpret_cast<const T *>
+            (reinterpret_cast<const char *>(this)
+             + values_offset(itl.capacity));
+    }
+
+    Entry_Ref element_unchecked(int index)
+    {
+        return Entry_Ref(valid_to[index], values()[index]);
+    }
+
+    Const_Entry_Ref element_unchecked(int index) const
+    {
+        return Const_Entry_Ref(valid_to[index], values()[index]);
+    }
 
     Version_Table(size_t capacity, Allocator allocator = Allocator())
         : itl(capacity, allocator)
@@ -398,8 +746,10 @@ private:
     Version_Table(size_t capacity, const Version_Table & old_version_table)
         : itl(capacity, old_version_table.itl)
     {
-        for (unsigned i = 0;  i < old_version_table.size();  ++i)
-            push_back(old_version_table.element(i));
+        for (unsigned i = 0;  i < old_version_table.size();  ++i) {
+            Const_Entry_Ref entry = old_version_table.element(i);
+            push_back(entry.valid_to, entry.value);
+        }
     }
 };
 
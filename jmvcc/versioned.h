@@ -87,6 +87,8 @@ struct Versioned : public Versioned_Object {
     {
         if (!current_trans) {
             ACE_Guard<Mutex> guard(lock);
+            if (current_read_only)
+                return value_at_epoch(current_read_only->epoch());
             return value_at_epoch(get_current_epoch());
         }
         
@@ -131,13 +133,20 @@ private:
         if (epoch >= valid_from())
             return *current;
 
-        for (int i = history.size() - 1;  i > 0;  --i) {
-            Epoch valid_from = history[i - 1].valid_to;
-            if (epoch >= valid_from)
-                return *history[i].value;
+        // Entry i is valid from history[i - 1].valid_to, so we binary
+        // search for the number of entries before the last one whose
+        // valid_to is at or before the epoch.
+        int base = 0, len = history.size() - 1;
+        if (len <= 0) return *history.front().value;
+
+        while (len > 1) {
+            int half = len / 2;
+            base = (history[base + half].valid_to <= epoch
+                    ? base + half : base);
+            len -= half;
         }
         
-        return *history.front().value;
+        return *history[base + (history[base].valid_to <= epoch)].value;
     }
     
     struct Entry_Holder {
@@ -201,11 +210,24 @@ public:
         return true;
     }
 
-    virtual void * setup(Epoch old_epoch, Epoch new_epoch, void * data)
+    virtual void * prepare(Epoch old_epoch, void * data)
+    {
+        // Copy the new value before anything is locked; setup() just has to
+        // link it in
+        Entry entry = new_entry(0, *reinterpret_cast<T *>(data));
+        return entry.value;
+    }
+
+    virtual void unprepare(void * data, void * prepared) throw ()
+    {
+        cleanup_entry(Entry(0, reinterpret_cast<T *>(prepared)));
+    }
+
+    virtual void * setup(Epoch old_epoch, Epoch new_epoch, void * prepared)
     {
         ACE_Guard<Mutex> guard(lock);
 
-        if (new_epoch != get_current_epoch() + 1)
+        if (new_epoch <= get_current_epoch())
             throw Exception("epochs out of order");
 
         if (valid_from() > old_epoch)
@@ -216,8 +238,7 @@ public:
         // entry as its epoch is higher than the current epoch.
         history.push_back(Entry(new_epoch, current));
         //valid_from = new_epoch;
-        Entry entry = new_entry(0, *reinterpret_cast<T *>(data));
-        current = entry.value;
+        current = reinterpret_cast<T *>(prepared);
 
         return this;
     }
@@ -14,6 +14,7 @@
 #include "jml/arch/atomic_ops.h"
 #include "jml/arch/exception.h"
 #include "jml/arch/threads.h"
+#include "jml/compiler/compiler.h"
 #include "version_table.h"
 #include "garbage.h"
 
@@ -32,6 +33,13 @@ namespace JMVCC {
     can be shared between an old and a new version), the object should
     derive directly from Versioned_Object instead.
 
+    Most objects spend most of their time with only one version, so that
+    version is stored inline in the object and the version table is only
+    allocated while there is more than one.  The inline value is only ever
+    written when moving back from a table, which happens when the last of
+    the older versions is cleaned up; by then any reader that was looking
+    at the inline value before the table was created has finished.
+
     TODO: allow it to have *no* versions.
 */
 
@@ -41,14 +49,13 @@ struct Versioned2 : public Versioned_Object {
     typedef T value_type;
 
     explicit Versioned2(const T & val = T())
+        : version_table(0), inline_value(val)
     {
-        //static Info info;
-        version_table = VT::create(val, 1);
     }
 
     ~Versioned2()
     {
-        VT::free(const_cast<VT *>(vt()), PUBLISHED, EXCLUSIVE);
+        if (vt()) VT::free(const_cast<VT *>(vt()), PUBLISHED, EXCLUSIVE);
     }
 
     // Client interface.  Just two methods to get at the current value.
@@ -58,16 +65,16 @@ struct Versioned2 : public Versioned_Object {
         T * local = current_trans->local_value<T>(this).first;
 
         if (!local) {
-            T value;
-            {
-                value = vt()
-                    ->value_at_epoch(current_trans->epoch());
-            }
-            local = current_trans->local_value<T>(this, value);
+            // Copied straight from the version into the sandbox
+            local = current_trans->local_value<T>
+                (this, value_at_epoch(current_trans->epoch()));
             
             if (!local)
                 throw Exception("mutate(): no local was created");
         }
+
+        if (JML_UNLIKELY(conflict_detection_ != DETECT_AT_COMMIT))
+            check_early_conflict();
         
         return *local;
     }
@@ -79,40 +86,122 @@ struct Versioned2 : public Versioned_Object {
     
     const T read() const
     {
-        if (!current_trans)
+        if (!current_trans) {
+            // A read-only transaction has no local values to look for
+            if (current_read_only)
+                return value_at_epoch(current_read_only->epoch());
             throw Exception("reading outside a transaction");
+        }
 
         const T * val = current_trans->local_value<T>(this).first;
         
-        if (val) return *val;
+        if (val) {
+            if (JML_UNLIKELY(conflict_detection_ != DETECT_AT_COMMIT))
+                check_early_conflict();
+            return *val;
+        }
         
-        const VT * d = vt();
-
-        T result = d->value_at_epoch(current_trans->epoch());
+        T result = value_at_epoch(current_trans->epoch());
         return result;
     }
 
     size_t history_size() const
     {
-        size_t result = vt()->size() - 1;
+        const VT * d = vt();
+        if (!d) return 0;
+        size_t result = d->size() - 1;
         return result;
     }
 
-private:
+protected:
     // Internal version_table object allocated for when we have more than one
     // version
     typedef Version_Table<T> VT;
 
-    // The single internal version_table member.  Updated atomically.
+    // The single internal version_table member.  Updated atomically.  Null
+    // when the only version is the inline one.
     mutable VT * version_table;
 
+    // The value when there is only one version
+    T inline_value;
+
     const VT * vt() const
     {
         return reinterpret_cast<const VT *>(version_table);
     }
 
+    const T & value_at_epoch(Epoch epoch) const
+    {
+        const VT * d = vt();
+        if (!d) return inline_value;
+        return d->value_at_epoch(epoch);
+    }
+
+    // Newest version, which is the one that the next commit builds on
+    const T & newest_value() const
+    {
+        const VT * d = vt();
+        if (!d) return inline_value;
+        return d->back().value;
+    }
+
+    // Add a new version with the given value, valid from new_epoch, without
+    // checking for conflicts.  The value is about to be thrown away, so its
+    // contents may be taken rather than copied (see Swap_Into_Place).
+    // Returns the setup data for commit() and rollback().
+    void * setup_value(Epoch new_epoch, T & value)
+    {
+        if (new_epoch <= get_current_epoch())
+            throw Exception("epochs out of order");
+
+        for (;;) {
+            const VT * d = vt();
+
+            if (!d) {
+                // Only the inline version so far; we need a table
+                VT * new_version_table
+                    = VT::create(VT::capacity_for_append(2));
+                new_version_table->push_back(new_epoch, inline_value);
+                new_version_table->push_back_stolen(1 /* valid_to */, value);
+
+                if (set_version_table(d, new_version_table, &value))
+                    return new_version_table;
+                continue;
+            }
+
+            // If there's room, add it to the table that's already there
+            if (const_cast<VT *>(d)->append_stolen(new_epoch, value))
+                return const_cast<VT *>(d);
+
+            VT * new_version_table
+                = d->copy(VT::capacity_for_append(d->size() + 1));
+            new_version_table->back().valid_to = new_epoch;
+            new_version_table->push_back_stolen(1 /* valid_to */, value);
+            
+            if (set_version_table(d, new_version_table, &value))
+                return new_version_table;
+        }
+    }
+
+    // We have a local value; has a newer version been committed since our
+    // snapshot?
+    void check_early_conflict() const
+    {
+        const VT * d = vt();
+
+        Epoch valid_from = 1;
+        if (d && d->size() > 1)
+            valid_from = d->element(d->size() - 2).valid_to;
+
+        current_trans->check_conflict(this, valid_from);
+    }
+
+    // Either table may be null, meaning the inline value.  If the new
+    // table's last value was taken from stolen_from with push_back_stolen(),
+    // it's given back if the table isn't used.
     bool set_version_table(const VT * & old_version_table,
-                           VT * new_version_table)
+                           VT * new_version_table,
+                           T * stolen_from = 0)
     {
         memory_barrier();
 
@@ -120,9 +209,13 @@ private:
                                const_cast<VT * &>(old_version_table),
                                new_version_table);
 
-        if (!result) VT::free(new_version_table, NEVER_PUBLISHED, SHARED);
-        else VT::free(const_cast<VT *>(old_version_table),
-                      PUBLISHED, SHARED);
+        if (!result) {
+            if (stolen_from) new_version_table->give_back(*stolen_from);
+            if (new_version_table)
+                VT::free(new_version_table, NEVER_PUBLISHED, SHARED);
+        }
+        else if (old_version_table)
+            VT::free(const_cast<VT *>(old_version_table), PUBLISHED, SHARED);
 
         return result;
     }
@@ -135,7 +228,7 @@ public:
         const VT * d = vt();
         
         Epoch valid_from = 1;
-        if (d->size() > 1)
+        if (d && d->size() > 1)
             valid_from = d->element(d->size() - 2).valid_to;
             
         if (valid_from > old_epoch)
@@ -145,27 +238,12 @@ public:
 
     virtual void * setup(Epoch old_epoch, Epoch new_epoch, void * new_value)
     {
-        for (;;) {
-            const VT * d = vt();
+        // Nothing else can commit this object while we're setting up, so
+        // the check can't go stale
+        if (!check(old_epoch, new_epoch, new_value))
+            return 0;  // something updated before us
 
-            if (new_epoch != get_current_epoch() + 1)
-                throw Exception("epochs out of order");
-            
-            Epoch valid_from = 1;
-            if (d->size() > 1)
-                valid_from = d->element(d->size() - 2).valid_to;
-            
-            if (valid_from > old_epoch)
-                return false;  // something updated before us
-            
-            VT * new_version_table = d->copy(d->size() + 1);
-            new_version_table->back().valid_to = new_epoch;
-            new_version_table->push_back(1 /* valid_to */,
-                                      *reinterpret_cast<T *>(new_value));
-            
-            if (set_version_table(d, new_version_table))
-                return new_version_table;
-        }
+        return setup_value(new_epoch, *reinterpret_cast<T *>(new_value));
     }
 
     virtual void commit(Epoch new_epoch, void * setup_data) throw ()
@@ -185,6 +263,9 @@ public:
     {
         const VT * d = vt();
 
+        // This leaves a table with one entry rather than going back to the
+        // inline value, since readers from before setup() might still be
+        // looking at the inline value.
         for (;;) {
             VT * d2 = d->copy(d->size());
             d2->pop_back(NEVER_PUBLISHED, EXCLUSIVE);
@@ -198,7 +279,7 @@ public:
 
         for (;;) {
 
-            if (d->size() < 2) {
+            if (!d || d->size() < 2) {
                 using namespace std;
                 cerr << "cleaning up: unused_valid_from = " << unused_valid_from
                      << " trigger_epoch = " << trigger_epoch << endl;
@@ -208,6 +289,16 @@ public:
 
             
             VT * result = d->cleanup(unused_valid_from);
+            if (result && result->size() == 1) {
+                // Only one version left, so it can go back inline.  Nothing
+                // can be reading the inline value: anything that read it
+                // before the table was created needed a version that has
+                // now been cleaned up.
+                inline_value = result->front().value;
+                VT::free(result, NEVER_PUBLISHED, SHARED);
+                if (set_version_table(d, 0)) return;
+                continue;
+            }
             if (result) {
                 if (set_version_table(d, result)) return;
                 continue;
@@ -233,12 +324,18 @@ public:
         const VT * d = vt();
 
         for (;;) {
+            // The inline version is valid from the start of time
+            if (!d) return 0;
+
             std::pair<VT *, Epoch> result
                 = d->rename_epoch(old_valid_from, new_valid_from);
 
             if (!result.first)
                 throw Exception("not found");
 
+            // Nothing needed to change
+            if (result.first == d) return result.second;
+
             if (set_version_table(d, result.first)) return result.second;
         }
     }
@@ -261,10 +358,14 @@ public:
         using namespace std;
         std::string s(indent, ' ');
         stream << s << "object at " << this << std::endl;
+        if (!d) {
+            stream << s << "single inline value " << inline_value << endl;
+            return;
+        }
         stream << s << "history with " << d->size()
                << " values" << endl;
         for (unsigned i = 0;  i < d->size();  ++i) {
-            const typename VT::Entry & entry = d->element(i);
+            typename VT::Const_Entry_Ref entry = d->element(i);
             stream << s << "  " << i << ": valid to "
                    << entry.valid_to;
             stream << " addr " << &entry.value;
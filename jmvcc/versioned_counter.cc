@@ -0,0 +1,154 @@
+/* versioned_counter.cc
+   Jeremy Barnes, 17 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Batches of deltas for versioned counters.
+*/
+
+#include "versioned_counter.h"
+#include "transaction.h"
+#include "jml/arch/exception.h"
+#include <ace/Synch.h>
+#include <iostream>
+#include <pthread.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+
+using namespace std;
+using namespace ML;
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* DELTA BATCHES                                                             */
+/*****************************************************************************/
+
+/// Objects with deltas waiting for the next flush
+vector<Delta_Batched *> delta_batch;
+ACE_Thread_Mutex delta_batch_lock;
+
+/// Held for the whole of a flush, so that an object can't be destroyed
+/// whilst it's being flushed
+ACE_Thread_Mutex delta_flush_lock;
+
+void queue_for_delta_batch(Delta_Batched * object)
+{
+    ACE_Guard<ACE_Thread_Mutex> guard(delta_batch_lock);
+    delta_batch.push_back(object);
+}
+
+void remove_from_delta_batch(Delta_Batched * object)
+{
+    ACE_Guard<ACE_Thread_Mutex> flush_guard(delta_flush_lock);
+    ACE_Guard<ACE_Thread_Mutex> guard(delta_batch_lock);
+    delta_batch.erase(std::remove(delta_batch.begin(), delta_batch.end(),
+                                  object),
+                      delta_batch.end());
+}
+
+size_t flush_delta_batch()
+{
+    ACE_Guard<ACE_Thread_Mutex> flush_guard(delta_flush_lock);
+
+    vector<Delta_Batched *> objects;
+    {
+        ACE_Guard<ACE_Thread_Mutex> guard(delta_batch_lock);
+        objects.swap(delta_batch);
+    }
+
+    if (objects.empty()) return 0;
+
+    // Counters never conflict, but the commit can still fail (for example
+    // if a contention manager makes us give way), so we may need to retry
+    try {
+        Local_Transaction trans;
+        do {
+            for (unsigned i = 0;  i < objects.size();  ++i)
+                objects[i]->take_pending();
+        } while (!trans.commit());
+    } catch (...) {
+        // Nothing was committed.  The objects keep what was taken (see
+        // take_pending()) and are still marked as queued, so they go back
+        // in the batch for the next flush.
+        ACE_Guard<ACE_Thread_Mutex> guard(delta_batch_lock);
+        delta_batch.insert(delta_batch.end(), objects.begin(), objects.end());
+        throw;
+    }
+
+    for (unsigned i = 0;  i < objects.size();  ++i)
+        if (objects[i]->flushed())
+            queue_for_delta_batch(objects[i]);
+
+    return objects.size();
+}
+
+
+/*****************************************************************************/
+/* BACKGROUND FLUSHING                                                       */
+/*****************************************************************************/
+
+ACE_Thread_Mutex delta_batching_lock;
+pthread_t delta_batching_thread;
+double delta_batching_interval = 0.0;
+volatile bool delta_batching_stop = false;
+
+void * run_delta_batching_thread(void *)
+{
+    // Sleep in short slices so that we notice quickly when we're stopped
+    while (!delta_batching_stop) {
+        double remaining = delta_batching_interval;
+        while (remaining > 0.0 && !delta_batching_stop) {
+            double slice = std::min(remaining, 0.01);
+            usleep((useconds_t)(slice * 1000000));
+            remaining -= slice;
+        }
+
+        // The deltas are kept for the next flush, so we carry on
+        try {
+            flush_delta_batch();
+        } catch (const std::exception & exc) {
+            cerr << "delta batching: flush failed: " << exc.what() << endl;
+        } catch (...) {
+            cerr << "delta batching: flush failed: unknown exception"
+                 << endl;
+        }
+    }
+
+    return 0;
+}
+
+void set_delta_batching(double interval)
+{
+    if (interval < 0.0)
+        throw Exception("set_delta_batching: negative interval");
+
+    ACE_Guard<ACE_Thread_Mutex> guard(delta_batching_lock);
+
+    if (delta_batching_interval > 0.0) {
+        // The thread flushes one last time on its way out
+        delta_batching_stop = true;
+        pthread_join(delta_batching_thread, 0);
+        delta_batching_stop = false;
+        delta_batching_interval = 0.0;
+    }
+
+    if (interval == 0.0) return;
+
+    delta_batching_interval = interval;
+    if (pthread_create(&delta_batching_thread, 0,
+                       run_delta_batching_thread, 0) != 0) {
+        delta_batching_interval = 0.0;
+        throw Exception("couldn't create delta batching thread");
+    }
+}
+
+double get_delta_batching()
+{
+    return delta_batching_interval;
+}
+
+} // namespace JMVCC
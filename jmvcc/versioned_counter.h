@@ -0,0 +1,190 @@
+/* versioned_counter.h                                             -*- C++ -*-
+   Jeremy Barnes, 17 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Versioned counters and accumulators, which are changed with deltas that
+   commute and so never conflict.
+*/
+
+#ifndef __jmvcc__versioned_counter_h__
+#define __jmvcc__versioned_counter_h__
+
+#include "versioned2.h"
+#include "adaptive_lock.h"
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* DELTA BATCHES                                                             */
+/*****************************************************************************/
+
+/* Batched transactions (see doc/design.txt): deltas are collected outside
+   of any transaction, and applied periodically in a single transaction for
+   the whole batch. */
+
+/** Something with deltas waiting to go in the next batch. */
+struct Delta_Batched {
+    virtual ~Delta_Batched()
+    {
+    }
+
+    /** Add everything that is waiting to the current transaction.  Called
+        again (with everything waiting, including what was taken last time)
+        if the transaction has to be retried. */
+    virtual void take_pending() = 0;
+
+    /** The transaction has committed.  Returns true if more deltas were
+        added in the meantime, in which case the object needs to go in the
+        next batch. */
+    virtual bool flushed() = 0;
+};
+
+/** Put the object in the next batch. */
+void queue_for_delta_batch(Delta_Batched * object);
+
+/** Take the object out of the batch, waiting for any flush in progress to
+    finish.  Called when an object with deltas waiting is destroyed; the
+    deltas are lost. */
+void remove_from_delta_batch(Delta_Batched * object);
+
+/** Apply all of the waiting deltas in one transaction.  Returns the number
+    of objects that were changed.  If it throws, the deltas are kept for
+    the next flush. */
+size_t flush_delta_batch();
+
+/** Flush the batch every interval seconds on a background thread.  Zero
+    (the default) turns it off, after a last flush; deltas then wait for
+    flush_delta_batch() to be called. */
+void set_delta_batching(double interval);
+
+double get_delta_batching();
+
+
+/*****************************************************************************/
+/* VERSIONED_COUNTER                                                         */
+/*****************************************************************************/
+
+/** A versioned value that is changed by adding deltas to it, such as a
+    counter or an accumulator.  The sandbox holds the sum of what the
+    transaction has added rather than a new value, and at commit time it
+    is added to the newest version, whatever that is.  Since addition
+    commutes, transactions that add to the same counter never conflict on
+    it.
+
+    Reading gives the value in the transaction's snapshot plus what the
+    transaction has added.  A transaction that needs to set the value
+    based on what it read (for example to stop it going below zero) should
+    use a Versioned2 instead.
+
+    T must be zero when default constructed, and support operator +.
+
+    Deltas can also be added without a transaction, with add_batched().
+    They are applied in a single transaction with those for every other
+    counter by flush_delta_batch(), or by a background thread (see
+    set_delta_batching()).  This is much cheaper for statistics that are
+    updated very often, at the cost of readers seeing them late.
+*/
+
+template<typename T>
+struct Versioned_Counter : public Versioned2<T>, public Delta_Batched {
+
+    typedef T value_type;
+
+    explicit Versioned_Counter(const T & val = T())
+        : Versioned2<T>(val), pending_(), flushing_(),
+          queued_(false), dirty_(false)
+    {
+    }
+
+    ~Versioned_Counter()
+    {
+        if (queued_) remove_from_delta_batch(this);
+    }
+
+    /** Add to the value in the current transaction. */
+    void add(const T & delta)
+    {
+        if (!current_trans) no_transaction_exception(this);
+        T * local = current_trans->local_value<T>(this).first;
+        if (local) *local = *local + delta;
+        else current_trans->local_value<T>(this, delta);
+    }
+
+    /** Add to the value in the next batch.  Doesn't need a transaction. */
+    void add_batched(const T & delta)
+    {
+        ACE_Guard<Adaptive_Lock> guard(pending_lock_);
+        pending_ = pending_ + delta;
+        dirty_ = true;
+        if (queued_) return;
+        queued_ = true;
+        queue_for_delta_batch(this);
+    }
+
+    const T read() const
+    {
+        if (!current_trans) {
+            if (current_read_only)
+                return this->value_at_epoch(current_read_only->epoch());
+            throw Exception("reading outside a transaction");
+        }
+
+        T result = this->value_at_epoch(current_trans->epoch());
+        const T * delta = current_trans->local_value<T>(this).first;
+        if (delta) result = result + *delta;
+        return result;
+    }
+
+    // Implement object interface
+    virtual bool check(Epoch old_epoch, Epoch new_epoch,
+                       void * delta) const
+    {
+        return true;
+    }
+
+    virtual void * setup(Epoch old_epoch, Epoch new_epoch, void * delta)
+    {
+        // Commits of this object are serialized, so the newest version
+        // can't change under us
+        T value = this->newest_value() + *reinterpret_cast<T *>(delta);
+        return this->setup_value(new_epoch, value);
+    }
+
+private:
+    // Setting the value directly would need conflict detection
+    using Versioned2<T>::mutate;
+    using Versioned2<T>::write;
+
+    virtual void take_pending()
+    {
+        T delta;
+        {
+            ACE_Guard<Adaptive_Lock> guard(pending_lock_);
+            flushing_ = flushing_ + pending_;
+            pending_ = T();
+            dirty_ = false;
+            delta = flushing_;
+        }
+        add(delta);
+    }
+
+    virtual bool flushed()
+    {
+        ACE_Guard<Adaptive_Lock> guard(pending_lock_);
+        flushing_ = T();
+        queued_ = dirty_;
+        return dirty_;
+    }
+
+    Adaptive_Lock pending_lock_;
+    T pending_;      ///< Added with add_batched() and not yet flushed
+    T flushing_;     ///< Taken by a flush that hasn't committed yet
+    bool queued_;    ///< In the batch (or being flushed)
+    bool dirty_;     ///< Added to since the last take_pending()
+};
+
+} // namespace JMVCC
+
+#endif /* __jmvcc__versioned_counter_h__ */
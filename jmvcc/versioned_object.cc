@@ -29,6 +29,19 @@ dump_unlocked(std::ostream & stream,
 {
 }
 
+void *
+Versioned_Object::
+prepare(Epoch old_epoch, void * local_data)
+{
+    return local_data;
+}
+
+void
+Versioned_Object::
+unprepare(void * local_data, void * prepared_data) throw ()
+{
+}
+
 std::string
 Versioned_Object::
 print_local_value(void * val) const
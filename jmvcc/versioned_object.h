@@ -39,10 +39,31 @@ struct Versioned_Object {
     // Should not modify anything.
     virtual bool check(Epoch old_epoch, Epoch new_epoch, void * data) const = 0;
 
+    // Do the expensive part of getting the commit ready (copying or
+    // serializing the new value, for example).  Called after check() but
+    // before the object is locked for the commit, so it must not publish
+    // anything, as another commit may get in first.  Returns what is passed
+    // to setup() as its local_data; the default passes the local value
+    // straight through.
+    //
+    // The sandbox is cleared after the commit, so once setup() has
+    // succeeded the local value is never looked at again.  prepare() and
+    // setup() may therefore take its contents rather than copying it (see
+    // Swap_Into_Place), as long as they give them back if they throw or
+    // fail, or are undone with unprepare().
+    virtual void * prepare(Epoch old_epoch, void * local_data);
+
+    // Free what prepare() returned when it never got to a successful
+    // setup(): the commit failed, or setup() returned null or threw.  Once
+    // setup() has succeeded, it belongs to commit() or rollback().
+    virtual void unprepare(void * local_data, void * prepared_data) throw ();
+
     // Get the commit ready and check that everything can go ahead, but
     // don't actually perform the commit.  Returns an opaque pointer that
     // can be used to provide information to commit() and rollback().  If the
     // setup fails, the pointer must be null, otherwise it must not be null.
+    // The object is locked against other commits whilst this is called, so
+    // it should do as little as possible (see prepare()).
     virtual void * setup(Epoch old_epoch, Epoch new_epoch,
                          void * local_data) = 0;
 
@@ -0,0 +1,530 @@
+/* versioned_small.h                                               -*- C++ -*-
+   Jeremy Barnes, 24 March 2010
+   Copyright (c) 2010 Jeremy Barnes.  All rights reserved.
+
+   Versioned objects for small plain values, which keep their versions
+   inline and are read under a seqlock.
+*/
+
+#ifndef __jmvcc__versioned_small_h__
+#define __jmvcc__versioned_small_h__
+
+#include "versioned2.h"
+#include <boost/type_traits/is_pod.hpp>
+#include <boost/mpl/if.hpp>
+#include <boost/static_assert.hpp>
+#include <stdint.h>
+
+
+namespace JMVCC {
+
+
+/*****************************************************************************/
+/* SEQLOCK                                                                   */
+/*****************************************************************************/
+
+/** A sequence lock.  Writers take it by making the sequence number odd, and
+    release it by making it even again.  Readers never write anything: they
+    read the sequence number, read the data, and read the sequence number
+    again, retrying if it changed or was odd to start with.  The data must
+    therefore be safe to read whilst it's being written, which means plain
+    values (no pointers that a writer might free).
+
+    Loads aren't reordered with other loads on x86, so readers only need to
+    stop the compiler from moving their loads.
+*/
+
+struct Seqlock {
+    Seqlock()
+        : seq(0)
+    {
+    }
+
+    volatile uint32_t seq;
+
+    uint32_t read_begin() const
+    {
+        for (;;) {
+            uint32_t result = seq;
+            if (JML_LIKELY(!(result & 1))) {
+                asm volatile ("" : : : "memory");
+                return result;
+            }
+            cpu_relax();
+        }
+    }
+
+    /** True if the data read since read_begin() returned start needs to be
+        read again. */
+    bool read_retry(uint32_t start) const
+    {
+        asm volatile ("" : : : "memory");
+        return seq != start;
+    }
+
+    void write_lock()
+    {
+        for (;;) {
+            uint32_t old = seq;
+            if (!(old & 1) && __sync_bool_compare_and_swap(&seq, old, old + 1))
+                return;
+            cpu_relax();
+        }
+    }
+
+    void write_unlock()
+    {
+        __sync_fetch_and_add(&seq, 1);
+    }
+
+    struct Write_Guard {
+        Write_Guard(Seqlock & lock)
+            : lock(lock)
+        {
+            lock.write_lock();
+        }
+
+        ~Write_Guard()
+        {
+            lock.write_unlock();
+        }
+
+        Seqlock & lock;
+    };
+};
+
+
+/*****************************************************************************/
+/* VERSIONED_SMALL                                                           */
+/*****************************************************************************/
+
+/** A versioned object for small plain values (ints, doubles, small PODs),
+    for which the mutex of a Versioned and the version table of a
+    Versioned2 cost much more than the value itself.
+
+    The newest N versions are kept inline in the object, in the same layout
+    as a Version_Table (the valid_to epochs in one array, the values in
+    another).  Readers use a seqlock, so a read never locks or allocates; it
+    copies the value out, and tries again if a writer changed anything in
+    the meantime.  Writers (setup, commit, rollback, cleanup and renaming,
+    all of which are rare compared to reads) are serialized by the same
+    seqlock.
+
+    If a long lived snapshot holds up the cleanup of older versions so
+    that there are more than N, they all move to a Version_Table as in a
+    Versioned2, and come back inline once enough of them have been cleaned
+    up.
+
+    T must be a POD, as it's copied while it may be being written.  Use
+    Select_Versioned<T>::type to get a Versioned_Small where possible and a
+    Versioned2 otherwise.
+*/
+
+template<typename T, int N = 4>
+struct Versioned_Small : public Versioned_Object {
+    BOOST_STATIC_ASSERT(boost::is_pod<T>::value);
+    BOOST_STATIC_ASSERT(N >= 2);
+
+    typedef T value_type;
+
+    explicit Versioned_Small(const T & val = T())
+        : size_(1), table_(0)
+    {
+        valid_to_[0] = 1;
+        values_[0] = val;
+    }
+
+    ~Versioned_Small()
+    {
+        if (table_) VT::free(table_, PUBLISHED, EXCLUSIVE);
+    }
+
+    // Client interface.  Just two methods to get at the current value.
+    T & mutate()
+    {
+        if (!current_trans) no_transaction_exception(this);
+        T * local = current_trans->local_value<T>(this).first;
+
+        if (!local) {
+            T value = value_at_epoch(current_trans->epoch());
+            local = current_trans->local_value<T>(this, value);
+
+            if (!local)
+                throw Exception("mutate(): no local was created");
+        }
+
+        if (JML_UNLIKELY(conflict_detection_ != DETECT_AT_COMMIT))
+            check_early_conflict();
+
+        return *local;
+    }
+
+    void write(const T & val)
+    {
+        mutate() = val;
+    }
+
+    const T read() const
+    {
+        if (!current_trans) {
+            // A read-only transaction has no local values to look for
+            if (current_read_only)
+                return value_at_epoch(current_read_only->epoch());
+            throw Exception("reading outside a transaction");
+        }
+
+        const T * val = current_trans->local_value<T>(this).first;
+
+        if (val) {
+            if (JML_UNLIKELY(conflict_detection_ != DETECT_AT_COMMIT))
+                check_early_conflict();
+            return *val;
+        }
+
+        return value_at_epoch(current_trans->epoch());
+    }
+
+    size_t history_size() const
+    {
+        for (;;) {
+            uint32_t seq = seqlock_.read_begin();
+            const VT * t = table_;
+            size_t result = (t ? t->size() : size_) - 1;
+            if (!seqlock_.read_retry(seq)) return result;
+        }
+    }
+
+    /// Are the versions in a table rather than inline?
+    bool overflowed() const
+    {
+        return table_;
+    }
+
+protected:
+    typedef Version_Table<T> VT;
+
+    mutable Seqlock seqlock_;
+
+    // Number of versions inline; at least one.  Unused when table_ is set.
+    uint32_t size_;
+
+    // All of the versions, when there are too many to fit inline
+    VT * table_;
+
+    // The versions, as in a Version_Table
+    Epoch valid_to_[N];
+    T values_[N];
+
+    T value_at_epoch(Epoch epoch) const
+    {
+        for (;;) {
+            uint32_t seq = seqlock_.read_begin();
+
+            T result;
+            const VT * t = table_;
+            if (t) result = t->value_at_epoch(epoch);
+            else result = values_[index_at_epoch(epoch)];
+
+            if (!seqlock_.read_retry(seq)) return result;
+        }
+    }
+
+    // Index of the inline version for the epoch.  A writer may be changing
+    // things, so this must stay in bounds whatever it reads.
+    int index_at_epoch(Epoch epoch) const
+    {
+        int sz = std::min<int>(size_, N);
+        if (sz < 2 || epoch >= valid_to_[sz - 2])
+            return sz - 1;
+
+        int i = 0;
+        while (i < sz - 2 && valid_to_[i] <= epoch)
+            ++i;
+        return i;
+    }
+
+    // Epoch from which the version back from the newest (0 for the newest)
+    // is valid
+    Epoch valid_from(int back) const
+    {
+        for (;;) {
+            uint32_t seq = seqlock_.read_begin();
+
+            Epoch result = 1;
+            const VT * t = table_;
+            int sz = (t ? t->size() : std::min<int>(size_, N));
+            int index = sz - 2 - back;
+            if (index >= 0)
+                result = (t ? t->element(index).valid_to : valid_to_[index]);
+
+            if (!seqlock_.read_retry(seq)) return result;
+        }
+    }
+
+    // We have a local value; has a newer version been committed since our
+    // snapshot?
+    void check_early_conflict() const
+    {
+        current_trans->check_conflict(this, valid_from(0));
+    }
+
+    // Move the first n versions of the table inline.  Called with the
+    // seqlock held.
+    void move_inline(const VT * t, int n)
+    {
+        for (int i = 0;  i < n;  ++i) {
+            typename VT::Const_Entry_Ref entry = t->element(i);
+            valid_to_[i] = entry.valid_to;
+            values_[i] = entry.value;
+        }
+        valid_to_[n - 1] = 1;
+        size_ = n;
+        table_ = 0;
+    }
+
+public:
+    // Implement object interface
+    virtual bool check(Epoch old_epoch, Epoch new_epoch,
+                       void * new_value) const
+    {
+        return valid_from(0) <= old_epoch;
+    }
+
+    virtual void * setup(Epoch old_epoch, Epoch new_epoch, void * new_value)
+    {
+        // Nothing else can commit this object while we're setting up, so
+        // the check can't go stale
+        if (!check(old_epoch, new_epoch, new_value))
+            return 0;  // something updated before us
+
+        if (new_epoch <= get_current_epoch())
+            throw Exception("epochs out of order");
+
+        const T & value = *reinterpret_cast<T *>(new_value);
+        VT * old_table = 0;
+
+        {
+            Seqlock::Write_Guard guard(seqlock_);
+
+            if (!table_ && size_ < N) {
+                valid_to_[size_ - 1] = new_epoch;
+                valid_to_[size_] = 1;
+                values_[size_] = value;
+                ++size_;
+            }
+            else if (!table_) {
+                // No room inline; everything moves to a table
+                VT * t = VT::create(VT::capacity_for_append(N + 1));
+                for (unsigned i = 0;  i < N;  ++i)
+                    t->push_back(i == N - 1 ? new_epoch : valid_to_[i],
+                                 values_[i]);
+                t->push_back(1 /* valid_to */, value);
+                table_ = t;
+            }
+            else if (!table_->append(new_epoch, value)) {
+                VT * t = table_->copy(VT::capacity_for_append(table_->size()
+                                                              + 1));
+                t->back().valid_to = new_epoch;
+                t->push_back(1 /* valid_to */, value);
+                old_table = table_;
+                table_ = t;
+            }
+        }
+
+        if (old_table) VT::free(old_table, PUBLISHED, SHARED);
+
+        return this;
+    }
+
+    virtual void commit(Epoch new_epoch, void * setup_data) throw ()
+    {
+        // Now that it's definitive, we have an older entry to clean up
+        snapshot_info.register_cleanup(this, valid_from(1));
+    }
+
+    virtual void rollback(Epoch new_epoch, void * local_data,
+                          void * setup_data) throw ()
+    {
+        VT * old_table = 0;
+
+        {
+            Seqlock::Write_Guard guard(seqlock_);
+
+            if (!table_) {
+                --size_;
+                valid_to_[size_ - 1] = 1;
+            }
+            else if (table_->size() - 1 <= N) {
+                old_table = table_;
+                move_inline(old_table, old_table->size() - 1);
+            }
+            else {
+                VT * t = table_->copy(table_->size());
+                t->pop_back(NEVER_PUBLISHED, EXCLUSIVE);
+                old_table = table_;
+                table_ = t;
+            }
+        }
+
+        if (old_table) VT::free(old_table, PUBLISHED, SHARED);
+    }
+
+    virtual void cleanup(Epoch unused_valid_from, Epoch trigger_epoch)
+    {
+        VT * old_table = 0;
+        bool found = false;
+
+        {
+            Seqlock::Write_Guard guard(seqlock_);
+
+            if (table_) {
+                VT * t = table_->cleanup(unused_valid_from);
+                if (t) {
+                    found = true;
+                    old_table = table_;
+                    if (t->size() <= N) {
+                        move_inline(t, t->size());
+                        VT::free(t, NEVER_PUBLISHED, SHARED);
+                    }
+                    else table_ = t;
+                }
+            }
+            else if (size_ >= 2) {
+                // Same as Version_Table::cleanup(), but in place
+                Epoch from = 1;
+                for (unsigned i = 0;  i < size_;  ++i) {
+                    if (from == unused_valid_from
+                        || (i == 0 && unused_valid_from < valid_to_[0])) {
+                        if (i != 0) valid_to_[i - 1] = valid_to_[i];
+                        for (unsigned j = i + 1;  j < size_;  ++j) {
+                            valid_to_[j - 1] = valid_to_[j];
+                            values_[j - 1] = values_[j];
+                        }
+                        --size_;
+                        found = true;
+                        break;
+                    }
+                    from = valid_to_[i];
+                }
+            }
+        }
+
+        if (old_table) VT::free(old_table, PUBLISHED, SHARED);
+
+        if (!found) {
+            using namespace std;
+            cerr << "----------- cleaning up didn't exist ---------" << endl;
+            dump_unlocked();
+            cerr << "unused_valid_from = " << unused_valid_from << endl;
+            cerr << "trigger_epoch = " << trigger_epoch << endl;
+            cerr << "----------- end cleaning up didn't exist ---------" << endl;
+            throw Exception("attempt to clean up something that didn't exist");
+        }
+    }
+
+    virtual Epoch rename_epoch(Epoch old_valid_from, Epoch new_valid_from)
+        throw ()
+    {
+        VT * old_table = 0;
+        Epoch result = 0;
+
+        {
+            Seqlock::Write_Guard guard(seqlock_);
+
+            if (table_) {
+                std::pair<VT *, Epoch> renamed
+                    = table_->rename_epoch(old_valid_from, new_valid_from);
+                if (!renamed.first)
+                    throw Exception("not found");
+                if (renamed.first != table_) {
+                    old_table = table_;
+                    table_ = renamed.first;
+                }
+                result = renamed.second;
+            }
+            else if (size_ > 1) {
+                // Same as Version_Table::rename_epoch(), but in place
+                int s = size_;
+                if (old_valid_from < valid_to_[0])
+                    result = (s == 2 ? valid_to_[1] : 0);
+                else {
+                    bool found = false;
+                    for (int i = 0;  i < s && !found;  ++i) {
+                        if (valid_to_[i] != old_valid_from) continue;
+                        valid_to_[i] = new_valid_from;
+                        found = true;
+                        if (i == s - 3)
+                            result = valid_to_[s - 2];
+                    }
+                    if (!found)
+                        throw Exception("not found");
+                }
+            }
+        }
+
+        if (old_table) VT::free(old_table, PUBLISHED, SHARED);
+
+        return result;
+    }
+
+    virtual void dump(std::ostream & stream = std::cerr, int indent = 0) const
+    {
+        dump_itl(stream, indent);
+    }
+
+    virtual void dump_unlocked(std::ostream & stream = std::cerr,
+                               int indent = 0) const
+    {
+        dump_itl(stream, indent);
+    }
+
+    void dump_itl(std::ostream & stream, int indent = 0) const
+    {
+        using namespace std;
+        std::string s(indent, ' ');
+        stream << s << "object at " << this << std::endl;
+
+        const VT * t = table_;
+        int sz = (t ? t->size() : size_);
+        stream << s << "history with " << sz << " values"
+               << (t ? " in table" : " inline") << endl;
+        for (int i = 0;  i < sz;  ++i) {
+            stream << s << "  " << i << ": valid to "
+                   << (t ? t->element(i).valid_to : valid_to_[i])
+                   << " value "
+                   << (t ? t->element(i).value : values_[i]) << endl;
+        }
+    }
+
+    virtual std::string print_local_value(void * val) const
+    {
+        return ostream_format(*reinterpret_cast<T *>(val));
+    }
+
+    virtual void destroy_local_value(void * val) const
+    {
+        current_trans->free_local_value<T>(val);
+    }
+};
+
+
+/*****************************************************************************/
+/* SELECT_VERSIONED                                                          */
+/*****************************************************************************/
+
+/** The best versioned object for a T: a Versioned_Small for PODs of up to
+    16 bytes, and a Versioned2 for everything else. */
+
+template<typename T>
+struct Select_Versioned {
+    enum { small = boost::is_pod<T>::value && sizeof(T) <= 16 };
+
+    typedef typename boost::mpl::if_c<small,
+                                      Versioned_Small<T>,
+                                      Versioned2<T> >::type type;
+};
+
+} // namespace JMVCC
+
+
+#endif /* __jmvcc__versioned_small_h__ */
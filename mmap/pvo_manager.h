@@ -224,10 +224,12 @@ struct PVOManager : public TypedPVO<PVOManagerVersion> {
                               boost::shared_ptr<TargetPVO> >::type
     lookup(ObjectId obj) const
     {
-        if (obj >= read().size())
+        const PVOManagerVersion & version = read();
+
+        if (obj >= version.size())
             throw ML::Exception("unknown object");
         
-        return read().get<TargetPVO>(obj, const_cast<PVOManager *>(this));
+        return version.get<TargetPVO>(obj, const_cast<PVOManager *>(this));
     }
 
     template<typename T>
@@ -238,6 +240,44 @@ struct PVOManager : public TypedPVO<PVOManagerVersion> {
         return lookup<TypedPVO<T> >(obj);
     }
 
+    /** Read the values of the objects with the given IDs into out, as
+        lookup<T>(id)->read() for each would.  The entries for the IDs are
+        prefetched ahead of use, and then the objects are read with
+        TypedPVO<T>::read_many(). */
+    template<typename T>
+    void read_many(const ObjectId * first, const ObjectId * last, T * out) const
+    {
+        const PVOManagerVersion & version = read();
+        PVOManager * owner = const_cast<PVOManager *>(this);
+
+        enum { D = TypedPVO<T>::PREFETCH_DISTANCE };
+
+        size_t n = last - first;
+        std::vector<const TypedPVO<T> *> objects(n);
+
+        for (size_t i = 0;  i < n;  ++i) {
+            if (i + D < n && first[i + D] < version.size())
+                __builtin_prefetch(&version[first[i + D]]);
+
+            ObjectId id = first[i];
+            if (id >= version.size())
+                throw ML::Exception("unknown object");
+
+            const PVOEntry & entry = version[id];
+            const TypedPVO<T> * obj;
+            if (entry.local) {
+                obj = dynamic_cast<const TypedPVO<T> *>(entry.local.get());
+                if (!obj)
+                    throw ML::Exception("local object of wrong type");
+            }
+            else obj = version.get<TypedPVO<T> >(id, owner).get();
+
+            objects[i] = obj;
+        }
+
+        TypedPVO<T>::read_many(objects.begin(), objects.end(), out);
+    }
+
     const PVOEntry & object_entry(ObjectId id) const
     {
         return read()[id];
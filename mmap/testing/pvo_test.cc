@@ -28,6 +28,7 @@
 #include <boost/bind.hpp>
 #include <fstream>
 #include <vector>
+#include <algorithm>
 #include "jml/utils/testing/live_counting_obj.h"
 #include "jml/utils/hash_map.h"
 #include <boost/interprocess/file_mapping.hpp>
@@ -451,6 +452,86 @@ BOOST_AUTO_TEST_CASE( test_persistence )
     BOOST_CHECK_EQUAL(constructed, destroyed);
 }
 
+BOOST_AUTO_TEST_CASE( test_read_many )
+{
+    const char * fname = "pvot_backing5";
+    remove_file_on_destroy destroyer1(fname);
+    unlink(fname);
+
+    PVOStore store(create_only, fname, 1024 * 1024);
+
+    // Enough objects that the pipeline in read_many() fills up
+    int n = 100;
+
+    vector<PVORef<int> > objects;
+    vector<ObjectId> ids;
+
+    {
+        Local_Transaction trans;
+        for (unsigned i = 0;  i < n;  ++i) {
+            objects.push_back(store.construct<int>(i * 10));
+            ids.push_back(objects.back().id());
+            BOOST_REQUIRE_EQUAL(ids.back(), i);
+        }
+        BOOST_REQUIRE(trans.commit());
+    }
+
+    // Read the IDs backwards, so that they're not in order
+    std::reverse(ids.begin(), ids.end());
+
+    vector<int> out(n);
+
+    BOOST_CHECK_THROW(TypedPVO<int>::read_many(objects.begin(),
+                                               objects.end(), &out[0]),
+                      ML::Exception);
+
+    {
+        Read_Only_Transaction snapshot;
+
+        {
+            Local_Transaction trans;
+
+            for (unsigned i = 0;  i < n;  i += 3)
+                objects[i].mutate() += 1;
+
+            // Our own changes are seen
+            TypedPVO<int>::read_many(objects.begin(), objects.end(),
+                                     &out[0]);
+            for (unsigned i = 0;  i < n;  ++i)
+                BOOST_CHECK_EQUAL(out[i], i * 10 + (i % 3 == 0));
+
+            store.read_many(&ids[0], &ids[0] + n, &out[0]);
+            for (unsigned i = 0;  i < n;  ++i)
+                BOOST_CHECK_EQUAL(out[i], objects[ids[i]].read());
+
+            BOOST_REQUIRE(trans.commit());
+        }
+
+        // The snapshot doesn't see the commit
+        TypedPVO<int>::read_many(objects.begin(), objects.end(), &out[0]);
+        for (unsigned i = 0;  i < n;  ++i)
+            BOOST_CHECK_EQUAL(out[i], i * 10);
+
+        store.read_many(&ids[0], &ids[0] + n, &out[0]);
+        for (unsigned i = 0;  i < n;  ++i)
+            BOOST_CHECK_EQUAL(out[i], ids[i] * 10);
+    }
+
+    {
+        Local_Transaction trans;
+
+        TypedPVO<int>::read_many(objects.begin(), objects.end(), &out[0]);
+        for (unsigned i = 0;  i < n;  ++i)
+            BOOST_CHECK_EQUAL(out[i], objects[i].read());
+
+        // A removed object can't be read
+        objects[7].remove();
+        BOOST_CHECK_THROW(TypedPVO<int>::read_many(objects.begin(),
+                                                   objects.end(), &out[0]),
+                          ML::Exception);
+    }
+}
+
 #if 0
 
 size_t counter = 1;
@@ -521,7 +602,7 @@ struct Object_Test_Thread2 {
                     total += store.lookup<Var>(i)->read();
                 
                 if (total != 0) {
-                    ACE_Guard<ACE_Mutex> guard(commit_lock);
+                    ACE_Guard<Adaptive_Lock> guard(commit_lock);
                     cerr << "--------------- total not zero" << endl;
                     snapshot_info.dump();
                     cerr << "total is " << total << endl;
@@ -13,6 +13,7 @@
 #include "serialization.h"
 #include "jml/utils/guard.h"
 #include "jml/arch/demangle.h"
+#include "jml/compiler/compiler.h"
 
 
 namespace JMVCC {
@@ -74,6 +75,9 @@ struct TypedPVO
         else if (!local)
             throw Exception("attempt to access a removed object");
 
+        if (JML_UNLIKELY(conflict_detection_ != DETECT_AT_COMMIT))
+            check_early_conflict();
+
         return *local;
     }
 
@@ -94,7 +98,11 @@ struct TypedPVO
     
     const T & read() const
     {
-        if (!current_trans) no_transaction_exception(this);
+        if (!current_trans) {
+            // A read-only transaction has no local values to look for
+            if (!current_read_only) no_transaction_exception(this);
+            return *vt()->value_at_epoch(current_read_only->epoch());
+        }
 
         bool has_local;
         const T * local;
@@ -103,8 +111,11 @@ struct TypedPVO
             = current_trans->local_value<T>(this);
         
         if (has_local) {
-            if (local) return *local;
-            else throw Exception("attempt to access a removed object");
+            if (!local)
+                throw Exception("attempt to access a removed object");
+            if (JML_UNLIKELY(conflict_detection_ != DETECT_AT_COMMIT))
+                check_early_conflict();
+            return *local;
         }
         
         const VT * d = vt();
@@ -113,6 +124,91 @@ struct TypedPVO
         return *result;
     }
 
+    /** Read the values of a lot of objects at once, as read() would, into
+        out[0] to out[last - first - 1].  The iterator is random access,
+        over pointers to objects, shared_ptrs of them or PVORefs.
+
+        Reading one object is three dependent cache misses (the object,
+        its version table and the value); if we do them one after the
+        other then nearly all of the time is spent waiting for memory.
+        Here we pipeline them instead: at each step, we start loading the
+        object PREFETCH_DISTANCE ahead, start loading the table of the one
+        before that, and so on, so that by the time we get to an object
+        everything that it needs is already in cache.
+    */
+    template<typename Iterator>
+    static void read_many(Iterator first, Iterator last, T * out)
+    {
+        Epoch epoch = 0;
+        if (current_trans) epoch = current_trans->epoch();
+        else if (current_read_only) epoch = current_read_only->epoch();
+        else no_transaction_exception(0);
+
+        // Only look in the sandbox if there is something to find
+        bool check_local = current_trans && current_trans->num_local_values();
+
+        enum {
+            D = PREFETCH_DISTANCE,
+            RING = 4 * D     ///< In flight tables and values; power of two
+        };
+
+        const VT * tables[RING];
+        const T * values[RING];
+
+        int n = last - first;
+
+        for (int i = 0;  i < n + 3 * D;  ++i) {
+
+            // Stage 4: the value is in cache; copy it out
+            int j = i - 3 * D;
+            if (j >= 0)
+                out[j] = *values[j % RING];
+
+            // Stage 3: the table is in cache; find the value and start
+            // loading it
+            j = i - 2 * D;
+            if (j >= 0 && j < n && tables[j % RING]) {
+                const T * value = tables[j % RING]->value_at_epoch(epoch);
+                __builtin_prefetch(value);
+                values[j % RING] = value;
+            }
+
+            // Stage 2: the object is in cache; take its local value if
+            // it has one, or start loading its table
+            j = i - D;
+            if (j >= 0 && j < n) {
+                const TypedPVO * obj = pvo_ptr(first[j]);
+                tables[j % RING] = 0;
+
+                bool has_local = false;
+                const T * local = 0;
+                if (check_local)
+                    boost::tie(local, has_local)
+                        = current_trans->local_value<T>(obj);
+
+                if (has_local) {
+                    if (!local)
+                        throw Exception("attempt to access a removed object");
+                    if (JML_UNLIKELY(conflict_detection_ != DETECT_AT_COMMIT))
+                        obj->check_early_conflict();
+                    values[j % RING] = local;
+                }
+                else {
+                    const VT * d = obj->vt();
+                    d->prefetch();
+                    tables[j % RING] = d;
+                }
+            }
+
+            // Stage 1: start loading the object
+            if (i < n)
+                __builtin_prefetch(&pvo_ptr(first[i])->version_table);
+        }
+    }
+
+    /// How many objects ahead read_many() starts loading each thing
+    enum { PREFETCH_DISTANCE = 8 };
+
     virtual void remove()
     {
         if (!current_trans) no_transaction_exception(this);
@@ -168,6 +264,22 @@ private:
         return vt()->value_at_epoch(epoch);
     }
 
+    // What read_many() can iterate over
+    static const TypedPVO * pvo_ptr(const TypedPVO * obj)
+    {
+        return obj;
+    }
+
+    static const TypedPVO * pvo_ptr(const boost::shared_ptr<TypedPVO> & obj)
+    {
+        return obj.get();
+    }
+
+    static const TypedPVO * pvo_ptr(const PVORef<T, TypedPVO> & ref)
+    {
+        return ref.pvo.get();
+    }
+
     struct ValCleanup {
         ValCleanup(T * val)
             : val(val)
@@ -292,16 +404,83 @@ public:
         return check_commit_possible(vt(), old_epoch, new_epoch);
     }
 
+    // We have a local value; has a newer version been committed since our
+    // snapshot?
+    void check_early_conflict() const
+    {
+        const VT * d = vt();
+
+        Epoch valid_from = 1;
+        if (d->size() > 1)
+            valid_from = d->element(d->size() - 2).valid_to;
+
+        current_trans->check_conflict(this, valid_from);
+    }
+
     void free_setup_data(void * setup_data)
     {
         Serializer<T>::deallocate(setup_data, *store());
     }
 
+    // What prepare() hands to setup(): the new value and where it has been
+    // serialized to.  Neither is published until setup().
+    struct Prepared {
+        T * value;
+        void * setup_data;
+    };
+
+    virtual void * prepare(Epoch old_epoch, void * new_value)
+    {
+        // NOTE: prepare has another job: to make sure that if the parent
+        // object needs to be modified, that it will have a local value and
+        // will therefore be ready to commit.
+
+        if (new_value == 0) {
+            // This object was removed.  Nothing to do.
+            return 0;
+        }
+
+        PVOManager * owner = this->owner();
+        if (owner && (void *)owner != (void *)this) {
+            // A commit of this object will require the owner to be committed
+            // as well.  Here we make sure that this happens.
+            mutate_owner(owner);
+        }
+
+        // The local value will be destroyed no matter what, so we take its
+        // contents if we can rather than copying it.  unprepare() gives them
+        // back.
+        std::auto_ptr<Prepared> result(new Prepared);
+        T & local = *reinterpret_cast<T *>(new_value);
+        std::auto_ptr<T> nv(new_stolen_value(local));
+
+        try {
+            result->setup_data = Serializer<T>::serialize(*nv, *store());
+        } catch (...) {
+            Steal_Value<T>::give_back(*nv, local);
+            throw;
+        }
+        result->value = nv.release();
+        return result.release();
+    }
+
+    virtual void unprepare(void * new_value, void * prepared_data) throw ()
+    {
+        Prepared * prepared = reinterpret_cast<Prepared *>(prepared_data);
+        if (!prepared) return;
+        Steal_Value<T>::give_back(*prepared->value,
+                                  *reinterpret_cast<T *>(new_value));
+        delete prepared->value;
+        free_setup_data(prepared->setup_data);
+        delete prepared;
+    }
+
     virtual void * setup(Epoch old_epoch, Epoch new_epoch, void * new_value)
     {
         // Perform the commit assuming that it's going to go ahead.  We
         // have to:
-        // 1.  Commit the new value to permanent storage;
+        // 1.  Commit the new value to permanent storage (this was done in
+        //     prepare(), before anything was locked);
         // 2.  Set up the new table to point to it;
         // 3.  Swap the new table in place, pointing to both the OLD and the
         //
@@ -394,49 +573,37 @@ public:
         //
         // Again the free is deferred
 
-        // NOTE: setup has another job: to make sure that if the parent ovbject
-        // needs to be modified, that it will have a local value and will
-        // therefore be ready to commit.
-
         if (new_value == 0) {
             // This object was removed.  Nothing to do.
             return (void *)1;
         }
 
-        // TODO: don't copy; steal, since the pointer will be destroyed no
-        // matter what.
-        //using namespace std;
-        //cerr << "setup " << this << type_name(*this) << endl;
-        std::auto_ptr<T> nv(new T(*reinterpret_cast<T *>(new_value)));
-
-        PVOManager * owner = this->owner();
-        if (owner && (void *)owner != (void *)this) {
-            // A commit of this object will require the owner to be committed
-            // as well.  Here we make sure that this happens.
-            mutate_owner(owner);
-        }
-
-        void * setup_data = Serializer<T>::serialize(*nv, *store());
-
-        Call_Guard guard(boost::bind(&TypedPVO<T>::free_setup_data, this,
-                                     setup_data));
+        Prepared * prepared = reinterpret_cast<Prepared *>(new_value);
+        T * nv = prepared->value;
+        void * setup_data = prepared->setup_data;
 
         for (;;) {
             const VT * d = vt();
 
-            if (new_epoch != get_current_epoch() + 1)
+            if (new_epoch <= get_current_epoch())
                 throw Exception("epochs out of order");
             
             if (!check_commit_possible(d, old_epoch, new_epoch))
-                return false;
+                return 0;  // unprepare() will free the value
 
-            VT * new_version_table = d->copy(d->size() + 1);
+            // If there's room, add it to the table that's already there
+            if (const_cast<VT *>(d)->append(new_epoch, nv)) {
+                delete prepared;
+                return setup_data;
+            }
+
+            VT * new_version_table
+                = d->copy(VT::capacity_for_append(d->size() + 1));
             new_version_table->back().valid_to = new_epoch;
-            new_version_table->push_back(1 /* valid_to */, nv.get());
+            new_version_table->push_back(1 /* valid_to */, nv);
             
             if (set_version_table(d, new_version_table)) {
-                nv.release();  // no need to delete it now
-                guard.clear(); // no need to deallocate now
+                delete prepared;  // the table and the commit own the rest
                 return setup_data;
             }
         }
@@ -543,6 +710,9 @@ public:
             if (!result.first)
                 throw Exception("not found");
 
+            // Nothing needed to change
+            if (result.first == d) return result.second;
+
             if (set_version_table(d, result.first)) return result.second;
         }
     }
@@ -568,7 +738,7 @@ public:
         stream << s << "history with " << d->size()
                << " values" << endl;
         for (unsigned i = 0;  i < d->size();  ++i) {
-            const typename VT::Entry & entry = d->element(i);
+            typename VT::Const_Entry_Ref entry = d->element(i);
             stream << s << "  " << i << ": valid to "
                    << entry.valid_to;
             stream << " addr " <<  entry.value;